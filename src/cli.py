@@ -326,6 +326,18 @@ class CLIHandler:
             help="Screen name (optional)",
         )
 
+        systray_trace_parser = subparsers.add_parser(
+            "systray-trace",
+            help="Record the tray icon traffic of the systray hook to a trace file",
+            prog="yasbc systray-trace",
+        )
+        systray_trace_parser.add_argument(
+            "action",
+            type=str,
+            choices=["start", "stop"],
+            help="Start a new trace in the config directory or stop the current one",
+        )
+
         # Channel management
         set_channel_parser = subparsers.add_parser(
             "set-channel",
@@ -443,6 +455,10 @@ class CLIHandler:
             self.send_command_to_application(f"toggle-bar{screen_arg}")
             sys.exit(0)
 
+        elif args.command == "systray-trace":
+            self.send_command_to_application(f"systray-trace {args.action}")
+            sys.exit(0)
+
         elif args.command == "set-channel":
             self.channel_handler.switch_channel(args.target_channel)
             sys.exit(0)
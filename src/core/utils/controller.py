@@ -83,6 +83,9 @@ def process_cli_command(command: str):
         action = base_command.split("-")[0]
         EventService().emit_event("handle_bar_cli", action, screen_name)
 
+    elif base_command == "systray-trace":
+        EventService().emit_event("systray_trace", parts[1] if len(parts) > 1 else "")
+
 
 def start_cli_server():
     handler = CliPipeHandler(process_cli_command)
@@ -0,0 +1,69 @@
+#pragma once
+
+// Fixed-size block pool for the hook's outgoing frames, see AllocFrameBlock in trayhook.cpp.
+// Free of Windows headers, tests/test_frame_slab.cpp covers it. Not thread-safe, the caller serializes.
+//
+// A slab carves one caller-provided region into blocks of a single size and threads the free ones on an
+// intrusive list, so taking and returning a block is a pointer swap. Blocks come back in LIFO order and the
+// next frame reuses the one that was just written, while it is still in cache.
+
+#include <cstddef>
+#include <cstdint>
+
+class FrameSlab {
+  public:
+    // Bytes of region needed for count blocks of blockSize
+    static size_t RegionSize(uint32_t blockSize, uint32_t count) { return (size_t)blockSize * count; }
+
+    // blockSize must be a multiple of 8, region must be 8-byte aligned and hold RegionSize(blockSize, count)
+    void Init(uint8_t *region, uint32_t blockSize, uint32_t count) {
+        m_region = region;
+        m_blockSize = blockSize;
+        m_count = count;
+        m_free = nullptr;
+        m_inUse = 0;
+        for (uint32_t i = count; i > 0; i--) {
+            FreeBlock *block = (FreeBlock *)(region + (size_t)(i - 1) * blockSize);
+            block->next = m_free;
+            m_free = block;
+        }
+    }
+
+    bool IsInitialized() const { return m_region != nullptr; }
+    uint32_t BlockSize() const { return m_blockSize; }
+    uint32_t InUse() const { return m_inUse; }
+
+    bool Owns(const void *block) const {
+        const uint8_t *bytes = (const uint8_t *)block;
+        return m_region && bytes >= m_region && bytes < m_region + RegionSize(m_blockSize, m_count);
+    }
+
+    // A free block, or nullptr when every block is taken
+    uint8_t *Alloc() {
+        FreeBlock *block = m_free;
+        if (!block)
+            return nullptr;
+        m_free = block->next;
+        m_inUse++;
+        return (uint8_t *)block;
+    }
+
+    // Returns a block from Alloc, Owns(block) must be true
+    void Free(void *block) {
+        FreeBlock *freed = (FreeBlock *)block;
+        freed->next = m_free;
+        m_free = freed;
+        m_inUse--;
+    }
+
+  private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    uint8_t *m_region = nullptr;
+    uint32_t m_blockSize = 0;
+    uint32_t m_count = 0;
+    FreeBlock *m_free = nullptr;
+    uint32_t m_inUse = 0;
+};
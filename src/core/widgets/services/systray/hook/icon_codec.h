@@ -0,0 +1,132 @@
+#pragma once
+
+// Span coding of icon pixels for TRAY_CAP_SPAN_CODEC, mirrored by decode_icon_spans in tray_protocol.py,
+// and tile deltas for TRAY_CAP_ICON_DELTA, mirrored by apply_icon_tiles.
+// Free of Windows headers, tests/test_icon_codec.cpp round-trips both codings on any platform.
+//
+// Icons are mostly fully transparent pixels, which are all-zero once premultiplied. The pixels are read as one
+// row-major run and coded as TrayIconSpan headers, each followed by `literals` raw pixels. Zero pixels after the
+// last literal are implied, the decoder starts from a zeroed bitmap. Coded pixels are only sent when they are
+// smaller than the raw ones, so a receiver tells the two apart by size alone.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "tray_protocol.h"
+
+#define ICON_SPAN_MAX_RUN 0xFFFF
+#define ICON_DELTA_TILE_SIZE 8
+
+// Writes the spans of count pixels to out, or only measures them when out is nullptr. Returns the coded size.
+inline size_t WriteIconSpans(const uint8_t *pixels, size_t count, uint8_t *out) {
+    size_t size = 0;
+    size_t i = 0;
+    while (i < count) {
+        size_t zeros = 0;
+        uint32_t pixel;
+        while (i + zeros < count && zeros < ICON_SPAN_MAX_RUN) {
+            memcpy(&pixel, pixels + (i + zeros) * 4, 4);
+            if (pixel != 0)
+                break;
+            zeros++;
+        }
+        size_t literals = 0;
+        while (i + zeros + literals < count && literals < ICON_SPAN_MAX_RUN) {
+            memcpy(&pixel, pixels + (i + zeros + literals) * 4, 4);
+            if (pixel == 0)
+                break;
+            literals++;
+        }
+        if (literals == 0 && i + zeros == count)
+            break; // trailing transparency is implied
+        if (out) {
+            TrayIconSpan span = {(uint16_t)zeros, (uint16_t)literals};
+            memcpy(out + size, &span, sizeof(span));
+            memcpy(out + size + sizeof(span), pixels + (i + zeros) * 4, literals * 4);
+        }
+        size += sizeof(TrayIconSpan) + literals * 4;
+        i += zeros + literals;
+    }
+    return size;
+}
+
+// Expands coded pixels into count zeroed pixels, returns false if the spans are malformed
+inline bool DecodeIconSpans(const uint8_t *data, size_t size, uint8_t *pixels, size_t count) {
+    size_t offset = 0;
+    size_t i = 0;
+    while (offset < size) {
+        if (size - offset < sizeof(TrayIconSpan))
+            return false;
+        TrayIconSpan span;
+        memcpy(&span, data + offset, sizeof(span));
+        offset += sizeof(span);
+        if (count - i < (size_t)span.zeros + span.literals || size - offset < (size_t)span.literals * 4)
+            return false;
+        i += span.zeros;
+        memcpy(pixels + i * 4, data + offset, (size_t)span.literals * 4);
+        i += span.literals;
+        offset += (size_t)span.literals * 4;
+    }
+    return true;
+}
+
+// Writes a TrayIconTile and the pixels of every tile of current that differs from previous, both width x height
+// RGBA. Only measures when out is nullptr. Returns the size, 0 when nothing changed.
+inline size_t WriteIconTiles(const uint8_t *previous, const uint8_t *current, uint32_t width, uint32_t height,
+                             uint8_t *out) {
+    const size_t stride = (size_t)width * 4;
+    size_t size = 0;
+    for (uint32_t top = 0; top < height; top += ICON_DELTA_TILE_SIZE) {
+        uint32_t rows = height - top < ICON_DELTA_TILE_SIZE ? height - top : ICON_DELTA_TILE_SIZE;
+        for (uint32_t left = 0; left < width; left += ICON_DELTA_TILE_SIZE) {
+            uint32_t columns = width - left < ICON_DELTA_TILE_SIZE ? width - left : ICON_DELTA_TILE_SIZE;
+            size_t offset = top * stride + left * 4;
+            size_t rowBytes = columns * 4;
+            bool dirty = false;
+            for (uint32_t row = 0; row < rows && !dirty; row++) {
+                dirty = memcmp(previous + offset + row * stride, current + offset + row * stride, rowBytes) != 0;
+            }
+            if (!dirty)
+                continue;
+            if (out) {
+                TrayIconTile tile = {(uint16_t)(left / ICON_DELTA_TILE_SIZE), (uint16_t)(top / ICON_DELTA_TILE_SIZE)};
+                uint8_t *cursor = out + size;
+                memcpy(cursor, &tile, sizeof(tile));
+                cursor += sizeof(tile);
+                for (uint32_t row = 0; row < rows; row++, cursor += rowBytes) {
+                    memcpy(cursor, current + offset + row * stride, rowBytes);
+                }
+            }
+            size += sizeof(TrayIconTile) + rows * rowBytes;
+        }
+    }
+    return size;
+}
+
+// Applies size bytes of tiles written by WriteIconTiles to a width x height RGBA image, false if malformed
+inline bool ApplyIconTiles(uint8_t *pixels, uint32_t width, uint32_t height, uint32_t tileSize, const uint8_t *data,
+                           size_t size) {
+    const size_t stride = (size_t)width * 4;
+    size_t offset = 0;
+    while (offset < size) {
+        if (size - offset < sizeof(TrayIconTile))
+            return false;
+        TrayIconTile tile;
+        memcpy(&tile, data + offset, sizeof(tile));
+        offset += sizeof(tile);
+        uint32_t left = (uint32_t)tile.x * tileSize;
+        uint32_t top = (uint32_t)tile.y * tileSize;
+        if (left >= width || top >= height)
+            return false;
+        uint32_t rows = height - top < tileSize ? height - top : tileSize;
+        uint32_t columns = width - left < tileSize ? width - left : tileSize;
+        size_t rowBytes = columns * 4;
+        if (size - offset < rows * rowBytes)
+            return false;
+        for (uint32_t row = 0; row < rows; row++, offset += rowBytes) {
+            memcpy(pixels + (top + row) * stride + left * 4, data + offset, rowBytes);
+        }
+    }
+    return true;
+}
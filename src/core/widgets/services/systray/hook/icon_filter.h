@@ -0,0 +1,105 @@
+#pragma once
+
+// The icons of a TRAY_MSG_FILTER, matched by GUID, hWnd/uID or the image name of the owning process.
+// Free of Windows headers, trayhook.cpp resolves image names and keeps one per connection on the writer thread.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "tray_protocol.h"
+
+class TrayIconFilter {
+  public:
+    // Replaces the filter with the payload of a TRAY_MSG_FILTER frame, header included.
+    // A malformed payload clears the filter and returns false.
+    bool Load(const uint8_t *data, size_t size) {
+        Clear();
+        TrayFilterMessage msg;
+        if (size < sizeof(msg))
+            return false;
+        memcpy(&msg, data, sizeof(msg));
+        size_t offset = sizeof(msg);
+        if ((size - offset) / sizeof(TrayGuid) < msg.guidCount)
+            return Reject();
+        for (uint32_t i = 0; i < msg.guidCount; i++, offset += sizeof(TrayGuid)) {
+            if (m_guidCount < TRAY_FILTER_MAX_GUIDS)
+                memcpy(&m_guids[m_guidCount++], data + offset, sizeof(TrayGuid));
+        }
+        if ((size - offset) / sizeof(TrayFilterIcon) < msg.iconCount)
+            return Reject();
+        for (uint32_t i = 0; i < msg.iconCount; i++, offset += sizeof(TrayFilterIcon)) {
+            if (m_iconCount < TRAY_FILTER_MAX_ICONS)
+                memcpy(&m_icons[m_iconCount++], data + offset, sizeof(TrayFilterIcon));
+        }
+        for (uint32_t i = 0; i < msg.exeCount; i++) {
+            uint16_t count;
+            if (size - offset < sizeof(count))
+                return Reject();
+            memcpy(&count, data + offset, sizeof(count));
+            offset += sizeof(count);
+            if ((size - offset) / sizeof(uint16_t) < count)
+                return Reject();
+            // A longer name cannot match anything GetTrayIconExe returns
+            if (count > 0 && count < TRAY_FILTER_MAX_EXE_LENGTH && m_exeCount < TRAY_FILTER_MAX_EXES) {
+                uint16_t *exe = m_exes[m_exeCount++];
+                memcpy(exe, data + offset, (size_t)count * sizeof(uint16_t));
+                exe[count] = 0;
+            }
+            offset += (size_t)count * sizeof(uint16_t);
+        }
+        return offset == size || Reject();
+    }
+
+    void Clear() {
+        m_guidCount = 0;
+        m_iconCount = 0;
+        m_exeCount = 0;
+        m_generation++;
+    }
+
+    bool IsEmpty() const { return m_guidCount == 0 && m_iconCount == 0 && m_exeCount == 0; }
+
+    // True when matching needs the image name of the icon's process
+    bool HasExes() const { return m_exeCount > 0; }
+
+    // Bumped whenever the filter changes, so callers can cache their matches
+    uint32_t Generation() const { return m_generation; }
+
+    // guid is NULL for icons without one, exe the NUL-terminated lower case image name or NULL if unknown
+    bool Matches(uint32_t hWnd, uint32_t uID, const TrayGuid *guid, const uint16_t *exe) const {
+        for (uint32_t i = 0; guid && i < m_guidCount; i++) {
+            if (memcmp(&m_guids[i], guid, sizeof(TrayGuid)) == 0)
+                return true;
+        }
+        for (uint32_t i = 0; i < m_iconCount; i++) {
+            if (m_icons[i].hWnd == hWnd && m_icons[i].uID == uID)
+                return true;
+        }
+        for (uint32_t i = 0; exe && i < m_exeCount; i++) {
+            const uint16_t *a = m_exes[i];
+            const uint16_t *b = exe;
+            while (*a && *a == *b) {
+                a++;
+                b++;
+            }
+            if (*a == *b)
+                return true;
+        }
+        return false;
+    }
+
+  private:
+    bool Reject() {
+        Clear();
+        return false;
+    }
+
+    TrayGuid m_guids[TRAY_FILTER_MAX_GUIDS];
+    TrayFilterIcon m_icons[TRAY_FILTER_MAX_ICONS];
+    uint16_t m_exes[TRAY_FILTER_MAX_EXES][TRAY_FILTER_MAX_EXE_LENGTH];
+    uint32_t m_guidCount = 0;
+    uint32_t m_iconCount = 0;
+    uint32_t m_exeCount = 0;
+    uint32_t m_generation = 0;
+};
@@ -0,0 +1,258 @@
+#include "icon_pipeline.h"
+
+#include <cstring>
+
+#include "icon_codec.h"
+#include "pixel_kernels.h"
+
+bool IsSameTrayIcon(const NOTIFYICONDATA32 *a, const NOTIFYICONDATA32 *b) {
+    if ((a->uFlags & TRAY_NIF_GUID) && (b->uFlags & TRAY_NIF_GUID))
+        return memcmp(&a->guidItem, &b->guidItem, sizeof(TrayGuid)) == 0;
+    return a->hWnd == b->hWnd && a->uID == b->uID;
+}
+
+TrayIconKey MakeTrayIconKey(const NOTIFYICONDATA32 *nid) {
+    TrayIconKey key = {};
+    key.hWnd = nid->hWnd;
+    key.uID = nid->uID;
+    key.hasGuid = (nid->uFlags & TRAY_NIF_GUID) != 0;
+    if (key.hasGuid)
+        key.guidItem = nid->guidItem;
+    return key;
+}
+
+bool MatchesTrayIconKey(const TrayIconKey *key, const NOTIFYICONDATA32 *nid) {
+    if (key->hasGuid && (nid->uFlags & TRAY_NIF_GUID))
+        return memcmp(&key->guidItem, &nid->guidItem, sizeof(TrayGuid)) == 0;
+    return key->hWnd == nid->hWnd && key->uID == nid->uID;
+}
+
+uint64_t HashIconPixels(const uint8_t *data, uint32_t size, uint32_t width, uint32_t height) {
+    const uint64_t k1 = 0x9E3779B97F4A7C15ULL;
+    const uint64_t k2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t h = ((uint64_t)width << 32 | height) * k1 ^ size;
+
+    uint32_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h ^= word * k2;
+        h = ((h << 31) | (h >> 33)) * k1;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * k1;
+    }
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+// Span codes the pixels when the host can decode them and it saves bytes, sets image.size accordingly
+static void PlanPixelCoding(IconImagePlan *plan, uint32_t capabilities) {
+    uint32_t rawSize = (uint32_t)plan->image.width * plan->image.height * 4;
+    plan->image.size = rawSize;
+    plan->spanCoded = false;
+    if (capabilities & TRAY_CAP_SPAN_CODEC) {
+        size_t codedSize = WriteIconSpans(plan->pixels, (size_t)plan->image.width * plan->image.height, NULL);
+        if (codedSize < rawSize) {
+            plan->image.size = (uint32_t)codedSize;
+            plan->spanCoded = true;
+        }
+    }
+}
+
+static uint8_t *WriteIconPixels(uint8_t *out, const IconImagePlan *plan) {
+    if (plan->spanCoded) {
+        WriteIconSpans(plan->pixels, (size_t)plan->image.width * plan->image.height, out);
+    } else {
+        memcpy(out, plan->pixels, plan->image.size);
+    }
+    return out + plan->image.size;
+}
+
+// Plans the mip set sent for a premultiplied width x height icon, largest first: one image per host size, never
+// upscaled. Every mip is filtered from the icon itself rather than from the next larger one, and all of them
+// together fit the scratch space, which bounds the frame size.
+static uint32_t PlanIconImages(const uint8_t *pixels, uint32_t width, uint32_t height,
+                               const IconPipelineConfig *config, IconImagePlan *plans) {
+    uint32_t longest = width > height ? width : height;
+    uint32_t budget = config->scratchSize;
+    uint8_t *scratch = config->scratch;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < config->iconSizeCount; i++) {
+        uint32_t target = config->iconSizes[i] < longest ? config->iconSizes[i] : longest;
+        uint32_t scaledWidth = (width * target + longest / 2) / longest;
+        uint32_t scaledHeight = (height * target + longest / 2) / longest;
+        IconImagePlan *plan = &plans[count];
+        plan->image.width = (uint16_t)(scaledWidth ? scaledWidth : 1);
+        plan->image.height = (uint16_t)(scaledHeight ? scaledHeight : 1);
+        if (count > 0 && plans[count - 1].image.width == plan->image.width &&
+            plans[count - 1].image.height == plan->image.height)
+            continue;
+        uint32_t rawSize = (uint32_t)plan->image.width * plan->image.height * 4;
+        if (rawSize > budget)
+            continue;
+        budget -= rawSize;
+        if (plan->image.width == width && plan->image.height == height) {
+            plan->pixels = pixels;
+        } else {
+            DownscaleIconPixels(pixels, width, height, scratch, plan->image.width, plan->image.height);
+            plan->pixels = scratch;
+            scratch += rawSize;
+        }
+        PlanPixelCoding(plan, config->capabilities);
+        count++;
+    }
+    return count;
+}
+
+// Size of a TRAY_MSG_ICON_DELTA from the images the host has to the planned ones, 0 when a full frame is due
+static uint32_t PlanIconDelta(const SentIcon *sent, const IconPipelineConfig *config, const IconImagePlan *plans,
+                              uint32_t imageCount) {
+    if (!(config->capabilities & TRAY_CAP_ICON_DELTA) || !sent->pixels || sent->generation != config->generation ||
+        sent->deltaCount >= ICON_DELTA_KEYFRAME_INTERVAL || sent->imageCount == 0 || sent->imageCount != imageCount)
+        return 0;
+    uint32_t size = sizeof(TrayIconDelta);
+    const uint8_t *previous = sent->pixels;
+    for (uint32_t i = 0; i < imageCount; i++) {
+        const TrayIconImage *image = &plans[i].image;
+        if (sent->images[i].width != image->width || sent->images[i].height != image->height)
+            return 0;
+        size += sizeof(TrayIconImage) +
+                (uint32_t)WriteIconTiles(previous, plans[i].pixels, image->width, image->height, NULL);
+        previous += (size_t)image->width * image->height * 4;
+    }
+    return size;
+}
+
+static uint8_t *WriteIconDelta(uint8_t *out, const SentIcon *sent, const IconImagePlan *plans, uint32_t imageCount) {
+    TrayIconDelta delta = {sent->iconHash, ICON_DELTA_TILE_SIZE, (uint16_t)imageCount};
+    memcpy(out, &delta, sizeof(delta));
+    out += sizeof(delta);
+    const uint8_t *previous = sent->pixels;
+    for (uint32_t i = 0; i < imageCount; i++) {
+        TrayIconImage image = plans[i].image;
+        uint8_t *tiles = out + sizeof(TrayIconImage);
+        image.size = (uint32_t)WriteIconTiles(previous, plans[i].pixels, image.width, image.height, tiles);
+        memcpy(out, &image, sizeof(image));
+        out = tiles + image.size;
+        previous += (size_t)image.width * image.height * 4;
+    }
+    return out;
+}
+
+uint32_t PlanTrayEventFrame(TrayEventFrame *frame, const IconPipelineConfig *config, uint64_t dwData, uint32_t cbData,
+                            const SHELLTRAYDATA *trayData, uint8_t *iconRGBA, uint32_t iconSize, uint32_t iconWidth,
+                            uint32_t iconHeight, const SentIcon *sent) {
+    uint32_t capabilities = config->capabilities;
+    frame->kind = TRAY_MSG_TRAY_EVENT;
+    frame->trayData = trayData;
+    frame->deltaBase = NULL;
+    frame->imageCount = 0;
+
+    uint64_t iconHash = 0;
+    if (iconSize > 0) {
+        iconHash = HashIconPixels(iconRGBA, iconSize, iconWidth, iconHeight);
+        if ((capabilities & TRAY_CAP_ICON_REF) && sent && CheckIconHash(sent, iconHash, config->generation)) {
+            // Pixels unchanged (tooltip or state update), the host resolves the hash from its cache
+            frame->kind = TRAY_MSG_ICON_REF;
+            iconSize = 0;
+        }
+    }
+
+    // The host only draws small icons, send those instead of up to 256x256 pixels it would throw away
+    frame->scaled = iconSize > 0 && (capabilities & TRAY_CAP_SCALED_ICONS);
+    if (frame->scaled) {
+        PremultiplyIconPixels(iconRGBA, (size_t)iconWidth * iconHeight);
+        frame->imageCount = PlanIconImages(iconRGBA, iconWidth, iconHeight, config, frame->plans);
+        iconSize = 0;
+        for (uint32_t i = 0; i < frame->imageCount; i++) {
+            iconSize += sizeof(TrayIconImage) + frame->plans[i].image.size;
+        }
+        // Animated icons change a few tiles per frame, send only those when it is smaller
+        uint32_t deltaSize = sent ? PlanIconDelta(sent, config, frame->plans, frame->imageCount) : 0;
+        if (deltaSize > 0 && deltaSize < iconSize) {
+            frame->kind = TRAY_MSG_ICON_DELTA;
+            frame->deltaBase = sent;
+            iconSize = deltaSize;
+        }
+    } else if (iconSize > 0) {
+        frame->plans[0].image.width = (uint16_t)iconWidth;
+        frame->plans[0].image.height = (uint16_t)iconHeight;
+        frame->plans[0].pixels = iconRGBA;
+        PlanPixelCoding(&frame->plans[0], capabilities);
+        frame->imageCount = 1;
+        iconSize = frame->plans[0].image.size;
+    }
+
+    // With the compact encoding only the fields the NIF_* flags name go out, usually a few dozen bytes
+    frame->compact = cbData > 0 && (capabilities & TRAY_CAP_COMPACT_NID);
+    frame->msg = {};
+    frame->msg.dwData = dwData;
+    frame->msg.cbData = frame->compact ? (uint32_t)TrayWriteCompactTrayData(trayData, NULL) : cbData;
+    frame->msg.iconWidth = iconWidth;
+    frame->msg.iconHeight = iconHeight;
+    frame->msg.iconDataSize = iconSize;
+    frame->msg.iconHash = iconHash;
+    return sizeof(frame->msg) + frame->msg.cbData + frame->msg.iconDataSize;
+}
+
+void WriteTrayEventFrame(uint8_t *out, const TrayEventFrame *frame) {
+    memcpy(out, &frame->msg, sizeof(frame->msg));
+    out += sizeof(frame->msg);
+    if (frame->compact) {
+        TrayWriteCompactTrayData(frame->trayData, out);
+    } else if (frame->msg.cbData > 0) {
+        memcpy(out, frame->trayData, frame->msg.cbData);
+    }
+    out += frame->msg.cbData;
+    if (frame->kind == TRAY_MSG_ICON_DELTA) {
+        WriteIconDelta(out, frame->deltaBase, frame->plans, frame->imageCount);
+        return;
+    }
+    for (uint32_t i = 0; i < frame->imageCount; i++) {
+        if (frame->scaled) {
+            memcpy(out, &frame->plans[i].image, sizeof(TrayIconImage));
+            out += sizeof(TrayIconImage);
+        }
+        out = WriteIconPixels(out, &frame->plans[i]);
+    }
+}
+
+uint32_t SentIconBaseSize(const TrayEventFrame *frame, const IconPipelineConfig *config) {
+    if (!(config->capabilities & TRAY_CAP_ICON_DELTA) || !frame->scaled)
+        return 0;
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < frame->imageCount; i++) {
+        size += (uint32_t)frame->plans[i].image.width * frame->plans[i].image.height * 4;
+    }
+    return size <= ICON_DELTA_MAX_BYTES ? size : 0;
+}
+
+void StoreSentIcon(SentIcon *sent, const TrayEventFrame *frame, const IconPipelineConfig *config) {
+    uint32_t deltaCount = frame->kind == TRAY_MSG_ICON_DELTA ? sent->deltaCount + 1 : 0;
+    uint32_t size = SentIconBaseSize(frame, config);
+    // Animated icons keep their sizes frame after frame, the previous base is overwritten in place
+    uint8_t *pixels = sent->pixels;
+    uint32_t capacity = sent->capacity;
+    *sent = {};
+    sent->iconHash = frame->msg.iconHash;
+    sent->generation = config->generation;
+    sent->pixels = pixels;
+    sent->capacity = capacity;
+    if (!pixels || size == 0 || capacity < size)
+        return;
+    uint8_t *cursor = pixels;
+    for (uint32_t i = 0; i < frame->imageCount; i++) {
+        sent->images[i] = frame->plans[i].image;
+        uint32_t imageSize = (uint32_t)frame->plans[i].image.width * frame->plans[i].image.height * 4;
+        memcpy(cursor, frame->plans[i].pixels, imageSize);
+        cursor += imageSize;
+    }
+    sent->imageCount = frame->imageCount;
+    sent->deltaCount = deltaCount;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+// Per-event pipeline of the hook between icon extraction and the transport: tray icon identity, pixel hashing,
+// mip planning, pixel coding, icon deltas and the TRAY_MSG_TRAY_EVENT payload.
+// Free of Windows headers so it builds into YASBTrayHookCore, which trayhook.cpp and trayhook_bench.cpp share.
+// Nothing here allocates, every buffer belongs to the caller.
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tray_protocol.h"
+
+#define ICON_DELTA_MAX_BYTES (64 * 1024) // largest scaled icon kept as a delta base
+#define ICON_DELTA_KEYFRAME_INTERVAL 30  // full frame after this many deltas, heals a host that lost the base
+
+bool IsSameTrayIcon(const NOTIFYICONDATA32 *a, const NOTIFYICONDATA32 *b);
+
+// Identity of a tray icon: the GUID when the app registered one, hWnd/uID otherwise
+struct TrayIconKey {
+    uint32_t hWnd;
+    uint32_t uID;
+    TrayGuid guidItem;
+    bool hasGuid;
+};
+
+TrayIconKey MakeTrayIconKey(const NOTIFYICONDATA32 *nid);
+bool MatchesTrayIconKey(const TrayIconKey *key, const NOTIFYICONDATA32 *nid);
+
+// Fast 64-bit content hash of an RGBA bitmap, 8 bytes per step with a murmur-style finalizer.
+// Never returns 0, which TrayEventMessage.iconHash reserves for "no icon".
+uint64_t HashIconPixels(const uint8_t *data, uint32_t size, uint32_t width, uint32_t height);
+
+// What the host negotiated for the current pipe connection, and where mips are filtered to
+struct IconPipelineConfig {
+    uint32_t capabilities;     // TRAY_CAP_* accepted in the host's TRAY_MSG_HELLO_ACK
+    int32_t generation;        // pipe connection the frames go to
+    const uint16_t *iconSizes; // TRAY_CAP_SCALED_ICONS sizes, largest first
+    uint32_t iconSizeCount;
+    uint8_t *scratch; // mip storage, the mips of one icon never need more than scratchSize bytes
+    uint32_t scratchSize;
+};
+
+// What the host was last sent for an icon, only valid on pipe connection `generation`
+struct SentIcon {
+    uint64_t iconHash; // 0 = none
+    int32_t generation;
+    uint8_t *pixels; // premultiplied images of the last full or delta frame, base of the next TRAY_MSG_ICON_DELTA
+    uint32_t imageCount;
+    TrayIconImage images[TRAY_MAX_ICON_SIZES]; // width and height of the images in pixels
+    uint32_t deltaCount;                       // deltas since the last full frame
+    uint32_t capacity;                         // bytes allocated at pixels, reused by the next frame
+};
+
+// True if the host already has the pixels with this hash for the icon.
+// A new connection may be a restarted host that lost its cache.
+inline bool CheckIconHash(const SentIcon *sent, uint64_t hash, int32_t generation) {
+    return sent->iconHash == hash && sent->generation == generation;
+}
+
+// Pixels of one icon image as they go out
+struct IconImagePlan {
+    TrayIconImage image;   // image.size is the byte count on the wire
+    const uint8_t *pixels; // raw RGBA, the icon itself or one of its mips in the scratch space
+    bool spanCoded;
+};
+
+// One tray event frame, planned before its buffer is allocated
+struct TrayEventFrame {
+    TrayEventMessage msg; // header left for the caller, it knows the sequence
+    uint16_t kind;        // TRAY_MSG_TRAY_EVENT, TRAY_MSG_ICON_REF or TRAY_MSG_ICON_DELTA
+    bool compact;         // payload in the TRAY_CAP_COMPACT_NID encoding
+    bool scaled;          // icon as TrayIconImage mips
+    const SHELLTRAYDATA *trayData;
+    const SentIcon *deltaBase; // images a TRAY_MSG_ICON_DELTA is relative to
+    uint32_t imageCount;
+    IconImagePlan plans[TRAY_MAX_ICON_SIZES];
+};
+
+// Plans the frame of a tray event carrying iconSize bytes of straight width x height RGBA, or no icon.
+// sent is what the host last got for this icon, NULL for icons not in the table. Scaled icons are premultiplied
+// in place. Returns the frame length for TrayInitFrameHeader and WriteTrayEventFrame.
+uint32_t PlanTrayEventFrame(TrayEventFrame *frame, const IconPipelineConfig *config, uint64_t dwData, uint32_t cbData,
+                            const SHELLTRAYDATA *trayData, uint8_t *iconRGBA, uint32_t iconSize, uint32_t iconWidth,
+                            uint32_t iconHeight, const SentIcon *sent);
+
+// Writes a planned frame, header included, to out
+void WriteTrayEventFrame(uint8_t *out, const TrayEventFrame *frame);
+
+// Bytes of the delta base RememberSentIcon should hold after frame went out, 0 when none is worth keeping
+uint32_t SentIconBaseSize(const TrayEventFrame *frame, const IconPipelineConfig *config);
+
+// Records what frame carried in sent. sent->pixels must hold SentIconBaseSize bytes, or be NULL to keep only the hash.
+void StoreSentIcon(SentIcon *sent, const TrayEventFrame *frame, const IconPipelineConfig *config);
@@ -0,0 +1,43 @@
+#pragma once
+
+// Recorder behind the TRAY_MSG_METRICS histograms, see RecordStageLatency in trayhook.cpp.
+// Free of Windows headers, tests/test_latency_histogram.cpp hammers it from several threads on any platform.
+//
+// Recording is a few relaxed atomic adds and never takes a lock, so it is safe on Explorer's tray UI thread
+// while the writer thread reads the same histogram. A snapshot taken during a recording may be a sample short
+// in one of its fields, which does not matter for percentiles.
+
+#include <atomic>
+#include <cstdint>
+
+#include "tray_protocol.h"
+
+class LatencyHistogram {
+  public:
+    void Record(uint64_t ns) {
+        m_buckets[TrayHistogramBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_totalNs.fetch_add(ns, std::memory_order_relaxed);
+        uint32_t clamped = ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+        uint32_t max = m_maxNs.load(std::memory_order_relaxed);
+        while (clamped > max && !m_maxNs.compare_exchange_weak(max, clamped, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint32_t Count() const { return m_count.load(std::memory_order_relaxed); }
+
+    void Snapshot(TrayStageHistogram *out) const {
+        out->count = m_count.load(std::memory_order_relaxed);
+        out->maxNs = m_maxNs.load(std::memory_order_relaxed);
+        out->totalNs = m_totalNs.load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < TRAY_HISTOGRAM_BUCKETS; i++) {
+            out->buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+  private:
+    std::atomic<uint32_t> m_count{0};
+    std::atomic<uint32_t> m_maxNs{0};
+    std::atomic<uint64_t> m_totalNs{0};
+    std::atomic<uint32_t> m_buckets[TRAY_HISTOGRAM_BUCKETS] = {};
+};
@@ -0,0 +1,277 @@
+#include "pixel_kernels.h"
+
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define PIXEL_KERNELS_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define PIXEL_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and clang only emit AVX2 instructions in functions that ask for them, MSVC emits any intrinsic
+#if defined(__GNUC__) || defined(__clang__)
+#define PIXEL_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PIXEL_TARGET_AVX2
+#endif
+
+bool SwizzleIconPixelsScalar(uint8_t *pixels, size_t count) {
+    uint8_t alpha = 0;
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        uint8_t b = pixels[0];
+        pixels[0] = pixels[2];
+        pixels[2] = b;
+        alpha |= pixels[3];
+    }
+    return alpha != 0;
+}
+
+void ApplyIconMaskScalar(uint8_t *pixels, const uint8_t *mask, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        pixels[i * 4 + 3] = (mask && mask[i * 4] == 255) ? 0 : 255;
+    }
+}
+
+#ifdef PIXEL_KERNELS_X64
+// SSE2 has no byte shuffle: B and R are the 0x00FF00FF bytes of each pixel, rotating them by 16 bits swaps them
+static bool SwizzleIconPixelsSse2(uint8_t *pixels, size_t count) {
+    const __m128i rbMask = _mm_set1_epi32(0x00FF00FF);
+    __m128i alpha = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i *p = (__m128i *)(pixels + i * 4);
+        __m128i v = _mm_loadu_si128(p);
+        __m128i rb = _mm_and_si128(v, rbMask);
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        _mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(rbMask, v), rb));
+        alpha = _mm_or_si128(alpha, v);
+    }
+    bool hasAlpha = (_mm_movemask_epi8(_mm_cmpeq_epi8(alpha, _mm_setzero_si128())) & 0x8888) != 0x8888;
+    return SwizzleIconPixelsScalar(pixels + i * 4, count - i) || hasAlpha;
+}
+
+static void ApplyIconMaskSse2(uint8_t *pixels, const uint8_t *mask, size_t count) {
+    const __m128i low = _mm_set1_epi32(0xFF);
+    const __m128i color = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i *p = (__m128i *)(pixels + i * 4);
+        __m128i m = _mm_and_si128(_mm_loadu_si128((const __m128i *)(mask + i * 4)), low);
+        __m128i alpha = _mm_andnot_si128(_mm_cmpeq_epi32(m, low), opaque);
+        _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(p), color), alpha));
+    }
+    ApplyIconMaskScalar(pixels + i * 4, mask + i * 4, count - i);
+}
+
+PIXEL_TARGET_AVX2 static bool SwizzleIconPixelsAvx2(uint8_t *pixels, size_t count) {
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5, 4,
+                                             7, 10, 9, 8, 11, 14, 13, 12, 15);
+    __m256i alpha = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i *p = (__m256i *)(pixels + i * 4);
+        __m256i v = _mm256_loadu_si256(p);
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(v, shuffle));
+        alpha = _mm256_or_si256(alpha, v);
+    }
+    unsigned zero = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(alpha, _mm256_setzero_si256()));
+    bool hasAlpha = (zero & 0x88888888u) != 0x88888888u;
+    return SwizzleIconPixelsScalar(pixels + i * 4, count - i) || hasAlpha;
+}
+
+PIXEL_TARGET_AVX2 static void ApplyIconMaskAvx2(uint8_t *pixels, const uint8_t *mask, size_t count) {
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    const __m256i color = _mm256_set1_epi32(0x00FFFFFF);
+    const __m256i opaque = _mm256_set1_epi32((int)0xFF000000);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i *p = (__m256i *)(pixels + i * 4);
+        __m256i m = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(mask + i * 4)), low);
+        __m256i alpha = _mm256_andnot_si256(_mm256_cmpeq_epi32(m, low), opaque);
+        _mm256_storeu_si256(p, _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(p), color), alpha));
+    }
+    ApplyIconMaskScalar(pixels + i * 4, mask + i * 4, count - i);
+}
+
+// AVX2 needs the CPU feature and the OS saving the YMM registers on context switches
+static bool CpuHasAvx2() {
+    unsigned regs[4] = {};
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, 0, 0);
+#else
+    __cpuid_count(0, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    if (regs[0] < 7)
+        return false;
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, 1, 0);
+#else
+    __cpuid_count(1, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    const unsigned osxsaveAvx = (1u << 27) | (1u << 28);
+    if ((regs[2] & osxsaveAvx) != osxsaveAvx)
+        return false;
+#ifdef _MSC_VER
+    unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    unsigned long long xcr0 = ((unsigned long long)hi << 32) | lo;
+#endif
+    if ((xcr0 & 0x6) != 0x6)
+        return false;
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, 7, 0);
+#else
+    __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    return (regs[1] & (1u << 5)) != 0;
+}
+#endif
+
+#ifdef PIXEL_KERNELS_NEON
+// De-interleaving loads put each channel in its own register, the swizzle is a register swap
+static bool SwizzleIconPixelsNeon(uint8_t *pixels, size_t count) {
+    uint8x16_t alpha = vdupq_n_u8(0);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v = vld4q_u8(pixels + i * 4);
+        uint8x16_t b = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = b;
+        alpha = vorrq_u8(alpha, v.val[3]);
+        vst4q_u8(pixels + i * 4, v);
+    }
+    bool hasAlpha = vmaxvq_u8(alpha) != 0;
+    return SwizzleIconPixelsScalar(pixels + i * 4, count - i) || hasAlpha;
+}
+
+static void ApplyIconMaskNeon(uint8_t *pixels, const uint8_t *mask, size_t count) {
+    const uint8x16_t white = vdupq_n_u8(255);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t v = vld4q_u8(pixels + i * 4);
+        uint8x16x4_t m = vld4q_u8(mask + i * 4);
+        v.val[3] = vmvnq_u8(vceqq_u8(m.val[0], white));
+        vst4q_u8(pixels + i * 4, v);
+    }
+    ApplyIconMaskScalar(pixels + i * 4, mask + i * 4, count - i);
+}
+#endif
+
+void PremultiplyIconPixels(uint8_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        uint32_t a = pixels[3];
+        if (a == 255)
+            continue;
+        for (int c = 0; c < 3; c++) {
+            uint32_t v = pixels[c] * a + 128;
+            pixels[c] = (uint8_t)((v + (v >> 8)) >> 8); // exact round(v / 255)
+        }
+    }
+}
+
+void UnpremultiplyIconPixels(uint8_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        uint32_t a = pixels[3];
+        if (a == 255)
+            continue;
+        for (int c = 0; c < 3; c++) {
+            uint32_t v = a ? (pixels[c] * 255 + a / 2) / a : 0;
+            pixels[c] = (uint8_t)(v < 255 ? v : 255);
+        }
+    }
+}
+
+// Coordinates are scaled so that both grids are integers: source pixel i spans [i * dst, (i + 1) * dst) and
+// destination pixel x spans [x * src, (x + 1) * src). The overlap of the two is the weight, they add up to src.
+static uint32_t Overlap(uint32_t sourceIndex, uint32_t dst, uint32_t start, uint32_t end) {
+    uint32_t sourceStart = sourceIndex * dst;
+    uint32_t sourceEnd = sourceStart + dst;
+    return (sourceEnd < end ? sourceEnd : end) - (sourceStart > start ? sourceStart : start);
+}
+
+// Sums of the source row under each destination column, weighted by coverage, at most 255 * srcWidth
+static void ReduceIconRow(const uint8_t *row, uint32_t srcWidth, uint32_t *sums, uint32_t dstWidth) {
+    for (uint32_t x = 0; x < dstWidth; x++, sums += 4) {
+        uint32_t left = x * srcWidth;
+        uint32_t right = left + srcWidth;
+        sums[0] = sums[1] = sums[2] = sums[3] = 0;
+        for (uint32_t sx = left / dstWidth; sx * dstWidth < right; sx++) {
+            uint32_t weight = Overlap(sx, dstWidth, left, right);
+            const uint8_t *pixel = row + sx * 4;
+            sums[0] += pixel[0] * weight;
+            sums[1] += pixel[1] * weight;
+            sums[2] += pixel[2] * weight;
+            sums[3] += pixel[3] * weight;
+        }
+    }
+}
+
+void DownscaleIconPixels(const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight, uint8_t *dst, uint32_t dstWidth,
+                         uint32_t dstHeight) {
+    uint32_t rowSums[ICON_DOWNSCALE_MAX_WIDTH * 4];
+    uint32_t sums[ICON_DOWNSCALE_MAX_WIDTH * 4]; // at most 255 * srcWidth * srcHeight
+    const uint32_t area = srcWidth * srcHeight;
+    for (uint32_t y = 0; y < dstHeight; y++) {
+        memset(sums, 0, dstWidth * 4 * sizeof(uint32_t));
+        uint32_t top = y * srcHeight;
+        uint32_t bottom = top + srcHeight;
+        for (uint32_t sy = top / dstHeight; sy * dstHeight < bottom; sy++) {
+            uint32_t weight = Overlap(sy, dstHeight, top, bottom);
+            ReduceIconRow(src + (size_t)sy * srcWidth * 4, srcWidth, rowSums, dstWidth);
+            for (uint32_t i = 0; i < dstWidth * 4; i++) {
+                sums[i] += rowSums[i] * weight;
+            }
+        }
+        for (uint32_t i = 0; i < dstWidth * 4; i++) {
+            *dst++ = (uint8_t)((sums[i] + area / 2) / area);
+        }
+    }
+}
+
+static PixelKernelSet SelectPixelKernels() {
+#if defined(PIXEL_KERNELS_X64)
+    if (CpuHasAvx2())
+        return {"avx2", SwizzleIconPixelsAvx2, ApplyIconMaskAvx2};
+    return {"sse2", SwizzleIconPixelsSse2, ApplyIconMaskSse2}; // baseline on x64
+#elif defined(PIXEL_KERNELS_NEON)
+    return {"neon", SwizzleIconPixelsNeon, ApplyIconMaskNeon}; // baseline on ARM64
+#else
+    return {"scalar", SwizzleIconPixelsScalar, ApplyIconMaskScalar};
+#endif
+}
+
+static const PixelKernelSet g_PixelKernels = SelectPixelKernels();
+
+bool SwizzleIconPixels(uint8_t *pixels, size_t count) { return g_PixelKernels.swizzle(pixels, count); }
+
+void ApplyIconMask(uint8_t *pixels, const uint8_t *mask, size_t count) {
+    if (!mask) {
+        ApplyIconMaskScalar(pixels, NULL, count);
+        return;
+    }
+    g_PixelKernels.applyMask(pixels, mask, count);
+}
+
+const char *PixelKernelName() { return g_PixelKernels.name; }
+
+size_t GetPixelKernelSets(PixelKernelSet *sets) {
+    size_t count = 0;
+    sets[count++] = g_PixelKernels;
+#if defined(PIXEL_KERNELS_X64)
+    if (g_PixelKernels.swizzle != SwizzleIconPixelsSse2)
+        sets[count++] = {"sse2", SwizzleIconPixelsSse2, ApplyIconMaskSse2};
+#endif
+    if (g_PixelKernels.swizzle != SwizzleIconPixelsScalar)
+        sets[count++] = {"scalar", SwizzleIconPixelsScalar, ApplyIconMaskScalar};
+    return count;
+}
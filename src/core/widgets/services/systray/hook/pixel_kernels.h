@@ -0,0 +1,50 @@
+#pragma once
+
+// BGRA -> RGBA conversion and downscaling of icon bitmaps for ExtractIconRGBA and the hook's scaled icons.
+// Free of Windows headers, tests/test_pixel_kernels.cpp and `trayhook_bench --kernels` build them on any platform.
+// The widest kernel the CPU supports (AVX2 or SSE2 on x86, NEON on ARM64, scalar otherwise) is picked once
+// when the module loads.
+
+#include <cstddef>
+#include <cstdint>
+
+#define ICON_DOWNSCALE_MAX_WIDTH 256
+#define PIXEL_KERNEL_SET_MAX 3 // avx2, sse2 and scalar on x64
+
+// Swaps B and R of count 32-bit pixels in place and tests for alpha in the same pass.
+// Returns false if every alpha byte is zero: the bitmap has no alpha channel and ApplyIconMask must provide it.
+bool SwizzleIconPixels(uint8_t *pixels, size_t count);
+
+// Replaces the alpha of count RGBA pixels with the icon's AND mask, drawn at 32bpp by DrawIconEx
+// (white = transparent). A NULL mask makes every pixel opaque.
+void ApplyIconMask(uint8_t *pixels, const uint8_t *mask, size_t count);
+
+// Multiplies the color channels of count RGBA pixels by their alpha, rounded to nearest
+void PremultiplyIconPixels(uint8_t *pixels, size_t count);
+
+// Divides premultiplied color channels by their alpha again, rounded to nearest so that PremultiplyIconPixels
+// gives back the exact input. Fully transparent pixels become transparent black.
+void UnpremultiplyIconPixels(uint8_t *pixels, size_t count);
+
+// Shrinks a premultiplied RGBA bitmap with an area filter: every destination pixel is the coverage-weighted average
+// of the source pixels under it, which is exact for any ratio and never rings like Lanczos.
+// Requires dstWidth <= srcWidth <= ICON_DOWNSCALE_MAX_WIDTH and dstHeight <= srcHeight.
+void DownscaleIconPixels(const uint8_t *src, uint32_t srcWidth, uint32_t srcHeight, uint8_t *dst, uint32_t dstWidth,
+                         uint32_t dstHeight);
+
+// Reference implementations, the vector kernels must match them bit for bit
+bool SwizzleIconPixelsScalar(uint8_t *pixels, size_t count);
+void ApplyIconMaskScalar(uint8_t *pixels, const uint8_t *mask, size_t count);
+
+// Name of the kernel set in use, for diagnostics
+const char *PixelKernelName();
+
+struct PixelKernelSet {
+    const char *name;
+    bool (*swizzle)(uint8_t *pixels, size_t count);
+    void (*applyMask)(uint8_t *pixels, const uint8_t *mask, size_t count); // mask is never NULL
+};
+
+// Every kernel set this CPU runs, the one in use first and the scalar reference last, so tests and benchmarks can
+// hold each against the reference. Returns how many were stored, at most PIXEL_KERNEL_SET_MAX.
+size_t GetPixelKernelSets(PixelKernelSet *sets);
@@ -0,0 +1,179 @@
+#pragma once
+
+// Single-producer/single-consumer byte ring living in a shared memory mapping, mirrored in shm_ring.py.
+// Free of Windows headers, tests/test_shm_ring.cpp runs a producer and a consumer process over a POSIX mmap.
+//
+// Layout: ShmRingHeader, then `capacity` bytes of records. Every record is an 8-byte ShmRingRecord
+// followed by `size` payload bytes, padded to 8 bytes. Records are never split at the end of the
+// buffer: a record with size SHM_RING_WRAP tells the consumer to continue at offset 0.
+// head and tail are free-running byte counters, only the producer stores head and only the consumer
+// stores tail.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#define SHM_RING_MAGIC 0x474E5259u // "YRNG"
+#define SHM_RING_WRAP 0u
+
+struct ShmRingHeader {
+    uint32_t magic;    // SHM_RING_MAGIC, written by the creator before the producer attaches
+    uint32_t capacity; // bytes of record space after the header, power of two
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+struct ShmRingRecord {
+    uint32_t size; // payload bytes, SHM_RING_WRAP for the padding record at the end of the buffer
+    uint32_t reserved;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring counters must be lock-free to be shared");
+static_assert(offsetof(ShmRingHeader, head) == 64, "ShmRingHeader layout changed");
+static_assert(offsetof(ShmRingHeader, tail) == 128, "ShmRingHeader layout changed");
+static_assert(sizeof(ShmRingHeader) == 192, "ShmRingHeader layout changed");
+static_assert(sizeof(ShmRingRecord) == 8, "ShmRingRecord layout changed");
+
+inline uint32_t ShmRingRecordSpan(uint32_t size) { return (uint32_t)((sizeof(ShmRingRecord) + size + 7) & ~7u); }
+
+// Formats a fresh mapping of mappedSize bytes, returns false if it cannot hold a power-of-two ring.
+inline bool ShmRingInit(void *base, size_t mappedSize) {
+    if (mappedSize < sizeof(ShmRingHeader) + 64)
+        return false;
+    size_t capacity = mappedSize - sizeof(ShmRingHeader);
+    if ((capacity & (capacity - 1)) != 0 || capacity > UINT32_MAX)
+        return false;
+    ShmRingHeader *header = new (base) ShmRingHeader;
+    header->capacity = (uint32_t)capacity;
+    header->head.store(0, std::memory_order_relaxed);
+    header->tail.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = SHM_RING_MAGIC;
+    return true;
+}
+
+inline ShmRingHeader *ShmRingValidate(void *base, size_t mappedSize) {
+    if (!base || mappedSize < sizeof(ShmRingHeader))
+        return nullptr;
+    ShmRingHeader *header = (ShmRingHeader *)base;
+    if (header->magic != SHM_RING_MAGIC || header->capacity < 64 ||
+        (header->capacity & (header->capacity - 1)) != 0 || header->capacity > mappedSize - sizeof(ShmRingHeader))
+        return nullptr;
+    return header;
+}
+
+class ShmRingProducer {
+  public:
+    bool Attach(void *base, size_t mappedSize) {
+        m_header = ShmRingValidate(base, mappedSize);
+        if (!m_header)
+            return false;
+        m_data = (uint8_t *)base + sizeof(ShmRingHeader);
+        m_capacity = m_header->capacity;
+        m_head = m_header->head.load(std::memory_order_relaxed);
+        m_cachedTail = m_header->tail.load(std::memory_order_acquire);
+        m_pending = 0;
+        return true;
+    }
+
+    void Detach() { m_header = nullptr; }
+    bool IsAttached() const { return m_header != nullptr; }
+
+    // Largest payload that can ever be reserved, at most half the ring so a wrap never deadlocks
+    uint32_t MaxRecordSize() const { return m_capacity / 2 - (uint32_t)sizeof(ShmRingRecord); }
+
+    // Reserves a contiguous payload of size bytes, or nullptr if the consumer has not freed enough space yet.
+    // Nothing is visible to the consumer until Commit. Empty payloads are refused, size 0 is SHM_RING_WRAP.
+    uint8_t *Reserve(uint32_t size) {
+        if (!m_header || size == 0 || size > MaxRecordSize())
+            return nullptr;
+        uint32_t span = ShmRingRecordSpan(size);
+        uint32_t offset = (uint32_t)(m_head & (m_capacity - 1));
+        uint32_t padding = m_capacity - offset < span ? m_capacity - offset : 0;
+        if (m_head + padding + span - m_cachedTail > m_capacity) {
+            m_cachedTail = m_header->tail.load(std::memory_order_acquire);
+            if (m_head + padding + span - m_cachedTail > m_capacity)
+                return nullptr;
+        }
+        if (padding) {
+            ((ShmRingRecord *)(m_data + offset))->size = SHM_RING_WRAP;
+            offset = 0;
+        }
+        ShmRingRecord *record = (ShmRingRecord *)(m_data + offset);
+        record->size = size;
+        record->reserved = 0;
+        m_pending = padding + span;
+        return (uint8_t *)(record + 1);
+    }
+
+    // Publishes the record returned by Reserve
+    void Commit() {
+        m_head += m_pending;
+        m_pending = 0;
+        m_header->head.store(m_head, std::memory_order_release);
+    }
+
+    // Bytes the consumer has released, a record needs ShmRingRecordSpan(size) plus up to that again when it wraps
+    uint32_t FreeSpace() {
+        m_cachedTail = m_header->tail.load(std::memory_order_acquire);
+        return m_capacity - (uint32_t)(m_head - m_cachedTail);
+    }
+
+    // True when the consumer has caught up with everything committed so far
+    bool IsDrained() const { return m_header && m_header->tail.load(std::memory_order_acquire) == m_head; }
+
+  private:
+    ShmRingHeader *m_header = nullptr;
+    uint8_t *m_data = nullptr;
+    uint32_t m_capacity = 0;
+    uint64_t m_head = 0;
+    uint64_t m_cachedTail = 0;
+    uint32_t m_pending = 0;
+};
+
+class ShmRingConsumer {
+  public:
+    bool Attach(void *base, size_t mappedSize) {
+        m_header = ShmRingValidate(base, mappedSize);
+        if (!m_header)
+            return false;
+        m_data = (const uint8_t *)base + sizeof(ShmRingHeader);
+        m_capacity = m_header->capacity;
+        m_tail = m_header->tail.load(std::memory_order_relaxed);
+        m_cachedHead = m_tail;
+        return true;
+    }
+
+    // Oldest committed payload and its size, or nullptr if the ring is empty. Valid until Release.
+    const uint8_t *Front(uint32_t *size) {
+        for (;;) {
+            if (m_tail == m_cachedHead) {
+                m_cachedHead = m_header->head.load(std::memory_order_acquire);
+                if (m_tail == m_cachedHead)
+                    return nullptr;
+            }
+            uint32_t offset = (uint32_t)(m_tail & (m_capacity - 1));
+            const ShmRingRecord *record = (const ShmRingRecord *)(m_data + offset);
+            if (record->size != SHM_RING_WRAP) {
+                *size = record->size;
+                return (const uint8_t *)(record + 1);
+            }
+            m_tail += m_capacity - offset;
+        }
+    }
+
+    // Hands the payload returned by Front back to the producer
+    void Release() {
+        const ShmRingRecord *record = (const ShmRingRecord *)(m_data + (m_tail & (m_capacity - 1)));
+        m_tail += ShmRingRecordSpan(record->size);
+        m_header->tail.store(m_tail, std::memory_order_release);
+    }
+
+  private:
+    ShmRingHeader *m_header = nullptr;
+    const uint8_t *m_data = nullptr;
+    uint32_t m_capacity = 0;
+    uint64_t m_tail = 0;
+    uint64_t m_cachedHead = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free single-producer/single-consumer ring buffer.
+// Slots are filled and consumed in place so large payloads are copied exactly once.
+// Neither side ever blocks: BeginPush returns nullptr when full, Front returns nullptr when empty.
+template <typename T, size_t Capacity> class SpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+  public:
+    // Producer: reserve the next free slot, or nullptr if the ring is full.
+    T *BeginPush() {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_cachedTail >= Capacity) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head - m_cachedTail >= Capacity)
+                return nullptr;
+        }
+        return &m_slots[head & (Capacity - 1)];
+    }
+
+    // Producer: publish the slot returned by BeginPush.
+    void CommitPush() { m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer: oldest published slot, or nullptr if the ring is empty.
+    T *Front() {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_cachedHead) {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail == m_cachedHead)
+                return nullptr;
+        }
+        return &m_slots[tail & (Capacity - 1)];
+    }
+
+    // Consumer: release the slot returned by Front back to the producer.
+    void Pop() { m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Approximate when called from a third thread, exact from either endpoint.
+    size_t Size() const {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+  private:
+    // Producer and consumer indices live on separate cache lines to avoid false sharing
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_cachedTail = 0; // producer-local copy of m_tail
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_cachedHead = 0; // consumer-local copy of m_head
+    alignas(64) T m_slots[Capacity];
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+// Minimal assertions for the hook's portable tests. A failed CHECK prints its location and the test keeps
+// running, TEST_RESULT() turns the failures into the exit code CTest reads.
+
+#include <cstdio>
+
+inline int g_TestFailures = 0;
+
+#define CHECK(condition)                                                                                               \
+    do {                                                                                                               \
+        if (!(condition)) {                                                                                            \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);                              \
+            g_TestFailures++;                                                                                          \
+        }                                                                                                              \
+    } while (0)
+
+#define TEST_RESULT() (g_TestFailures ? (fprintf(stderr, "%d check(s) failed\n", g_TestFailures), 1) : 0)
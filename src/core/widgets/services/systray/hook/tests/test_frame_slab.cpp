@@ -0,0 +1,55 @@
+// Unit tests for frame_slab.h: every block of the region is handed out exactly once, freed blocks come back in
+// LIFO order, and Owns tells slab blocks from foreign pointers.
+
+#include "../frame_slab.h"
+#include "test_check.h"
+
+#include <cstring>
+#include <set>
+#include <vector>
+
+int main() {
+    const uint32_t blockSize = 1024, count = 40;
+    std::vector<uint64_t> storage(FrameSlab::RegionSize(blockSize, count) / sizeof(uint64_t)); // 8-byte aligned
+    uint8_t *region = (uint8_t *)storage.data();
+
+    FrameSlab slab;
+    CHECK(!slab.IsInitialized());
+    CHECK(!slab.Owns(region));
+    slab.Init(region, blockSize, count);
+    CHECK(slab.IsInitialized());
+    CHECK(slab.BlockSize() == blockSize);
+
+    // The whole region, block by block in address order, then nothing
+    std::set<uint8_t *> blocks;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *block = slab.Alloc();
+        CHECK(block == region + (size_t)i * blockSize);
+        CHECK(slab.Owns(block) && slab.Owns(block + blockSize - 1));
+        blocks.insert(block);
+        memset(block, 0xA5, blockSize); // a written block must not corrupt the free list
+    }
+    CHECK(blocks.size() == count);
+    CHECK(slab.InUse() == count);
+    CHECK(slab.Alloc() == nullptr);
+    CHECK(!slab.Owns(region + (size_t)count * blockSize));
+    CHECK(!slab.Owns(region - 1));
+
+    // LIFO reuse keeps the hottest block in use
+    uint8_t *third = region + 2 * (size_t)blockSize, *last = region + (size_t)(count - 1) * blockSize;
+    slab.Free(third);
+    slab.Free(last);
+    CHECK(slab.InUse() == count - 2);
+    CHECK(slab.Alloc() == last);
+    CHECK(slab.Alloc() == third);
+    CHECK(slab.Alloc() == nullptr);
+
+    for (uint8_t *block : blocks)
+        slab.Free(block);
+    CHECK(slab.InUse() == 0);
+    std::set<uint8_t *> again;
+    while (uint8_t *block = slab.Alloc())
+        again.insert(block);
+    CHECK(again == blocks);
+    return TEST_RESULT();
+}
@@ -0,0 +1,102 @@
+// Unit tests for icon_codec.h: span coding and tile deltas round-trip on icons shaped like the real ones, runs
+// longer than a span can hold are split, and malformed input is rejected.
+
+#include "../icon_codec.h"
+#include "test_check.h"
+
+#include <vector>
+
+static uint32_t g_Random = 0x2545F491u;
+
+static uint32_t RandomWord() {
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return g_Random;
+}
+
+// A premultiplied icon: transparent corners around a disc, every opaque pixel non-zero
+static std::vector<uint8_t> MakeIcon(uint32_t size) {
+    std::vector<uint8_t> pixels((size_t)size * size * 4, 0);
+    int32_t center = (int32_t)size / 2, radius = (int32_t)size * 7 / 16;
+    for (int32_t y = 0; y < (int32_t)size; y++) {
+        for (int32_t x = 0; x < (int32_t)size; x++) {
+            if ((x - center) * (x - center) + (y - center) * (y - center) > radius * radius)
+                continue;
+            uint32_t pixel = RandomWord() | 0xFF000000u;
+            memcpy(&pixels[((size_t)y * size + x) * 4], &pixel, 4);
+        }
+    }
+    return pixels;
+}
+
+static void CheckSpansRoundTrip(const std::vector<uint8_t> &pixels) {
+    size_t count = pixels.size() / 4;
+    size_t size = WriteIconSpans(pixels.data(), count, nullptr);
+    std::vector<uint8_t> coded(size);
+    CHECK(WriteIconSpans(pixels.data(), count, coded.data()) == size);
+    std::vector<uint8_t> decoded(pixels.size(), 0);
+    CHECK(DecodeIconSpans(coded.data(), coded.size(), decoded.data(), count));
+    CHECK(decoded == pixels);
+}
+
+static void TestSpans() {
+    for (uint32_t size : {1u, 16u, 24u, 32u, 256u}) {
+        std::vector<uint8_t> icon = MakeIcon(size);
+        CheckSpansRoundTrip(icon);
+        if (size >= 16)
+            CHECK(WriteIconSpans(icon.data(), icon.size() / 4, nullptr) < icon.size());
+    }
+
+    // Fully transparent codes to nothing, fully opaque to one span per ICON_SPAN_MAX_RUN pixels
+    std::vector<uint8_t> clear(256 * 256 * 4, 0);
+    CHECK(WriteIconSpans(clear.data(), 32 * 32, nullptr) == 0);
+    CheckSpansRoundTrip(clear);
+    std::vector<uint8_t> opaque(256 * 256 * 4, 0xFF);
+    CHECK(WriteIconSpans(opaque.data(), 256 * 256, nullptr) == 2 * sizeof(TrayIconSpan) + opaque.size());
+    CheckSpansRoundTrip(opaque);
+
+    // A zero run longer than a span holds, then a single pixel
+    clear[clear.size() - 4] = 1;
+    CheckSpansRoundTrip(clear);
+
+    // Malformed: truncated header, literals past the data, pixels past the bitmap
+    std::vector<uint8_t> icon = MakeIcon(32);
+    std::vector<uint8_t> coded(WriteIconSpans(icon.data(), 32 * 32, nullptr));
+    WriteIconSpans(icon.data(), 32 * 32, coded.data());
+    std::vector<uint8_t> decoded(icon.size());
+    CHECK(!DecodeIconSpans(coded.data(), 2, decoded.data(), 32 * 32));
+    CHECK(!DecodeIconSpans(coded.data(), coded.size() - 1, decoded.data(), 32 * 32));
+    CHECK(!DecodeIconSpans(coded.data(), coded.size(), decoded.data(), 16 * 16));
+}
+
+static void TestTiles() {
+    for (uint32_t size : {8u, 20u, 32u}) { // 20 leaves clipped tiles at the right and bottom edges
+        std::vector<uint8_t> previous = MakeIcon(size);
+        CHECK(WriteIconTiles(previous.data(), previous.data(), size, size, nullptr) == 0);
+
+        std::vector<uint8_t> current = previous;
+        size_t changed[] = {0, (size_t)size * size - 1, (size_t)(size / 2) * size + size / 2};
+        for (size_t pixel : changed)
+            current[pixel * 4 + 1] ^= 0x5A;
+        size_t deltaSize = WriteIconTiles(previous.data(), current.data(), size, size, nullptr);
+        CHECK(deltaSize > 0);
+        std::vector<uint8_t> delta(deltaSize);
+        CHECK(WriteIconTiles(previous.data(), current.data(), size, size, delta.data()) == deltaSize);
+
+        std::vector<uint8_t> patched = previous;
+        CHECK(ApplyIconTiles(patched.data(), size, size, ICON_DELTA_TILE_SIZE, delta.data(), delta.size()));
+        CHECK(patched == current);
+
+        CHECK(!ApplyIconTiles(patched.data(), size, size, ICON_DELTA_TILE_SIZE, delta.data(), delta.size() - 1));
+        TrayIconTile outside = {(uint16_t)(size / ICON_DELTA_TILE_SIZE + 1), 0};
+        CHECK(!ApplyIconTiles(patched.data(), size, size, ICON_DELTA_TILE_SIZE, (const uint8_t *)&outside,
+                              sizeof(outside)));
+    }
+}
+
+int main() {
+    TestSpans();
+    TestTiles();
+    return TEST_RESULT();
+}
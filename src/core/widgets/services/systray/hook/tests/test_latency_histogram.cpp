@@ -0,0 +1,98 @@
+// Unit tests for latency_histogram.h: samples land in their TrayHistogramBucket, and snapshots taken while other
+// threads record, the way the writer thread reads what the tray UI thread records, never see a field go back.
+
+#include "../latency_histogram.h"
+#include "test_check.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define RECORDER_THREADS 4
+#define RECORDS_PER_THREAD 200000
+
+// Deterministic sample i of a recorder, spread over most buckets
+static uint64_t Sample(uint32_t thread, uint32_t i) {
+    uint32_t mixed = (i * 2654435761u) ^ (thread * 0x9E3779B9u);
+    return (uint64_t)(mixed & 0xFFFF) << (mixed >> 28);
+}
+
+static void TestSingleThread() {
+    LatencyHistogram histogram;
+    TrayStageHistogram snapshot;
+    histogram.Snapshot(&snapshot);
+    CHECK(snapshot.count == 0 && snapshot.maxNs == 0 && snapshot.totalNs == 0);
+
+    histogram.Record(10);
+    histogram.Record(1000);
+    histogram.Record(1000);
+    histogram.Record((uint64_t)UINT32_MAX + 5); // max clamps, the total does not
+    histogram.Snapshot(&snapshot);
+    CHECK(histogram.Count() == 4);
+    CHECK(snapshot.count == 4);
+    CHECK(snapshot.maxNs == UINT32_MAX);
+    CHECK(snapshot.totalNs == 10 + 2000 + (uint64_t)UINT32_MAX + 5);
+    CHECK(snapshot.buckets[TrayHistogramBucket(10)] == 1);
+    CHECK(snapshot.buckets[TrayHistogramBucket(1000)] == 2);
+    CHECK(snapshot.buckets[TrayHistogramBucket((uint64_t)UINT32_MAX + 5)] == 1);
+}
+
+static void TestConcurrent() {
+    LatencyHistogram histogram;
+    std::atomic<bool> done{false};
+    uint32_t snapshots = 0, regressions = 0;
+
+    std::thread reader([&] {
+        TrayStageHistogram previous = {}, current;
+        while (!done.load()) {
+            histogram.Snapshot(&current);
+            bool regressed = current.count < previous.count || current.maxNs < previous.maxNs ||
+                             current.totalNs < previous.totalNs;
+            for (uint32_t i = 0; i < TRAY_HISTOGRAM_BUCKETS; i++)
+                regressed = regressed || current.buckets[i] < previous.buckets[i];
+            regressions += regressed;
+            previous = current;
+            snapshots++;
+        }
+    });
+
+    std::vector<std::thread> recorders;
+    for (uint32_t thread = 0; thread < RECORDER_THREADS; thread++) {
+        recorders.emplace_back([&histogram, thread] {
+            for (uint32_t i = 0; i < RECORDS_PER_THREAD; i++)
+                histogram.Record(Sample(thread, i));
+        });
+    }
+    for (std::thread &recorder : recorders)
+        recorder.join();
+    done.store(true);
+    reader.join();
+    CHECK(regressions == 0);
+    CHECK(snapshots > 0);
+
+    // Once the recorders are done nothing is lost
+    TrayStageHistogram expected = {};
+    for (uint32_t thread = 0; thread < RECORDER_THREADS; thread++) {
+        for (uint32_t i = 0; i < RECORDS_PER_THREAD; i++) {
+            uint64_t ns = Sample(thread, i);
+            expected.count++;
+            expected.totalNs += ns;
+            expected.buckets[TrayHistogramBucket(ns)]++;
+            if (ns > expected.maxNs)
+                expected.maxNs = ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+        }
+    }
+    TrayStageHistogram actual;
+    histogram.Snapshot(&actual);
+    CHECK(actual.count == expected.count);
+    CHECK(actual.maxNs == expected.maxNs);
+    CHECK(actual.totalNs == expected.totalNs);
+    for (uint32_t i = 0; i < TRAY_HISTOGRAM_BUCKETS; i++)
+        CHECK(actual.buckets[i] == expected.buckets[i]);
+}
+
+int main() {
+    TestSingleThread();
+    TestConcurrent();
+    return TEST_RESULT();
+}
@@ -0,0 +1,175 @@
+// Unit tests for pixel_kernels.cpp: every vector kernel set the CPU runs must match the scalar reference bit for
+// bit, for every length around the vector widths and at unaligned addresses, and the scalar-only kernels must
+// round exactly.
+
+#include "../pixel_kernels.h"
+#include "test_check.h"
+
+#include <cstring>
+#include <vector>
+
+static uint32_t g_Random = 0x9E3779B9u;
+
+static uint8_t RandomByte() {
+    g_Random ^= g_Random << 13;
+    g_Random ^= g_Random >> 17;
+    g_Random ^= g_Random << 5;
+    return (uint8_t)(g_Random >> 11);
+}
+
+// Random pixels, with alpha all zero (a bitmap without alpha channel) or zero but for the pixel at lonelyAlpha
+static void FillPixels(uint8_t *pixels, size_t count, bool zeroAlpha, size_t lonelyAlpha) {
+    for (size_t i = 0; i < count * 4; i++)
+        pixels[i] = RandomByte();
+    if (!zeroAlpha)
+        return;
+    for (size_t i = 0; i < count; i++)
+        pixels[i * 4 + 3] = i == lonelyAlpha ? (uint8_t)(RandomByte() | 1) : 0;
+}
+
+// A 32bpp AND mask as DrawIconEx draws it, black or white, with the odd other value in the unused bytes
+static void FillMask(uint8_t *mask, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint8_t value = RandomByte();
+        uint8_t level = value < 96 ? 0 : value < 192 ? 255 : RandomByte();
+        mask[i * 4] = level;
+        mask[i * 4 + 1] = RandomByte() < 128 ? level : RandomByte();
+        mask[i * 4 + 2] = level;
+        mask[i * 4 + 3] = RandomByte();
+    }
+}
+
+static void TestKernelSet(const PixelKernelSet &set) {
+    static const size_t counts[] = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 256, 1024, 1027};
+    for (size_t count : counts) {
+        for (size_t misalign = 0; misalign < 16; misalign += 4) {
+            for (int pattern = 0; pattern < 4; pattern++) {
+                // pattern 0: random alpha, 1: no alpha, 2 and 3: only the first or the last pixel has alpha
+                size_t lonely = pattern == 2 ? 0 : pattern == 3 ? count - 1 : count;
+                std::vector<uint8_t> expected(count * 4 + misalign), actual(count * 4 + misalign);
+                FillPixels(expected.data() + misalign, count, pattern != 0, lonely);
+                actual = expected;
+
+                bool expectedAlpha = SwizzleIconPixelsScalar(expected.data() + misalign, count);
+                bool actualAlpha = set.swizzle(actual.data() + misalign, count);
+                CHECK(actualAlpha == expectedAlpha);
+                CHECK(expected == actual);
+                if (pattern == 1)
+                    CHECK(!actualAlpha);
+                if (pattern > 1 && count > 0)
+                    CHECK(actualAlpha);
+
+                std::vector<uint8_t> mask(count * 4 + misalign);
+                FillMask(mask.data() + misalign, count);
+                ApplyIconMaskScalar(expected.data() + misalign, mask.data() + misalign, count);
+                set.applyMask(actual.data() + misalign, mask.data() + misalign, count);
+                CHECK(expected == actual);
+            }
+        }
+    }
+}
+
+static void TestDispatch() {
+    PixelKernelSet sets[PIXEL_KERNEL_SET_MAX];
+    size_t count = GetPixelKernelSets(sets);
+    CHECK(count >= 1 && count <= PIXEL_KERNEL_SET_MAX);
+    CHECK(strcmp(sets[0].name, PixelKernelName()) == 0);
+    CHECK(sets[count - 1].swizzle == SwizzleIconPixelsScalar);
+    for (size_t i = 0; i < count; i++) {
+        printf("kernel set %s\n", sets[i].name);
+        TestKernelSet(sets[i]);
+    }
+
+    // A missing mask makes every pixel opaque whatever the kernel set
+    uint8_t pixels[9 * 4] = {};
+    ApplyIconMask(pixels, nullptr, 9);
+    for (int i = 0; i < 9; i++)
+        CHECK(pixels[i * 4 + 3] == 255 && pixels[i * 4] == 0);
+}
+
+static void TestPremultiply() {
+    std::vector<uint8_t> pixels(256 * 256 * 4);
+    for (uint32_t a = 0; a < 256; a++) {
+        for (uint32_t c = 0; c < 256; c++) {
+            uint8_t *pixel = &pixels[(a * 256 + c) * 4];
+            pixel[0] = pixel[1] = pixel[2] = (uint8_t)c;
+            pixel[3] = (uint8_t)a;
+        }
+    }
+    PremultiplyIconPixels(pixels.data(), 256 * 256);
+    for (uint32_t a = 0; a < 256; a++) {
+        for (uint32_t c = 0; c < 256; c++) {
+            const uint8_t *pixel = &pixels[(a * 256 + c) * 4];
+            uint32_t rounded = (c * a * 2 + 255) / 510; // round half up of c * a / 255
+            CHECK(pixel[0] == rounded && pixel[1] == rounded && pixel[2] == rounded && pixel[3] == a);
+        }
+    }
+}
+
+// Every premultiplied value survives a round trip, which is all extraction needs of the straight pixels it hands on
+static void TestUnpremultiply() {
+    std::vector<uint8_t> pixels(256 * 256 * 4), expected;
+    for (uint32_t a = 0; a < 256; a++) {
+        for (uint32_t c = 0; c < 256; c++) {
+            uint8_t *pixel = &pixels[(a * 256 + c) * 4];
+            pixel[0] = (uint8_t)c;
+            pixel[1] = (uint8_t)(255 - c);
+            pixel[2] = (uint8_t)(c * 7);
+            pixel[3] = (uint8_t)a;
+        }
+    }
+    PremultiplyIconPixels(pixels.data(), 256 * 256);
+    expected = pixels;
+    UnpremultiplyIconPixels(pixels.data(), 256 * 256);
+    CHECK(pixels[255 * 256 * 4 + 100 * 4] == 100); // opaque pixels are left alone
+    CHECK(pixels[0] == 0 && pixels[1] == 0 && pixels[2] == 0 && pixels[3] == 0);
+    PremultiplyIconPixels(pixels.data(), 256 * 256);
+    CHECK(pixels == expected);
+}
+
+static void TestDownscale() {
+    // Same size is a copy
+    std::vector<uint8_t> src(32 * 32 * 4), dst(32 * 32 * 4);
+    FillPixels(src.data(), 32 * 32, false, 0);
+    DownscaleIconPixels(src.data(), 32, 32, dst.data(), 32, 32);
+    CHECK(src == dst);
+
+    // A flat color stays flat at any ratio
+    for (size_t i = 0; i < src.size(); i += 4) {
+        src[i] = 10;
+        src[i + 1] = 120;
+        src[i + 2] = 200;
+        src[i + 3] = 255;
+    }
+    for (uint32_t size = 1; size < 32; size++) {
+        DownscaleIconPixels(src.data(), 32, 32, dst.data(), size, size);
+        for (uint32_t i = 0; i < size * size; i++)
+            CHECK(dst[i * 4] == 10 && dst[i * 4 + 1] == 120 && dst[i * 4 + 2] == 200 && dst[i * 4 + 3] == 255);
+    }
+
+    // Halving averages each 2x2 block, rounded to nearest
+    FillPixels(src.data(), 32 * 32, false, 0);
+    DownscaleIconPixels(src.data(), 32, 32, dst.data(), 16, 16);
+    int mismatches = 0;
+    for (uint32_t y = 0; y < 16; y++) {
+        for (uint32_t x = 0; x < 16; x++) {
+            for (uint32_t c = 0; c < 4; c++) {
+                uint32_t sum = 0;
+                for (uint32_t dy = 0; dy < 2; dy++)
+                    for (uint32_t dx = 0; dx < 2; dx++)
+                        sum += src[((y * 2 + dy) * 32 + x * 2 + dx) * 4 + c];
+                if (dst[(y * 16 + x) * 4 + c] != (sum + 2) / 4)
+                    mismatches++;
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+int main() {
+    TestDispatch();
+    TestPremultiply();
+    TestUnpremultiply();
+    TestDownscale();
+    return TEST_RESULT();
+}
@@ -0,0 +1,125 @@
+// Stress test for shm_ring.h: a forked producer and the parent as consumer share one POSIX mmap, the way the hook
+// and the host share the TRAY_SHM_RING_NAME mapping. Record sizes vary so every wrap position gets exercised.
+
+#include "../shm_ring.h"
+#include "test_check.h"
+
+#include <cstring>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define RING_CAPACITY 4096
+#define RECORD_COUNT 200000
+
+// Deterministic size of record i, from one byte up to the largest the ring accepts
+static uint32_t RecordSize(uint32_t i, uint32_t maxSize) { return (i * 2654435761u >> 7) % maxSize + 1; }
+
+static uint8_t RecordByte(uint32_t i, uint32_t offset) { return (uint8_t)(i * 31 + offset * 7); }
+
+static void Produce(void *base, size_t mappedSize) {
+    ShmRingProducer producer;
+    if (!producer.Attach(base, mappedSize))
+        _exit(2);
+    uint32_t maxSize = producer.MaxRecordSize();
+    for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+        uint32_t size = RecordSize(i, maxSize);
+        uint8_t *payload;
+        while (!(payload = producer.Reserve(size)))
+            sched_yield();
+        for (uint32_t offset = 0; offset < size; offset++)
+            payload[offset] = RecordByte(i, offset);
+        producer.Commit();
+    }
+    while (!producer.IsDrained())
+        sched_yield();
+    _exit(0);
+}
+
+static void TestSingleProcess(void *base, size_t mappedSize) {
+    CHECK(!ShmRingInit(base, sizeof(ShmRingHeader) + 100)); // not a power of two
+    CHECK(ShmRingInit(base, mappedSize));
+    ShmRingProducer producer;
+    ShmRingConsumer consumer;
+    CHECK(producer.Attach(base, mappedSize));
+    CHECK(consumer.Attach(base, mappedSize));
+    CHECK(producer.Reserve(producer.MaxRecordSize() + 1) == nullptr);
+    CHECK(producer.Reserve(0) == nullptr); // would read as SHM_RING_WRAP
+
+    // Fill until full, nothing is visible before Commit
+    uint32_t size;
+    uint32_t committed = 0;
+    while (uint8_t *payload = producer.Reserve(100)) {
+        if (committed == 0)
+            CHECK(consumer.Front(&size) == nullptr);
+        memset(payload, (int)committed, 100);
+        producer.Commit();
+        committed++;
+    }
+    CHECK(committed == RING_CAPACITY / ShmRingRecordSpan(100));
+    CHECK(producer.FreeSpace() < ShmRingRecordSpan(100));
+
+    for (uint32_t i = 0; i < committed; i++) {
+        const uint8_t *payload = consumer.Front(&size);
+        CHECK(payload && size == 100 && payload[0] == (uint8_t)i && payload[99] == (uint8_t)i);
+        consumer.Release();
+    }
+    CHECK(consumer.Front(&size) == nullptr);
+    CHECK(producer.IsDrained());
+    CHECK(producer.FreeSpace() == RING_CAPACITY);
+}
+
+static void TestTwoProcesses(void *base, size_t mappedSize) {
+    CHECK(ShmRingInit(base, mappedSize));
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0)
+        Produce(base, mappedSize);
+
+    ShmRingConsumer consumer;
+    CHECK(consumer.Attach(base, mappedSize));
+    ShmRingProducer limits;
+    limits.Attach(base, mappedSize);
+    uint32_t maxSize = limits.MaxRecordSize();
+    uint32_t received = 0;
+    uint32_t corrupt = 0;
+    while (received < RECORD_COUNT) {
+        uint32_t size;
+        const uint8_t *payload = consumer.Front(&size);
+        if (!payload) {
+            sched_yield();
+            continue;
+        }
+        if (size != RecordSize(received, maxSize))
+            corrupt++;
+        else
+            for (uint32_t offset = 0; offset < size; offset++)
+                if (payload[offset] != RecordByte(received, offset)) {
+                    corrupt++;
+                    break;
+                }
+        consumer.Release();
+        received++;
+    }
+    CHECK(corrupt == 0);
+
+    int status = 0;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    uint32_t size;
+    CHECK(consumer.Front(&size) == nullptr);
+}
+
+int main() {
+    size_t mappedSize = sizeof(ShmRingHeader) + RING_CAPACITY;
+    void *base = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    TestSingleProcess(base, mappedSize);
+    TestTwoProcesses(base, mappedSize);
+    munmap(base, mappedSize);
+    return TEST_RESULT();
+}
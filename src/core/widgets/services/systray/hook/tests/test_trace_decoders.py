@@ -0,0 +1,138 @@
+"""
+Replays a tray trace, and the frames trayhook_bench built from it, through the native parse_frames of _trayproto
+and the pure Python one of tray_protocol.py. Both have to return the same frames for every message, for batches
+of them and for corrupted copies.
+
+    test_trace_decoders.py <directory holding core/widgets/services/systray/_trayproto> <trace> <frames>
+"""
+
+import ctypes
+import importlib
+import random
+import sys
+from pathlib import Path
+
+SOURCE_ROOT = Path(__file__).resolve().parents[6]
+NATIVE = "core.widgets.services.systray._trayproto"
+PROTOCOL = "core.widgets.services.systray.tray_protocol"
+BATCH_SIZE = 8  # frames per batch, like a busy hook packs them
+MUTATIONS = 2000
+
+failures = 0
+
+
+def check(condition: bool, message: str) -> None:
+    global failures
+    if not condition:
+        failures += 1
+        if failures <= 10:
+            print(f"FAILED: {message}", file=sys.stderr)
+
+
+def load_decoders():
+    """The pure Python tray_protocol module, imported while _trayproto is hidden, and the native module"""
+    sys.path[:0] = [str(SOURCE_ROOT), sys.argv[1]]
+    if not hasattr(ctypes, "WINFUNCTYPE"):
+        # structs.py declares Win32 callback types at import, none of them is called here
+        ctypes.WINFUNCTYPE = ctypes.CFUNCTYPE
+    sys.modules[NATIVE] = None
+    protocol = importlib.import_module(PROTOCOL)
+    del sys.modules[NATIVE]
+    native = importlib.import_module(NATIVE)
+    assert protocol._trayproto is None
+    return protocol, native
+
+
+def split_messages(protocol, data: bytes) -> list[bytes]:
+    messages = []
+    offset = 0
+    while offset < len(data):
+        header = protocol.read_frame_header(data, offset)
+        if header is None:
+            check(False, f"unreadable frame at offset {offset}")
+            break
+        messages.append(data[offset : offset + header.length])
+        offset += header.length
+    return messages
+
+
+def compare(protocol, native, message: bytes, capabilities: int, name: str) -> list:
+    expected = protocol.parse_frames(message, capabilities)
+    actual = native.parse_frames(message, capabilities)
+    check(actual == expected, f"{name}: native {actual!r:.300} != Python {expected!r:.300}")
+    return expected[0]
+
+
+def replay(protocol, native, path: str, capabilities: int) -> list:
+    """Events of every message in the file, after checking both decoders agree on it alone and in batches"""
+    messages = split_messages(protocol, Path(path).read_bytes())
+    check(len(messages) > 1, f"{path}: no frames")
+    events = []
+    for index, message in enumerate(messages):
+        frames = compare(protocol, native, message, capabilities, f"{path} frame {index}")
+        events += [frame.event for frame in frames if frame.event is not None]
+
+    for start in range(0, len(messages), BATCH_SIZE):
+        chunk = messages[start : start + BATCH_SIZE]
+        batch = protocol.pack_frame(protocol.MSG_BATCH, protocol.BATCH.pack(len(chunk)) + b"".join(chunk))
+        frames = compare(protocol, native, batch, capabilities, f"{path} batch at frame {start}")
+        check(len(frames) == len(chunk), f"{path}: batch at frame {start} lost frames")
+
+    # Flipped bytes and cut batches have to be rejected the same way, without reading past the message
+    rng = random.Random(0x59525459)
+    for mutation in range(MUTATIONS):
+        message = bytearray(rng.choice(messages))
+        for _ in range(rng.randint(1, 4)):
+            message[rng.randrange(len(message))] = rng.randrange(256)
+        compare(protocol, native, bytes(message), capabilities, f"{path} mutation {mutation}")
+    batch = protocol.pack_frame(protocol.MSG_BATCH, protocol.BATCH.pack(BATCH_SIZE) + b"".join(messages[:BATCH_SIZE]))
+    for cut in range(protocol.FRAME_HEADER.size, len(batch), 997):
+        truncated = bytearray(batch[:cut])
+        truncated[8:12] = cut.to_bytes(4, "little")  # the batch header claims only what is left
+        compare(protocol, native, bytes(truncated), capabilities, f"{path} batch cut at {cut}")
+    return events
+
+
+def main() -> int:
+    protocol, native = load_decoders()
+    _, trace_path, frames_path = sys.argv[1:4]
+
+    # A trace holds whole SHELLTRAYDATA payloads and unscaled straight RGBA, like a host without capabilities
+    trace_events = replay(protocol, native, trace_path, 0)
+    check(bool(trace_events), "the trace holds no tray events")
+    for event in trace_events:
+        check(event.images is not None and len(event.images) == 1, f"trace icon of {event.hwnd:#x} not decoded")
+
+    # BENCH_CAPABILITIES of trayhook_bench.cpp
+    capabilities = (
+        protocol.CAP_ICON_REF
+        | protocol.CAP_SCALED_ICONS
+        | protocol.CAP_SPAN_CODEC
+        | protocol.CAP_ICON_DELTA
+        | protocol.CAP_COMPACT_NID
+    )
+    frame_events = replay(protocol, native, frames_path, capabilities)
+
+    # The frames carry the same tray messages as the trace they were built from, strings and GUIDs included
+    def identity(event):
+        return event.message, event.hwnd, event.uid, event.flags, event.guid, event.tip, event.info, event.info_title
+
+    check(len(frame_events) == len(trace_events), f"{len(frame_events)} frames for {len(trace_events)} trace events")
+    check(
+        [identity(event) for event in frame_events] == [identity(event) for event in trace_events],
+        "frames and trace disagree on the tray messages",
+    )
+    check(any(event.tip for event in frame_events), "no tip decoded")
+    check(any("\r" not in event.info and event.info for event in frame_events), "no balloon text decoded")
+    check(any(event.guid for event in frame_events), "no GUID decoded")
+    check(any(event.images and len(event.images) == 3 for event in frame_events), "no scaled icon decoded")
+
+    if failures:
+        print(f"{failures} check(s) failed", file=sys.stderr)
+        return 1
+    print(f"{len(trace_events)} tray events decoded alike by both decoders")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
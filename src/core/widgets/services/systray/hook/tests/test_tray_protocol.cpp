@@ -0,0 +1,174 @@
+// Unit tests for tray_protocol.h: frame header validation, the latency histogram buckets and the
+// TRAY_CAP_COMPACT_NID payload, built on any platform by the hook's CMakeLists.txt.
+
+#include "../tray_protocol.h"
+#include "test_check.h"
+
+#include <vector>
+
+static void SetText(uint16_t *units, const char *text) {
+    for (; *text; text++)
+        *units++ = (uint16_t)(unsigned char)*text;
+    *units = 0;
+}
+
+static void TestFrameHeader() {
+    TrayHelloMessage hello = {};
+    TrayInitFrameHeader(&hello.header, TRAY_MSG_HELLO, sizeof(hello), 7, 123456789);
+    CHECK(hello.header.magic == TRAY_PROTOCOL_MAGIC);
+    CHECK(hello.header.version == TRAY_PROTOCOL_VERSION);
+    CHECK(hello.header.kind == TRAY_MSG_HELLO);
+    CHECK(hello.header.sequence == 7);
+    CHECK(hello.header.timestamp == 123456789);
+
+    // Wire offsets tray_protocol.py unpacks with "<IHHIIQ"
+    const uint8_t *bytes = (const uint8_t *)&hello;
+    CHECK(bytes[0] == 0x59 && bytes[1] == 0x54 && bytes[2] == 0x52 && bytes[3] == 0x59);
+    CHECK(offsetof(TrayFrameHeader, kind) == 6);
+    CHECK(offsetof(TrayFrameHeader, length) == 8);
+    CHECK(offsetof(TrayFrameHeader, timestamp) == 16);
+    CHECK(offsetof(TrayHelloAckMessage, iconSizes) == 36);
+    CHECK(offsetof(TrayHelloAckMessage, flags) == 44);
+    CHECK(offsetof(TrayEventMessage, iconHash) == 48);
+
+    CHECK(TrayReadFrameHeader(&hello, sizeof(hello)) == &hello.header);
+    CHECK(TrayReadFrameHeader(&hello, sizeof(hello), sizeof(TrayHelloMessage)) == &hello.header);
+    CHECK(TrayReadFrameHeader(&hello, sizeof(hello), sizeof(TrayHelloAckMessage)) == nullptr);
+    CHECK(TrayReadFrameHeader(&hello, sizeof(TrayFrameHeader) - 1) == nullptr);
+    CHECK(TrayReadFrameHeader(&hello, sizeof(hello) - 1) == nullptr); // length runs past the buffer
+
+    // Longer frames of a known kind are accepted, fields are only ever appended
+    std::vector<uint8_t> longer(sizeof(hello) + 16);
+    hello.header.length = (uint32_t)longer.size();
+    memcpy(longer.data(), &hello, sizeof(hello));
+    CHECK(TrayReadFrameHeader(longer.data(), longer.size(), sizeof(TrayHelloMessage)) != nullptr);
+
+    TrayFrameHeader bad = hello.header;
+    bad.length = sizeof(TrayFrameHeader);
+    bad.magic ^= 1;
+    CHECK(TrayReadFrameHeader(&bad, sizeof(bad)) == nullptr);
+    bad.magic = TRAY_PROTOCOL_MAGIC;
+    bad.version = TRAY_PROTOCOL_VERSION + 1;
+    CHECK(TrayReadFrameHeader(&bad, sizeof(bad)) == nullptr);
+    bad.version = TRAY_PROTOCOL_VERSION;
+    bad.length = sizeof(TrayFrameHeader) - 1;
+    CHECK(TrayReadFrameHeader(&bad, sizeof(bad)) == nullptr);
+}
+
+static void TestHistogramBuckets() {
+    CHECK(TrayHistogramBucket(0) == 0);
+    CHECK(TrayHistogramBucket(63) == 0);
+    CHECK(TrayHistogramBucket(64) == 1);
+    CHECK(TrayHistogramBucket(255) == 3);
+    CHECK(TrayHistogramBucket(256) == 4);
+    CHECK(TrayHistogramBucket(UINT64_MAX) == TRAY_HISTOGRAM_BUCKETS - 1);
+
+    for (uint32_t bucket = 0; bucket < TRAY_HISTOGRAM_BUCKETS; bucket++) {
+        uint64_t low = TrayHistogramBucketLow(bucket);
+        CHECK(TrayHistogramBucket(low) == bucket);
+        if (bucket > 0)
+            CHECK(TrayHistogramBucket(low - 1) == bucket - 1);
+        if (bucket + 1 < TRAY_HISTOGRAM_BUCKETS)
+            CHECK(TrayHistogramBucketLow(bucket + 1) > low);
+    }
+}
+
+static SHELLTRAYDATA MakeTrayData(uint32_t flags) {
+    SHELLTRAYDATA data = {};
+    data.dwSignature = 0x34753423;
+    data.dwMessage = 1; // NIM_MODIFY
+    data.nid.cbSize = sizeof(NOTIFYICONDATA32);
+    data.nid.hWnd = 0x10ab4;
+    data.nid.uID = 3;
+    data.nid.uFlags = flags;
+    data.nid.uCallbackMessage = 0x8001;
+    data.nid.hIcon = 0x2c0f11;
+    SetText(data.nid.szTip, "Volume: 42%");
+    data.nid.dwState = 1;
+    data.nid.dwStateMask = 3;
+    SetText(data.nid.szInfo, "Update ready");
+    SetText(data.nid.szInfoTitle, "Installer");
+    data.nid.uVersion = 4;
+    data.nid.dwInfoFlags = 0x10;
+    data.nid.guidItem = {0x12345678, 0x9abc, 0xdef0, {1, 2, 3, 4, 5, 6, 7, 8}};
+    data.nid.hBalloonIcon = 0x4411;
+    return data;
+}
+
+// What a reader sees of data: the fields of the flags that are set, everything else zero
+static SHELLTRAYDATA Project(const SHELLTRAYDATA &data) {
+    SHELLTRAYDATA out = {};
+    uint32_t flags = data.nid.uFlags;
+    out.dwSignature = data.dwSignature;
+    out.dwMessage = data.dwMessage;
+    out.nid.cbSize = sizeof(NOTIFYICONDATA32);
+    out.nid.hWnd = data.nid.hWnd;
+    out.nid.uID = data.nid.uID;
+    out.nid.uFlags = flags;
+    out.nid.uVersion = data.nid.uVersion;
+    if (flags & TRAY_NIF_MESSAGE)
+        out.nid.uCallbackMessage = data.nid.uCallbackMessage;
+    if (flags & TRAY_NIF_ICON)
+        out.nid.hIcon = data.nid.hIcon;
+    if (flags & TRAY_NIF_TIP)
+        memcpy(out.nid.szTip, data.nid.szTip, sizeof(out.nid.szTip));
+    if (flags & TRAY_NIF_STATE) {
+        out.nid.dwState = data.nid.dwState;
+        out.nid.dwStateMask = data.nid.dwStateMask;
+    }
+    if (flags & TRAY_NIF_INFO) {
+        memcpy(out.nid.szInfo, data.nid.szInfo, sizeof(out.nid.szInfo));
+        memcpy(out.nid.szInfoTitle, data.nid.szInfoTitle, sizeof(out.nid.szInfoTitle));
+        out.nid.dwInfoFlags = data.nid.dwInfoFlags;
+        out.nid.hBalloonIcon = data.nid.hBalloonIcon;
+    }
+    if (flags & TRAY_NIF_GUID)
+        out.nid.guidItem = data.nid.guidItem;
+    return out;
+}
+
+static void TestCompactTrayData() {
+    for (uint32_t flags = 0; flags < 64; flags++) {
+        SHELLTRAYDATA data = MakeTrayData(flags);
+        size_t size = TrayWriteCompactTrayData(&data, nullptr);
+        CHECK(size >= sizeof(TrayCompactTrayData));
+        CHECK(size <= sizeof(SHELLTRAYDATA));
+
+        std::vector<uint8_t> payload(size);
+        CHECK(TrayWriteCompactTrayData(&data, payload.data()) == size);
+
+        SHELLTRAYDATA read;
+        CHECK(TrayReadCompactTrayData(payload.data(), payload.size(), &read));
+        SHELLTRAYDATA expected = Project(data);
+        CHECK(memcmp(&read, &expected, sizeof(read)) == 0);
+
+        // Every truncation is rejected, so is trailing garbage
+        for (size_t cut = 0; cut < size; cut++)
+            CHECK(!TrayReadCompactTrayData(payload.data(), cut, &read));
+        payload.push_back(0);
+        CHECK(!TrayReadCompactTrayData(payload.data(), payload.size(), &read));
+    }
+
+    // A tip without terminator keeps its first 127 units, like Explorer
+    SHELLTRAYDATA data = MakeTrayData(TRAY_NIF_TIP);
+    for (uint16_t &unit : data.nid.szTip)
+        unit = 'x';
+    uint8_t payload[sizeof(SHELLTRAYDATA)];
+    size_t size = TrayWriteCompactTrayData(&data, payload);
+    CHECK(size == sizeof(TrayCompactTrayData) + sizeof(uint16_t) + 127 * sizeof(uint16_t));
+    SHELLTRAYDATA read;
+    CHECK(TrayReadCompactTrayData(payload, size, &read));
+    CHECK(read.nid.szTip[126] == 'x' && read.nid.szTip[127] == 0);
+
+    // A string count that does not fit its field is malformed
+    uint16_t count = 128;
+    memcpy(payload + sizeof(TrayCompactTrayData), &count, sizeof(count));
+    CHECK(!TrayReadCompactTrayData(payload, size, &read));
+}
+
+int main() {
+    TestFrameHeader();
+    TestHistogramBuckets();
+    TestCompactTrayData();
+    return TEST_RESULT();
+}
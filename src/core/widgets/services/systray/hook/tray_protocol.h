@@ -0,0 +1,479 @@
+#pragma once
+
+// Wire format of \\.\pipe\yasb_systray_monitor, shared by trayhook.cpp and mirrored in tray_protocol.py.
+// Must stay free of Windows headers, tests/test_tray_protocol.cpp checks it on Linux in CI.
+//
+// Every message is one pipe message starting with a TrayFrameHeader, all fields little-endian and packed.
+// Compatibility rules:
+//  - Receivers skip frames of unknown kind using header.length, so new kinds need no version bump.
+//  - Fields are only ever appended to a message, receivers accept length >= the size they know.
+//  - TRAY_PROTOCOL_VERSION changes only when an existing layout changes; both sides reject a mismatch.
+//  - Optional behaviour is announced with TRAY_CAP_* bits in the handshake and used only when the
+//    host echoes the bit back in its TRAY_MSG_HELLO_ACK.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define TRAY_PROTOCOL_MAGIC 0x59525459u // "YTRY"
+#define TRAY_PROTOCOL_VERSION 1
+
+// Frame kinds
+#define TRAY_MSG_HELLO 1          // hook -> host, first frame of every connection
+#define TRAY_MSG_HELLO_ACK 2      // host -> hook, reply to TRAY_MSG_HELLO
+#define TRAY_MSG_TEXT 3           // hook -> host, UTF-8 debug text
+#define TRAY_MSG_TRAY_EVENT 4     // hook -> host, TrayEventMessage + SHELLTRAYDATA + RGBA pixels
+#define TRAY_MSG_ICON_REF 5       // hook -> host, TrayEventMessage + SHELLTRAYDATA, pixels unchanged since last sent
+#define TRAY_MSG_BATCH 6          // hook -> host, TrayBatchMessage followed by `count` complete frames
+#define TRAY_MSG_STATS 7          // hook -> host, TrayStatsMessage, sent when the counters changed
+#define TRAY_MSG_SNAPSHOT_BEGIN 8 // hook -> host, TraySnapshotMessage, `count` NIM_ADD tray events follow
+#define TRAY_MSG_SNAPSHOT_END 9   // hook -> host, TraySnapshotMessage, icons not in the snapshot are gone
+#define TRAY_MSG_ICON_DELTA 10    // hook -> host, TrayEventMessage + SHELLTRAYDATA + TrayIconDelta tile updates
+#define TRAY_MSG_METRICS 11       // hook -> host, TrayMetricsMessage + a TrayStageHistogram per TRAY_STAGE_*
+#define TRAY_MSG_RECORD 12        // host -> hook, TrayRecordMessage, starts or stops the trace file
+#define TRAY_MSG_FILTER 13        // host -> hook, TrayFilterMessage, replaces the set of icons sent without pixels
+#define TRAY_MSG_COMMAND 14       // host -> hook, TrayCommandMessage, answered by a TRAY_MSG_COMMAND_REPLY
+#define TRAY_MSG_COMMAND_REPLY 15 // hook -> host, TrayCommandReplyMessage with the requestId of the command
+
+// Capability bits
+#define TRAY_CAP_ICON_REF 0x00000001     // host resolves TRAY_MSG_ICON_REF from its own cache
+#define TRAY_CAP_BATCH 0x00000002        // host unpacks TRAY_MSG_BATCH
+#define TRAY_CAP_SHM_RING 0x00000004     // host reads frames from a shared memory ring (shm_ring.h)
+#define TRAY_CAP_SCALED_ICONS 0x00000008 // host names icon sizes, pixels arrive as premultiplied TrayIconImage lists
+#define TRAY_CAP_SPAN_CODEC 0x00000010   // host decodes span coded pixels (icon_codec.h)
+#define TRAY_CAP_ICON_DELTA 0x00000020   // host patches cached scaled icons with TRAY_MSG_ICON_DELTA
+#define TRAY_CAP_COMPACT_NID 0x00000040  // tray event payloads are TrayCompactTrayData instead of SHELLTRAYDATA
+#define TRAY_CAP_METRICS 0x00000080      // host takes the TRAY_MSG_METRICS latency histograms
+#define TRAY_CAP_RECORD 0x00000100       // hook reads TRAY_MSG_RECORD from the pipe after the handshake
+#define TRAY_CAP_FILTER 0x00000200       // hook reads TRAY_MSG_FILTER from the pipe after the handshake
+#define TRAY_CAP_COMMAND 0x00000400      // hook reads TRAY_MSG_COMMAND from the pipe and answers every one
+
+#define TRAY_MAX_ICON_SIZES 4
+
+// Hello flags
+#define TRAY_HELLO_SNAPSHOT 0x00000001 // a snapshot of every live icon follows the handshake
+
+// Hello ack flags
+#define TRAY_ACK_FILTER 0x00000001 // a TRAY_MSG_FILTER follows the ack, the hook applies it before the snapshot
+
+// Shared memory transport, created by the host per connection and formatted before it sends the ack.
+// Names are formatted with the hook's process id. The event is auto-reset and set after every commit.
+#define TRAY_SHM_RING_NAME L"Local\\yasb_systray_ring_%lu"
+#define TRAY_SHM_EVENT_NAME L"Local\\yasb_systray_ring_event_%lu"
+
+// Hook stages timed for TRAY_MSG_METRICS, the message carries their histograms in this order
+#define TRAY_STAGE_COPYDATA 0     // EnqueueCopyData on Explorer's tray UI thread, all the hook adds to its wndproc
+#define TRAY_STAGE_WNDPROC 1      // Explorer's own handling of the same WM_COPYDATA, for scale
+#define TRAY_STAGE_ICON_EXTRACT 2 // ExtractIconRGBA on the writer thread
+#define TRAY_STAGE_FRAME_BUILD 3  // SendTrayEventToPipe, icon extraction included
+#define TRAY_STAGE_PIPE_WRITE 4   // SubmitPipeWrite, including any wait for a free write slot
+#define TRAY_STAGE_COUNT 5
+
+#define TRAY_HISTOGRAM_BUCKETS 96
+
+#define TRAY_RECORD_PATH_CAPACITY 260
+
+// Limits of a TRAY_MSG_FILTER, entries past them are ignored by the hook
+#define TRAY_FILTER_MAX_GUIDS 32
+#define TRAY_FILTER_MAX_ICONS 64
+#define TRAY_FILTER_MAX_EXES 64
+#define TRAY_FILTER_MAX_EXE_LENGTH 64 // UTF-16 units of an image name, terminator included
+
+// Commands of a TRAY_MSG_COMMAND
+#define TRAY_COMMAND_PING 1            // replies with value unchanged
+#define TRAY_COMMAND_SNAPSHOT 2        // streams the icon table as after a reconnect, replies with the icon count
+#define TRAY_COMMAND_STATS 3           // sends TRAY_MSG_STATS, and TRAY_MSG_METRICS with TRAY_CAP_METRICS, right away
+#define TRAY_COMMAND_COALESCE_WINDOW 4 // value replaces the NIM_MODIFY coalescing window, replies with the old one
+#define TRAY_COMMAND_ICON_SIZES 5      // iconSizes replace the TRAY_CAP_SCALED_ICONS sizes, a snapshot follows
+
+// Longest NIM_MODIFY coalescing window the hook takes. A longer one in TRAY_MSG_HELLO_ACK is cut to it, in
+// TRAY_COMMAND_COALESCE_WINDOW it is TRAY_COMMAND_INVALID. Held any longer, modifies would overflow the hook's
+// pending events.
+#define TRAY_MAX_COALESCE_WINDOW_MS 1000
+
+// Status of a TRAY_MSG_COMMAND_REPLY
+#define TRAY_COMMAND_OK 0
+#define TRAY_COMMAND_UNKNOWN 1 // the hook predates the command
+#define TRAY_COMMAND_INVALID 2 // arguments out of range, or the command needs a capability the host did not accept
+
+#pragma pack(push, 1)
+struct TrayFrameHeader {
+    uint32_t magic;     // TRAY_PROTOCOL_MAGIC
+    uint16_t version;   // TRAY_PROTOCOL_VERSION
+    uint16_t kind;      // TRAY_MSG_*
+    uint32_t length;    // whole frame including this header
+    uint32_t sequence;  // per-connection counter, gaps mean the sender dropped frames
+    uint64_t timestamp; // sender's monotonic clock in microseconds (QueryPerformanceCounter based)
+};
+
+struct TrayHelloMessage {
+    TrayFrameHeader header;
+    uint32_t capabilities; // TRAY_CAP_* supported by the hook
+    uint32_t processId;    // explorer.exe the hook lives in
+    uint32_t flags;        // TRAY_HELLO_*
+};
+
+struct TrayHelloAckMessage {
+    TrayFrameHeader header;
+    uint32_t capabilities;                   // subset of the hello capabilities the host accepts
+    uint32_t coalesceWindowMs;               // NIM_MODIFY coalescing window up to TRAY_MAX_COALESCE_WINDOW_MS, 0 = off
+    uint32_t ringSize;                       // bytes in the TRAY_SHM_RING_NAME mapping for TRAY_CAP_SHM_RING
+    uint16_t iconSizes[TRAY_MAX_ICON_SIZES]; // edge lengths in pixels for TRAY_CAP_SCALED_ICONS, 0 = unused
+    uint32_t flags;                          // TRAY_ACK_*
+};
+
+struct TrayEventMessage {
+    TrayFrameHeader header;
+    uint64_t dwData;
+    uint32_t cbData; // size of the SHELLTRAYDATA payload that follows
+    uint32_t iconWidth;    // size of the icon as the application drew it
+    uint32_t iconHeight;
+    uint32_t iconDataSize; // icon bytes after the payload, always 0 for TRAY_MSG_ICON_REF
+    uint64_t iconHash;     // content hash of the unscaled RGBA bytes, 0 = no icon
+};
+
+// With TRAY_CAP_SCALED_ICONS the icon data of a tray event is a list of these, largest first, each followed by
+// its premultiplied RGBA pixels. There is one per host icon size that fits the source, never larger than the icon.
+struct TrayIconImage {
+    uint16_t width;
+    uint16_t height;
+    uint32_t size; // pixel bytes that follow, width * height * 4 or less when span coded
+};
+
+// With TRAY_CAP_SPAN_CODEC, pixels (the whole icon data, or one TrayIconImage) smaller than width * height * 4
+// are a list of these, each followed by `literals` RGBA pixels. Skipped pixels are all-zero.
+struct TrayIconSpan {
+    uint16_t zeros;
+    uint16_t literals;
+};
+
+// Icon data of a TRAY_MSG_ICON_DELTA: the scaled images of the icon whose iconHash is baseHash with some tiles
+// replaced. One TrayIconImage per base image follows, its size counting the TrayIconTile records after it.
+// A host that no longer has the base keeps the old image until the next full TRAY_MSG_TRAY_EVENT (keyframe).
+struct TrayIconDelta {
+    uint64_t baseHash;
+    uint16_t tileSize; // tile edge in pixels, tiles at the right and bottom edges are clipped
+    uint16_t imageCount;
+};
+
+// A replaced tile, followed by its premultiplied RGBA pixels row by row
+struct TrayIconTile {
+    uint16_t x; // tile column
+    uint16_t y; // tile row
+};
+
+// Container for several frames written as one pipe message. The container's sequence is 0,
+// the inner frames keep their own sequence numbers. Batches never nest.
+struct TrayBatchMessage {
+    TrayFrameHeader header;
+    uint32_t count;
+};
+
+// Backpressure and resource counters of the hook, cumulative since it was injected except for the object counts
+struct TrayStatsMessage {
+    TrayFrameHeader header;
+    uint32_t eventsDropped;      // tray messages lost because the hook's intake queue was full
+    uint32_t framesDropped;      // frames built but never delivered
+    uint32_t modifiesDropped;    // pending NIM_MODIFY discarded to make room while the host was slow
+    uint32_t modifiesCoalesced;  // NIM_MODIFY merged into a pending event for the same icon
+    uint32_t backpressureEvents; // times the hook found the transport full and held events back
+    uint32_t queueHighWater;     // most events pending in the hook at once
+    uint32_t heapAllocations;    // heap blocks the hook allocated for frames and icon state
+    uint32_t gdiObjectsCreated;  // GDI objects the hook created, including the bitmaps GetIconInfo hands out
+    uint32_t frameSlabMisses;    // frames no free slab block could hold, allocated from the hook's heap instead
+    uint32_t gdiObjects;         // GDI objects explorer.exe held when the message was sent
+    uint32_t userObjects;        // USER objects (icons among them) explorer.exe held when the message was sent
+};
+
+// Latencies of one stage in nanoseconds, cumulative since the hook was injected. Buckets per TrayHistogramBucket.
+struct TrayStageHistogram {
+    uint32_t count;
+    uint32_t maxNs;
+    uint64_t totalNs;
+    uint32_t buckets[TRAY_HISTOGRAM_BUCKETS];
+};
+
+struct TrayMetricsMessage {
+    TrayFrameHeader header;
+    uint32_t stageCount; // TrayStageHistogram that follow
+};
+
+// A trace file holds the frames of TRAY_MSG_RECORD as they would go over the pipe: a TRAY_MSG_HELLO, then one
+// TRAY_MSG_TRAY_EVENT per tray message with the SHELLTRAYDATA exactly as Explorer received it and the icon as
+// unscaled straight RGBA. Header timestamps are when Explorer received each message.
+struct TrayRecordMessage {
+    TrayFrameHeader header;
+    uint32_t maxBytes;                        // the trace stops growing at this size, 0 stops recording
+    uint16_t path[TRAY_RECORD_PATH_CAPACITY]; // NUL-terminated UTF-16 path of the trace file, replaced if it exists
+};
+
+// Icons the host hides in every widget. The hook forwards their tray messages without NIF_ICON and never
+// rasterizes them, which saves the extraction for background apps nobody sees. Followed by guidCount TrayGuid,
+// iconCount TrayFilterIcon and exeCount TrayCompactString, the lower case image names without extension as in
+// IconData.exe. Each message replaces the previous filter, a new connection starts without one.
+struct TrayFilterMessage {
+    TrayFrameHeader header;
+    uint32_t guidCount;
+    uint32_t iconCount;
+    uint32_t exeCount;
+};
+
+struct TrayFilterIcon {
+    uint32_t hWnd;
+    uint32_t uID;
+};
+
+// A request of the host. The hook services commands on its writer thread, never Explorer's tray UI thread, in
+// the order they arrive and answers each with a TRAY_MSG_COMMAND_REPLY carrying the same requestId. Frames the
+// command makes the hook send go out before the reply.
+struct TrayCommandMessage {
+    TrayFrameHeader header;
+    uint32_t requestId; // chosen by the host, echoed in the reply
+    uint32_t command;   // TRAY_COMMAND_*
+    uint32_t value;
+    uint16_t iconSizes[TRAY_MAX_ICON_SIZES]; // TRAY_COMMAND_ICON_SIZES only, edge lengths in pixels, 0 = unused
+};
+
+struct TrayCommandReplyMessage {
+    TrayFrameHeader header;
+    uint32_t requestId;
+    uint32_t command;
+    uint32_t status; // TRAY_COMMAND_OK, TRAY_COMMAND_UNKNOWN or TRAY_COMMAND_INVALID
+    uint32_t value;  // result of the command, 0 unless it names one
+};
+
+// Brackets the icon table the hook streams after the handshake
+struct TraySnapshotMessage {
+    TrayFrameHeader header;
+    uint32_t count; // icons in the snapshot
+};
+
+struct TrayGuid {
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+};
+
+// NOTIFYICONDATAW as Explorer receives it from 32-bit and 64-bit callers alike (handles truncated to 32 bits)
+struct NOTIFYICONDATA32 {
+    uint32_t cbSize;
+    uint32_t hWnd;
+    uint32_t uID;
+    uint32_t uFlags;
+    uint32_t uCallbackMessage;
+    uint32_t hIcon;
+    uint16_t szTip[128];
+    uint32_t dwState;
+    uint32_t dwStateMask;
+    uint16_t szInfo[256];
+    union {
+        uint32_t uTimeout;
+        uint32_t uVersion;
+    };
+    uint16_t szInfoTitle[64];
+    uint32_t dwInfoFlags;
+    TrayGuid guidItem;
+    uint32_t hBalloonIcon;
+};
+
+// WM_COPYDATA payload sent to Shell_TrayWnd by Shell_NotifyIcon (dwData == 1)
+struct SHELLTRAYDATA {
+    uint32_t dwSignature;
+    uint32_t dwMessage;
+    NOTIFYICONDATA32 nid;
+};
+
+// With TRAY_CAP_COMPACT_NID the payload of a tray event (cbData bytes) is this header followed by only the
+// NOTIFYICONDATA fields whose NIF_* flag is set, in this order:
+//   NIF_MESSAGE  uint32 uCallbackMessage
+//   NIF_ICON     uint32 hIcon
+//   NIF_TIP      TrayCompactString szTip
+//   NIF_STATE    uint32 dwState, uint32 dwStateMask
+//   NIF_INFO     TrayCompactString szInfo, TrayCompactString szInfoTitle, uint32 dwInfoFlags, uint32 hBalloonIcon
+//   NIF_GUID     TrayGuid guidItem
+// A TrayCompactString is a uint16 count followed by that many UTF-16 units, without the terminator.
+struct TrayCompactTrayData {
+    uint32_t dwSignature;
+    uint32_t dwMessage;
+    uint32_t hWnd;
+    uint32_t uID;
+    uint32_t uFlags;
+    uint32_t uVersion; // the uTimeout/uVersion union, NIM_SETVERSION carries no flag for it
+};
+#pragma pack(pop)
+
+static_assert(sizeof(TrayFrameHeader) == 24, "TrayFrameHeader layout changed");
+static_assert(sizeof(TrayHelloMessage) == 36, "TrayHelloMessage layout changed");
+static_assert(sizeof(TrayHelloAckMessage) == 48, "TrayHelloAckMessage layout changed");
+static_assert(sizeof(TrayEventMessage) == 56, "TrayEventMessage layout changed");
+static_assert(sizeof(TrayIconImage) == 8, "TrayIconImage layout changed");
+static_assert(sizeof(TrayIconSpan) == 4, "TrayIconSpan layout changed");
+static_assert(sizeof(TrayIconDelta) == 12, "TrayIconDelta layout changed");
+static_assert(sizeof(TrayIconTile) == 4, "TrayIconTile layout changed");
+static_assert(sizeof(TrayBatchMessage) == 28, "TrayBatchMessage layout changed");
+static_assert(sizeof(TrayStatsMessage) == 68, "TrayStatsMessage layout changed");
+static_assert(sizeof(TrayStageHistogram) == 400, "TrayStageHistogram layout changed");
+static_assert(sizeof(TrayMetricsMessage) == 28, "TrayMetricsMessage layout changed");
+static_assert(sizeof(TrayRecordMessage) == 548, "TrayRecordMessage layout changed");
+static_assert(sizeof(TrayFilterMessage) == 36, "TrayFilterMessage layout changed");
+static_assert(sizeof(TrayFilterIcon) == 8, "TrayFilterIcon layout changed");
+static_assert(sizeof(TrayCommandMessage) == 44, "TrayCommandMessage layout changed");
+static_assert(sizeof(TrayCommandReplyMessage) == 40, "TrayCommandReplyMessage layout changed");
+static_assert(sizeof(TraySnapshotMessage) == 28, "TraySnapshotMessage layout changed");
+static_assert(sizeof(TrayCompactTrayData) == 24, "TrayCompactTrayData layout changed");
+static_assert(sizeof(NOTIFYICONDATA32) == 956, "NOTIFYICONDATA32 layout changed");
+static_assert(sizeof(SHELLTRAYDATA) == 964, "SHELLTRAYDATA layout changed");
+
+inline void TrayInitFrameHeader(TrayFrameHeader *header, uint16_t kind, uint32_t length, uint32_t sequence,
+                                uint64_t timestamp) {
+    header->magic = TRAY_PROTOCOL_MAGIC;
+    header->version = TRAY_PROTOCOL_VERSION;
+    header->kind = kind;
+    header->length = length;
+    header->sequence = sequence;
+    header->timestamp = timestamp;
+}
+
+// Validates the frame at data and returns its header, or nullptr if it is truncated or from another protocol.
+// minLength is the smallest frame length the caller understands for the expected kind.
+inline const TrayFrameHeader *TrayReadFrameHeader(const void *data, size_t size, size_t minLength = 0) {
+    if (size < sizeof(TrayFrameHeader))
+        return nullptr;
+    const TrayFrameHeader *header = (const TrayFrameHeader *)data;
+    if (header->magic != TRAY_PROTOCOL_MAGIC || header->version != TRAY_PROTOCOL_VERSION)
+        return nullptr;
+    if (header->length < sizeof(TrayFrameHeader) || header->length > size || header->length < minLength)
+        return nullptr;
+    return header;
+}
+
+// Log-linear bucket of a latency in nanoseconds, mirrored by histogram_bucket_low in tray_protocol.py.
+// Latencies under 256 ns fall into four 64 ns buckets and every power of two above into four equal ones,
+// so a bucket spans at most a quarter of its lower bound. The last bucket holds everything from 1.88 s up.
+inline uint32_t TrayHistogramBucket(uint64_t ns) {
+    if (ns < 256)
+        return (uint32_t)(ns >> 6);
+    uint32_t exponent = 8;
+    while (exponent < 63 && ns >> (exponent + 1))
+        exponent++;
+    uint32_t bucket = (exponent - 7) * 4 + (uint32_t)((ns >> (exponent - 2)) & 3);
+    return bucket < TRAY_HISTOGRAM_BUCKETS ? bucket : TRAY_HISTOGRAM_BUCKETS - 1;
+}
+
+// Smallest latency in nanoseconds that falls into bucket
+inline uint64_t TrayHistogramBucketLow(uint32_t bucket) {
+    if (bucket < 4)
+        return (uint64_t)bucket << 6;
+    return (uint64_t)(4 + bucket % 4) << (bucket / 4 + 5);
+}
+
+// NOTIFYICONDATA flags as used by TrayCompactTrayData, same values as shellapi.h
+#define TRAY_NIF_MESSAGE 0x00000001
+#define TRAY_NIF_ICON 0x00000002
+#define TRAY_NIF_TIP 0x00000004
+#define TRAY_NIF_STATE 0x00000008
+#define TRAY_NIF_INFO 0x00000010
+#define TRAY_NIF_GUID 0x00000020
+
+// Appends a TrayCompactString for a NUL-terminated UTF-16 array of capacity units. At most capacity - 1 units
+// are kept, Explorer drops the rest as well, so a compact payload is never larger than a SHELLTRAYDATA.
+inline size_t TrayWriteCompactString(const void *text, size_t capacity, uint8_t *out) {
+    const uint8_t *units = (const uint8_t *)text;
+    uint16_t count = 0;
+    for (uint16_t unit; count < capacity - 1; count++) {
+        memcpy(&unit, units + count * sizeof(unit), sizeof(unit));
+        if (unit == 0)
+            break;
+    }
+    if (out) {
+        memcpy(out, &count, sizeof(count));
+        memcpy(out + sizeof(count), units, (size_t)count * sizeof(uint16_t));
+    }
+    return sizeof(count) + (size_t)count * sizeof(uint16_t);
+}
+
+// Writes the TRAY_CAP_COMPACT_NID payload of data to out, or only measures it when out is nullptr.
+// Returns the payload size.
+inline size_t TrayWriteCompactTrayData(const SHELLTRAYDATA *data, uint8_t *out) {
+    const NOTIFYICONDATA32 *nid = &data->nid;
+    size_t size = 0;
+    auto field = [&](const void *value, size_t length) {
+        if (out)
+            memcpy(out + size, value, length);
+        size += length;
+    };
+    auto text = [&](const void *value, size_t capacity) {
+        size += TrayWriteCompactString(value, capacity, out ? out + size : nullptr);
+    };
+
+    TrayCompactTrayData header = {data->dwSignature, data->dwMessage, nid->hWnd, nid->uID, nid->uFlags, nid->uVersion};
+    field(&header, sizeof(header));
+    if (nid->uFlags & TRAY_NIF_MESSAGE)
+        field(&nid->uCallbackMessage, sizeof(uint32_t));
+    if (nid->uFlags & TRAY_NIF_ICON)
+        field(&nid->hIcon, sizeof(uint32_t));
+    if (nid->uFlags & TRAY_NIF_TIP)
+        text(nid->szTip, 128);
+    if (nid->uFlags & TRAY_NIF_STATE) {
+        field(&nid->dwState, sizeof(uint32_t));
+        field(&nid->dwStateMask, sizeof(uint32_t));
+    }
+    if (nid->uFlags & TRAY_NIF_INFO) {
+        text(nid->szInfo, 256);
+        text(nid->szInfoTitle, 64);
+        field(&nid->dwInfoFlags, sizeof(uint32_t));
+        field(&nid->hBalloonIcon, sizeof(uint32_t));
+    }
+    if (nid->uFlags & TRAY_NIF_GUID)
+        field(&nid->guidItem, sizeof(TrayGuid));
+    return size;
+}
+
+// Rebuilds the SHELLTRAYDATA of a TRAY_CAP_COMPACT_NID payload of size bytes, mirrored by decode_compact_tray_data
+// in tray_protocol.py. Fields without their flag stay zero. Returns false if the payload is malformed.
+inline bool TrayReadCompactTrayData(const uint8_t *data, size_t size, SHELLTRAYDATA *out) {
+    NOTIFYICONDATA32 *nid = &out->nid;
+    size_t offset = 0;
+    auto field = [&](void *value, size_t length) {
+        if (size - offset < length)
+            return false;
+        memcpy(value, data + offset, length);
+        offset += length;
+        return true;
+    };
+    auto text = [&](void *value, size_t capacity) {
+        uint16_t count;
+        if (!field(&count, sizeof(count)) || count >= capacity)
+            return false;
+        return field(value, (size_t)count * sizeof(uint16_t));
+    };
+
+    memset(out, 0, sizeof(*out));
+    TrayCompactTrayData header;
+    if (!field(&header, sizeof(header)))
+        return false;
+    out->dwSignature = header.dwSignature;
+    out->dwMessage = header.dwMessage;
+    nid->cbSize = sizeof(NOTIFYICONDATA32);
+    nid->hWnd = header.hWnd;
+    nid->uID = header.uID;
+    nid->uFlags = header.uFlags;
+    nid->uVersion = header.uVersion;
+    if (nid->uFlags & TRAY_NIF_MESSAGE && !field(&nid->uCallbackMessage, sizeof(uint32_t)))
+        return false;
+    if (nid->uFlags & TRAY_NIF_ICON && !field(&nid->hIcon, sizeof(uint32_t)))
+        return false;
+    if (nid->uFlags & TRAY_NIF_TIP && !text(nid->szTip, 128))
+        return false;
+    if (nid->uFlags & TRAY_NIF_STATE &&
+        !(field(&nid->dwState, sizeof(uint32_t)) && field(&nid->dwStateMask, sizeof(uint32_t))))
+        return false;
+    if (nid->uFlags & TRAY_NIF_INFO &&
+        !(text(nid->szInfo, 256) && text(nid->szInfoTitle, 64) && field(&nid->dwInfoFlags, sizeof(uint32_t)) &&
+          field(&nid->hBalloonIcon, sizeof(uint32_t))))
+        return false;
+    if (nid->uFlags & TRAY_NIF_GUID && !field(&nid->guidItem, sizeof(TrayGuid)))
+        return false;
+    return offset == size;
+}
@@ -1,259 +1,1898 @@
 #include <windows.h>
 
+#include "frame_slab.h"
+#include "icon_filter.h"
+#include "icon_pipeline.h"
+#include "latency_histogram.h"
+#include "pixel_kernels.h"
+#include "shm_ring.h"
+#include "spsc_ring.h"
+#include "tray_protocol.h"
+
 #define WM_YASB_UNHOOK (WM_APP + 1)
 
+#define MAX_ICON_WIDTH 256
+#define MAX_ICON_HEIGHT 256
+#define ICON_SURFACE_BYTES (MAX_ICON_WIDTH * MAX_ICON_HEIGHT * 4 * 2)
+#define ICON_SURFACE_PITCH (MAX_ICON_WIDTH * 4)
+#define EVENT_RING_CAPACITY 128
+#define PENDING_EVENT_CAPACITY 128
+#define DEFAULT_COALESCE_WINDOW_MS 50
+#define HANDSHAKE_TIMEOUT_MS 2000
+#define RECONNECT_MIN_DELAY_MS 250
+#define RECONNECT_MAX_DELAY_MS 30000
+#define ICON_TABLE_CAPACITY 256
+#define BATCH_MAX_BYTES (32 * 1024) // matches the host's pipe read buffer
+#define BATCH_LATENCY_US 5000
+#define PIPE_WRITE_SLOTS 4
+#define PIPE_WRITE_TIMEOUT_MS 500 // how often a writer waiting for a free slot checks the pipe is still alive
+#define WRITE_SLOT_WAIT_MS 2000   // longest a frame waits for a free write slot before it is dropped
+#define RING_FULL_TIMEOUT_MS PIPE_WRITE_TIMEOUT_MS
+#define BACKPRESSURE_POLL_MS 10
+#define STATS_INTERVAL_MS 1000
+#define METRICS_INTERVAL_MS 5000
+#define HOST_FRAME_MAX_SIZE (16 * 1024) // a TRAY_MSG_FILTER at its limits
+#define TRACE_QUEUE_CAPACITY 256
+#define TRACE_QUEUE_MAX_BYTES (8 * 1024 * 1024)
+#define TRACE_STOP_TIMEOUT_MS 1000  // longest the exiting writer waits for the trace thread to finish the file
+#define WRITER_STOP_TIMEOUT_MS 5000 // the watchdog's wait for the writer thread, its own waits are all shorter
+#define WRITER_EXIT_STRANDED 1      // writer exit code when it left its trace thread running
+#define MAX_EVENT_FRAME_SIZE                                                                                           \
+    (sizeof(TrayEventMessage) + sizeof(SHELLTRAYDATA) + TRAY_MAX_ICON_SIZES * sizeof(TrayIconImage) +                  \
+     MAX_ICON_WIDTH * MAX_ICON_HEIGHT * 4)
+#define TEXT_QUEUE_CAPACITY 32
+#define FRAME_SLAB_SMALL_SIZE 1024                       // text, stats, snapshot markers and TRAY_MSG_ICON_REF
+#define FRAME_SLAB_SMALL_COUNT (TEXT_QUEUE_CAPACITY + 8) // a full text queue and the writer's own small frames
+#define FRAME_SLAB_BATCH_COUNT (PIPE_WRITE_SLOTS + 2)    // every slot busy, plus the batch and a frame being built
+#define FRAME_SLAB_LARGE_COUNT 2                         // unscaled icons, only for hosts without scaled icons
+#define HOOK_CAPABILITIES                                                                                              \
+    (TRAY_CAP_ICON_REF | TRAY_CAP_BATCH | TRAY_CAP_SHM_RING | TRAY_CAP_SCALED_ICONS | TRAY_CAP_SPAN_CODEC |            \
+     TRAY_CAP_ICON_DELTA | TRAY_CAP_COMPACT_NID | TRAY_CAP_METRICS | TRAY_CAP_RECORD | TRAY_CAP_FILTER |             \
+     TRAY_CAP_COMMAND)
+
 // Global state
 WNDPROC g_OldWndProc = NULL;
 HANDLE g_hPipe = INVALID_HANDLE_VALUE;
+volatile LONG g_PipeGeneration = 0; // bumped on every new pipe connection
 HMODULE g_hModule = NULL;
-CRITICAL_SECTION g_PipeCS;
+CRITICAL_SECTION g_PipeCS; // guards connecting and closing g_hPipe, never held across a write
 volatile LONG g_Detaching = 0;
+volatile LONG g_TrayWindowGone = 0; // set on WM_NCDESTROY, the writer then closes the pipe and stays disconnected
 HANDLE g_hUnhookDoneEvent = NULL;
+HANDLE g_hWriterThread = NULL;
+HANDLE g_hWriterEvent = NULL;     // auto-reset, signalled when the tray UI thread enqueues an event
+HANDLE g_hWriterStopEvent = NULL; // manual-reset, set with g_WriterStop so no wait of the writer outlasts the stop
+volatile LONG g_WriterStop = 0;
+volatile LONG g_DroppedEvents = 0;                     // events lost because the event ring was full
+volatile LONG g_FrameSequence = 0;                     // last TrayFrameHeader.sequence on this connection
+bool g_ResyncPending = false;                          // the host missed tray state, a snapshot is due
+DWORD g_HostCapabilities = 0;                          // TRAY_CAP_* accepted in the host's TRAY_MSG_HELLO_ACK
+DWORD g_CoalesceWindowMs = DEFAULT_COALESCE_WINDOW_MS; // the host may override it in TRAY_MSG_HELLO_ACK and later
+DWORD g_HostRingSize = 0;                              // size of the host's shared memory ring, 0 = pipe only
+uint16_t g_HostIconSizes[TRAY_MAX_ICON_SIZES];         // TRAY_CAP_SCALED_ICONS sizes, largest first
+DWORD g_HostIconSizeCount = 0;
+TrayIconFilter g_IconFilter; // the host's TRAY_MSG_FILTER, owned by the writer thread once it runs
+TrayStatsMessage g_Stats = {}; // writer-owned counters, only the payload after the header is used
+LARGE_INTEGER g_QpcFrequency = {};
 
-#define MAX_ICON_WIDTH 256
-#define MAX_ICON_HEIGHT 256
-
-#pragma pack(push, 1)
-struct PipeMessageHeader {
-    DWORD type; // 1 = text, 2 = COPYDATA
-};
-
-struct PipeCopyDataMessage {
-    PipeMessageHeader header;
+// Snapshot of a single WM_COPYDATA tray message, owned by the ring until the writer pops it
+struct TrayEvent {
+    ULONGLONG timestamp; // GetTimestampUs() when Explorer received the message
     DWORDLONG dwData;
-    DWORD cbData; // size of NOTIFYICONDATA payload
-    DWORD iconWidth;
-    DWORD iconHeight;
-    DWORD iconDataSize; // 0 = no icon, >0 = RGBA bytes follow
+    DWORD cbData; // bytes of trayData that were actually sent by the caller
+    HICON hIcon; // private CopyIcon of nid.hIcon, rasterized and destroyed by the writer
+    SHELLTRAYDATA trayData;
 };
 
-struct NOTIFYICONDATA32 {
-    DWORD cbSize;
-    DWORD hWnd;
-    DWORD uID;
-    DWORD uFlags;
-    DWORD uCallbackMessage;
-    DWORD hIcon;
-    WCHAR szTip[128];
-    DWORD dwState;
-    DWORD dwStateMask;
-    WCHAR szInfo[256];
-    union {
-        UINT uTimeout;
-        UINT uVersion;
-    } DUMMYUNIONNAME;
-    WCHAR szInfoTitle[64];
-    DWORD dwInfoFlags;
-    GUID guidItem;
-    DWORD hBalloonIcon;
-};
+SpscRing<TrayEvent, EVENT_RING_CAPACITY> g_EventRing;
 
-struct SHELLTRAYDATA {
-    DWORD dwSignature;
-    DWORD dwMessage;
-    NOTIFYICONDATA32 nid;
-};
-#pragma pack(pop)
+// Logs to the debugger and queues the text for the host, which gets it once the writer thread is connected
+void DebugOutput(const char *msg);
+
+// Monotonic microseconds for TrayFrameHeader.timestamp
+ULONGLONG GetTimestampUs() {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    ULONGLONG frequency = (ULONGLONG)g_QpcFrequency.QuadPart;
+    ULONGLONG ticks = (ULONGLONG)counter.QuadPart;
+    return ticks / frequency * 1000000 + ticks % frequency * 1000000 / frequency;
+}
+
+// Hot path latencies, recorded on both threads and reported by the writer thread as TRAY_MSG_METRICS
+LatencyHistogram g_StageLatency[TRAY_STAGE_COUNT];
+
+// QPC ticks marking the start of a timed stage
+LONGLONG ReadStageClock() {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+// Records the time since ReadStageClock returned start as one sample of stage
+void RecordStageLatency(DWORD stage, LONGLONG start) {
+    ULONGLONG ticks = (ULONGLONG)(ReadStageClock() - start);
+    ULONGLONG frequency = (ULONGLONG)g_QpcFrequency.QuadPart;
+    g_StageLatency[stage].Record(ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency);
+}
+
+// Synchronous overlapped read or write with a timeout, cancels the I/O if it does not complete in time or the
+// writer is told to stop
+bool PipeIoWithTimeout(HANDLE hPipe, bool write, void *buffer, DWORD size, DWORD *transferred, DWORD timeoutMs) {
+    OVERLAPPED overlapped = {0};
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!overlapped.hEvent)
+        return false;
+
+    BOOL ok = write ? WriteFile(hPipe, buffer, size, NULL, &overlapped)
+                    : ReadFile(hPipe, buffer, size, NULL, &overlapped);
+    if (!ok && GetLastError() == ERROR_IO_PENDING) {
+        HANDLE handles[2] = {overlapped.hEvent, g_hWriterStopEvent};
+        if (WaitForMultipleObjects(g_hWriterStopEvent ? 2 : 1, handles, FALSE, timeoutMs) != WAIT_OBJECT_0) {
+            CancelIo(hPipe);
+        }
+        ok = GetOverlappedResult(hPipe, &overlapped, transferred, TRUE);
+    } else if (ok) {
+        ok = GetOverlappedResult(hPipe, &overlapped, transferred, FALSE);
+    }
+    CloseHandle(overlapped.hEvent);
+    return ok != FALSE;
+}
+
+// Takes the icon sizes of a TRAY_MSG_HELLO_ACK or TRAY_COMMAND_ICON_SIZES, sorted largest first, the order the
+// images go out in. Returns how many are usable, with none the current sizes stay.
+DWORD SetHostIconSizes(const uint16_t *sizes) {
+    uint16_t sorted[TRAY_MAX_ICON_SIZES];
+    DWORD count = 0;
+    for (DWORD i = 0; i < TRAY_MAX_ICON_SIZES; i++) {
+        uint16_t size = sizes[i];
+        if (size == 0 || size > MAX_ICON_WIDTH)
+            continue;
+        DWORD j = count++;
+        for (; j > 0 && sorted[j - 1] < size; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = size;
+    }
+    if (count > 0) {
+        memcpy(g_HostIconSizes, sorted, count * sizeof(uint16_t));
+        g_HostIconSizeCount = count;
+    }
+    return count;
+}
+
+// Reads the TRAY_MSG_FILTER a host sends right after its ack, so the snapshot of a reconnect already leaves out
+// the pixels of hidden icons
+bool ReadHandshakeFilter(HANDLE hPipe) {
+    BYTE frame[HOST_FRAME_MAX_SIZE];
+    DWORD transferred = 0;
+    if (!PipeIoWithTimeout(hPipe, false, frame, sizeof(frame), &transferred, HANDSHAKE_TIMEOUT_MS))
+        return false;
+    const TrayFrameHeader *header = TrayReadFrameHeader(frame, transferred, sizeof(TrayFilterMessage));
+    if (!header || header->kind != TRAY_MSG_FILTER)
+        return false;
+    if (!g_IconFilter.Load(frame, header->length))
+        DebugOutput("[DLL] Malformed icon filter, nothing is filtered.\n");
+    return true;
+}
+
+// Announces the hook and waits for the host to accept it. A host speaking another protocol
+// version never answers with a valid TRAY_MSG_HELLO_ACK, so the connection is refused instead
+// of misparsed.
+bool PerformHandshake(HANDLE hPipe) {
+    TrayHelloMessage hello = {};
+    TrayInitFrameHeader(&hello.header, TRAY_MSG_HELLO, sizeof(hello), 0, GetTimestampUs());
+    hello.capabilities = HOOK_CAPABILITIES;
+    hello.processId = GetCurrentProcessId();
+    // Every connection after the first one starts with SendIconSnapshot
+    hello.flags = g_PipeGeneration > 0 ? TRAY_HELLO_SNAPSHOT : 0;
+
+    DWORD transferred = 0;
+    if (!PipeIoWithTimeout(hPipe, true, &hello, sizeof(hello), &transferred, HANDSHAKE_TIMEOUT_MS))
+        return false;
+
+    BYTE reply[512];
+    if (!PipeIoWithTimeout(hPipe, false, reply, sizeof(reply), &transferred, HANDSHAKE_TIMEOUT_MS))
+        return false;
+
+    // ringSize was appended to the ack, anything before it is mandatory
+    const TrayFrameHeader *header =
+        TrayReadFrameHeader(reply, transferred, offsetof(TrayHelloAckMessage, ringSize));
+    if (!header || header->kind != TRAY_MSG_HELLO_ACK)
+        return false;
+
+    const TrayHelloAckMessage *ack = (const TrayHelloAckMessage *)reply;
+    g_HostCapabilities = ack->capabilities & HOOK_CAPABILITIES;
+    g_CoalesceWindowMs = ack->coalesceWindowMs < TRAY_MAX_COALESCE_WINDOW_MS ? ack->coalesceWindowMs
+                                                                             : TRAY_MAX_COALESCE_WINDOW_MS;
+    g_HostRingSize = header->length >= offsetof(TrayHelloAckMessage, iconSizes) ? ack->ringSize : 0;
+    if (g_HostRingSize == 0)
+        g_HostCapabilities &= ~TRAY_CAP_SHM_RING;
+
+    g_HostIconSizeCount = 0;
+    if (header->length >= offsetof(TrayHelloAckMessage, flags))
+        SetHostIconSizes(ack->iconSizes);
+    if (g_HostIconSizeCount == 0)
+        g_HostCapabilities &= ~TRAY_CAP_SCALED_ICONS;
+    g_IconFilter.Clear(); // a different host may have connected, it sends its own filter
+    bool filterFollows = header->length >= sizeof(TrayHelloAckMessage) && (ack->flags & TRAY_ACK_FILTER) &&
+                         (g_HostCapabilities & TRAY_CAP_FILTER);
+    return !filterFollows || ReadHandshakeFilter(hPipe);
+}
 
 void ConnectToPipe() {
     EnterCriticalSection(&g_PipeCS);
     if (g_hPipe == INVALID_HANDLE_VALUE) {
-        g_hPipe = CreateFileW(L"\\\\.\\pipe\\yasb_systray_monitor", GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-                              FILE_FLAG_OVERLAPPED, NULL);
+        HANDLE hPipe = CreateFileW(L"\\\\.\\pipe\\yasb_systray_monitor", GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                   OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if (hPipe != INVALID_HANDLE_VALUE) {
+            DWORD mode = PIPE_READMODE_MESSAGE;
+            g_FrameSequence = 0;
+            if (SetNamedPipeHandleState(hPipe, &mode, NULL, NULL) && PerformHandshake(hPipe)) {
+                g_hPipe = hPipe;
+                InterlockedIncrement(&g_PipeGeneration);
+            } else {
+                OutputDebugStringA("[DLL] Pipe handshake failed.\n");
+                CloseHandle(hPipe);
+            }
+        }
     }
     LeaveCriticalSection(&g_PipeCS);
 }
 
-bool ExtractIconRGBA(HICON hIcon, BYTE *&outRGBA, DWORD &outSize, DWORD &outWidth, DWORD &outHeight) {
+// Extraction surface, owned by the writer thread. One DIB section, selected into g_hIconDC, holds the icon as
+// DrawIconEx draws it, followed by its mip set: the scaled images PlanIconImages derives from it for the host's
+// sizes. Until the mips are built the second half briefly holds the AND mask of icons without alpha.
+HDC g_hIconDC = NULL;
+HBITMAP g_hIconSurface = NULL;
+BYTE *g_IconSurfaceBits = NULL;
+
+void ReleaseIconSurface() {
+    if (g_hIconDC)
+        DeleteDC(g_hIconDC); // deselects the surface
+    if (g_hIconSurface)
+        DeleteObject(g_hIconSurface);
+    g_hIconSurface = NULL;
+    g_hIconDC = NULL;
+    g_IconSurfaceBits = NULL;
+}
+
+bool InitIconSurface() {
+    BITMAPINFOHEADER surfaceInfo = {};
+    surfaceInfo.biSize = sizeof(surfaceInfo);
+    surfaceInfo.biWidth = MAX_ICON_WIDTH;
+    surfaceInfo.biHeight = -(LONG)(ICON_SURFACE_BYTES / ICON_SURFACE_PITCH);
+    surfaceInfo.biPlanes = 1;
+    surfaceInfo.biBitCount = 32;
+    surfaceInfo.biCompression = BI_RGB;
+
+    g_hIconDC = CreateCompatibleDC(NULL);
+    void *bits = NULL;
+    g_hIconSurface = CreateDIBSection(g_hIconDC, (BITMAPINFO *)&surfaceInfo, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!g_hIconDC || !g_hIconSurface || !SelectObject(g_hIconDC, g_hIconSurface)) {
+        ReleaseIconSurface();
+        return false;
+    }
+    g_IconSurfaceBits = (BYTE *)bits;
+    g_Stats.gdiObjectsCreated += 2;
+    return true;
+}
+
+// Size of the icon behind an application's nid.hIcon, so extraction only asks GDI for it when the handle changes
+struct IconSizeCache {
+    DWORD hIconValue; // 0 = nothing cached
+    DWORD width;
+    DWORD height;
+};
+
+// Size of hIcon from the bitmaps GetIconInfo copies out of it, the only GDI objects extraction creates
+bool ReadIconSize(HICON hIcon, DWORD &width, DWORD &height) {
     ICONINFO iconInfo = {};
     if (!GetIconInfo(hIcon, &iconInfo))
         return false;
+    g_Stats.gdiObjectsCreated += (iconInfo.hbmMask != NULL) + (iconInfo.hbmColor != NULL);
 
+    // Monochrome icons have no color bitmap, their mask stacks the AND and XOR halves
     BITMAP bitmap = {};
-    if (!GetObject(iconInfo.hbmColor, sizeof(bitmap), &bitmap)) {
+    bool ok = GetObject(iconInfo.hbmColor ? iconInfo.hbmColor : iconInfo.hbmMask, sizeof(bitmap), &bitmap) != 0;
+    width = (DWORD)bitmap.bmWidth;
+    height = iconInfo.hbmColor ? (DWORD)bitmap.bmHeight : (DWORD)bitmap.bmHeight / 2;
+    if (iconInfo.hbmMask)
         DeleteObject(iconInfo.hbmMask);
+    if (iconInfo.hbmColor)
         DeleteObject(iconInfo.hbmColor);
-        return false;
-    }
+    return ok;
+}
 
-    outWidth = (DWORD)bitmap.bmWidth;
-    outHeight = (DWORD)bitmap.bmHeight;
+// Packs rows drawn at the surface pitch to width pixels each, in place as every row only moves back
+void PackIconRows(BYTE *pixels, DWORD width, DWORD height) {
+    for (DWORD y = 1; y < height; y++)
+        memmove(pixels + y * width * 4, pixels + y * ICON_SURFACE_PITCH, width * 4);
+}
 
-    if (outWidth == 0 || outHeight == 0 || outWidth > MAX_ICON_WIDTH || outHeight > MAX_ICON_HEIGHT) {
-        DeleteObject(iconInfo.hbmMask);
-        DeleteObject(iconInfo.hbmColor);
+// Draws the icon into the extraction surface and reads it back as straight RGBA, outRGBA points into the surface
+// and stays valid until the next extraction. With a sizeCache an icon handle the application sent before costs no
+// GetIconInfo; one it destroyed and recycled for an icon of another size is drawn at the cached size.
+bool ExtractIconRGBA(HICON hIcon, DWORD hIconValue, IconSizeCache *sizeCache, BYTE *&outRGBA, DWORD &outSize,
+                     DWORD &outWidth, DWORD &outHeight) {
+    if (!g_IconSurfaceBits && !InitIconSurface())
         return false;
+
+    if (sizeCache && hIconValue && sizeCache->hIconValue == hIconValue) {
+        outWidth = sizeCache->width;
+        outHeight = sizeCache->height;
+    } else {
+        if (!ReadIconSize(hIcon, outWidth, outHeight))
+            return false;
+        if (sizeCache)
+            *sizeCache = {hIconValue, outWidth, outHeight};
     }
 
-    BITMAPINFOHEADER bitmapInfo = {};
-    bitmapInfo.biSize = sizeof(bitmapInfo);
-    bitmapInfo.biWidth = outWidth;
-    bitmapInfo.biHeight = -(LONG)outHeight;
-    bitmapInfo.biPlanes = 1;
-    bitmapInfo.biBitCount = 32;
-    bitmapInfo.biCompression = BI_RGB;
+    if (outWidth == 0 || outHeight == 0 || outWidth > MAX_ICON_WIDTH || outHeight > MAX_ICON_HEIGHT)
+        return false;
 
     DWORD pixelCount = outWidth * outHeight;
     outSize = pixelCount * 4;
+    outRGBA = g_IconSurfaceBits;
 
-    outRGBA = (BYTE *)HeapAlloc(GetProcessHeap(), 0, outSize);
-    if (!outRGBA) {
-        DeleteObject(iconInfo.hbmMask);
-        DeleteObject(iconInfo.hbmColor);
-        return false;
+    // Over transparent black GDI blends an icon with alpha into premultiplied pixels, and draws any other one
+    // through its masks with alpha left at zero
+    memset(g_IconSurfaceBits, 0, outHeight * ICON_SURFACE_PITCH);
+    BOOL ok = DrawIconEx(g_hIconDC, 0, 0, hIcon, outWidth, outHeight, 0, NULL, DI_NORMAL);
+    GdiFlush(); // the surface is read directly below
+    PackIconRows(outRGBA, outWidth, outHeight);
+
+    // One vectorized pass swaps to RGBA and tells whether the bitmap has an alpha channel at all
+    if (ok && SwizzleIconPixels(outRGBA, pixelCount)) {
+        UnpremultiplyIconPixels(outRGBA, pixelCount);
+    } else if (ok) {
+        // No alpha, transparency comes from the AND mask, drawn into the mip half of the surface
+        BYTE *maskBytes = g_IconSurfaceBits + ICON_SURFACE_BYTES / 2;
+        BOOL maskOk = DrawIconEx(g_hIconDC, 0, ICON_SURFACE_BYTES / 2 / ICON_SURFACE_PITCH, hIcon, outWidth,
+                                 outHeight, 0, NULL, DI_MASK);
+        GdiFlush();
+        if (maskOk)
+            PackIconRows(maskBytes, outWidth, outHeight);
+        ApplyIconMask(outRGBA, maskOk ? maskBytes : NULL, pixelCount); // mask draw failed, assume fully opaque
+    }
+
+    if (!ok) {
+        outRGBA = NULL;
+        outSize = 0;
     }
+    return ok;
+}
 
-    HDC hdc = CreateCompatibleDC(NULL);
-    BOOL ok = GetDIBits(hdc, iconInfo.hbmColor, 0, outHeight, outRGBA, (BITMAPINFO *)&bitmapInfo, DIB_RGB_COLORS) ==
-              (int)outHeight;
+// Pipe writer, owned by the writer thread which is the only one writing to g_hPipe.
+// Writes are overlapped and several can be in flight, each slot keeps its event for the lifetime of
+// the thread and owns the frame until the write completes.
+struct PipeWriteSlot {
+    OVERLAPPED overlapped;
+    HANDLE hPipe;     // handle the write was issued on
+    void *allocation; // freed on completion, NULL when the slot is idle
+};
 
-    bool isMaskBased = true;
-    for (DWORD i = 0; i < pixelCount; i++) {
-        if (outRGBA[i * 4 + 3] != 0) {
-            isMaskBased = false;
-            break;
+PipeWriteSlot g_WriteSlots[PIPE_WRITE_SLOTS];
+
+// Frame slabs. Every outgoing pipe frame, built on any thread, takes a block of the size class that fits it.
+// The slabs live in a private heap, away from Explorer's own allocations and heap lock, and blocks go back to
+// their slab once the write completes, so a steady stream of frames allocates nothing. A frame whose class has
+// no free block left comes straight from the private heap and counts as a slab miss.
+enum FrameSlabClass { FRAME_SLAB_SMALL, FRAME_SLAB_BATCH, FRAME_SLAB_LARGE, FRAME_SLAB_CLASSES };
+
+const DWORD g_FrameSlabBlockSizes[FRAME_SLAB_CLASSES] = {FRAME_SLAB_SMALL_SIZE, BATCH_MAX_BYTES,
+                                                         (MAX_EVENT_FRAME_SIZE + 7) & ~7};
+const DWORD g_FrameSlabBlockCounts[FRAME_SLAB_CLASSES] = {FRAME_SLAB_SMALL_COUNT, FRAME_SLAB_BATCH_COUNT,
+                                                          FRAME_SLAB_LARGE_COUNT};
+
+CRITICAL_SECTION g_FrameSlabCS; // guards the slabs, frames are freed on the writer thread only
+HANDLE g_hFrameHeap = NULL;
+FrameSlab g_FrameSlabs[FRAME_SLAB_CLASSES]; // regions are allocated when a class is first used
+volatile LONG g_FrameHeapAllocations = 0;   // folded into g_Stats by the writer thread
+volatile LONG g_FrameSlabMisses = 0;
+
+BYTE *AllocFrameBlock(DWORD size) {
+    int slabClass = 0;
+    while (slabClass < FRAME_SLAB_CLASSES && size > g_FrameSlabBlockSizes[slabClass])
+        slabClass++;
+
+    BYTE *block = NULL;
+    EnterCriticalSection(&g_FrameSlabCS);
+    if (!g_hFrameHeap)
+        g_hFrameHeap = HeapCreate(0, 0, 0);
+    if (g_hFrameHeap && slabClass < FRAME_SLAB_CLASSES) {
+        FrameSlab *slab = &g_FrameSlabs[slabClass];
+        if (!slab->IsInitialized()) {
+            DWORD blockSize = g_FrameSlabBlockSizes[slabClass];
+            DWORD blockCount = g_FrameSlabBlockCounts[slabClass];
+            BYTE *region = (BYTE *)HeapAlloc(g_hFrameHeap, 0, FrameSlab::RegionSize(blockSize, blockCount));
+            if (region) {
+                InterlockedIncrement(&g_FrameHeapAllocations);
+                slab->Init(region, blockSize, blockCount);
+            }
         }
+        block = slab->Alloc();
+    }
+    if (g_hFrameHeap && !block) {
+        block = (BYTE *)HeapAlloc(g_hFrameHeap, 0, size);
+        InterlockedIncrement(&g_FrameHeapAllocations);
+        InterlockedIncrement(&g_FrameSlabMisses);
+    }
+    LeaveCriticalSection(&g_FrameSlabCS);
+    return block;
+}
+
+void FreeFrameBlock(void *block) {
+    if (!block)
+        return;
+    EnterCriticalSection(&g_FrameSlabCS);
+    int slabClass = 0;
+    while (slabClass < FRAME_SLAB_CLASSES && !g_FrameSlabs[slabClass].Owns(block))
+        slabClass++;
+    if (slabClass < FRAME_SLAB_CLASSES) {
+        g_FrameSlabs[slabClass].Free(block);
+    } else {
+        HeapFree(g_hFrameHeap, 0, block);
+    }
+    LeaveCriticalSection(&g_FrameSlabCS);
+}
+
+// Text frames from any thread, handed to the writer thread under a lock held only for the enqueue
+CRITICAL_SECTION g_TextQueueCS;
+TrayFrameHeader *g_TextQueue[TEXT_QUEUE_CAPACITY];
+DWORD g_TextQueueCount = 0;
+
+// Host frames, owned by the writer thread. While connected one overlapped read stays pending on the pipe so the
+// host can send a frame at any time, its completion wakes the writer thread like a write completion does.
+OVERLAPPED g_HostRead = {};
+HANDLE g_HostReadPipe = INVALID_HANDLE_VALUE; // pipe of the pending read, INVALID_HANDLE_VALUE when there is none
+bool g_HostReadTruncated = false;             // the pending read continues a frame larger than g_HostFrame
+BYTE g_HostFrame[HOST_FRAME_MAX_SIZE];
+
+bool InitPipeWriter() {
+    for (int i = 0; i < PIPE_WRITE_SLOTS; i++) {
+        g_WriteSlots[i] = {};
+        g_WriteSlots[i].overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (!g_WriteSlots[i].overlapped.hEvent)
+            return false;
+    }
+    g_HostRead.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    return g_HostRead.hEvent != NULL;
+}
+
+// Waits for the cancelled read on hPipe to end so g_HostRead can be reused
+void AbandonHostRead(HANDLE hPipe) {
+    if (g_HostReadPipe != hPipe)
+        return;
+    DWORD transferred;
+    GetOverlappedResult(hPipe, &g_HostRead, &transferred, TRUE);
+    g_HostReadPipe = INVALID_HANDLE_VALUE;
+    g_HostReadTruncated = false;
+}
+
+// Collects the result of a finished or cancelled write and frees its frame
+bool CompletePipeWrite(PipeWriteSlot *slot) {
+    DWORD written;
+    BOOL ok = GetOverlappedResult(slot->hPipe, &slot->overlapped, &written, TRUE);
+    FreeFrameBlock(slot->allocation);
+    slot->allocation = NULL;
+    return ok != FALSE;
+}
+
+// Drops the connection after a failed or stuck write, the next frame reconnects
+void DisconnectPipe() {
+    EnterCriticalSection(&g_PipeCS);
+    HANDLE hPipe = g_hPipe;
+    g_hPipe = INVALID_HANDLE_VALUE;
+    LeaveCriticalSection(&g_PipeCS);
+    if (hPipe == INVALID_HANDLE_VALUE)
+        return;
+    g_ResyncPending = false; // the next connection starts with a snapshot anyway
+
+    CancelIoEx(hPipe, NULL);
+    for (int i = 0; i < PIPE_WRITE_SLOTS; i++) {
+        if (g_WriteSlots[i].allocation && g_WriteSlots[i].hPipe == hPipe)
+            CompletePipeWrite(&g_WriteSlots[i]);
+    }
+    AbandonHostRead(hPipe);
+    CloseHandle(hPipe);
+}
+
+// Backpressure is not a reason to reconnect, only a pipe the host has closed is
+void DisconnectPipeIfBroken() {
+    if (g_hPipe != INVALID_HANDLE_VALUE && !PeekNamedPipe(g_hPipe, NULL, 0, NULL, NULL, NULL))
+        DisconnectPipe();
+}
+
+// Frees the slots whose writes have finished
+void ReapPipeWrites() {
+    bool broken = false;
+    for (int i = 0; i < PIPE_WRITE_SLOTS; i++) {
+        PipeWriteSlot *slot = &g_WriteSlots[i];
+        if (slot->allocation && HasOverlappedIoCompleted(&slot->overlapped) && !CompletePipeWrite(slot))
+            broken = true;
+    }
+    if (broken)
+        DisconnectPipe();
+}
+
+// Events of the writes still in flight, for the writer thread's wait
+DWORD GetPipeWriteEvents(HANDLE *events) {
+    DWORD count = 0;
+    for (int i = 0; i < PIPE_WRITE_SLOTS; i++) {
+        if (g_WriteSlots[i].allocation)
+            events[count++] = g_WriteSlots[i].overlapped.hEvent;
+    }
+    return count;
+}
+
+PipeWriteSlot *FindFreeWriteSlot() {
+    ReapPipeWrites();
+    for (int i = 0; i < PIPE_WRITE_SLOTS; i++) {
+        if (!g_WriteSlots[i].allocation)
+            return &g_WriteSlots[i];
+    }
+    return NULL;
+}
+
+// A slot for the next write. When all are busy it waits up to WRITE_SLOT_WAIT_MS for one to finish, NULL means
+// the frame has to be dropped. The coalescing stage holds events back before they get here, so this wait is rare.
+PipeWriteSlot *AcquireWriteSlot() {
+    ULONGLONG start = GetTickCount64();
+    for (;;) {
+        PipeWriteSlot *slot = FindFreeWriteSlot();
+        if (slot || g_hPipe == INVALID_HANDLE_VALUE || g_WriterStop || GetTickCount64() - start >= WRITE_SLOT_WAIT_MS)
+            return slot;
+        HANDLE events[PIPE_WRITE_SLOTS + 1];
+        DWORD count = GetPipeWriteEvents(events);
+        if (g_hWriterStopEvent)
+            events[count++] = g_hWriterStopEvent;
+        if (WaitForMultipleObjects(count, events, FALSE, PIPE_WRITE_TIMEOUT_MS) == WAIT_TIMEOUT)
+            DisconnectPipeIfBroken();
+    }
+}
+
+// Starts writing a frame and returns without waiting for it. Takes ownership of allocation, which
+// holds the size bytes at data and is freed once the write is done or dropped.
+void SubmitPipeWrite(void *allocation, const void *data, DWORD size) {
+    LONGLONG start = ReadStageClock();
+    PipeWriteSlot *slot = AcquireWriteSlot();
+    HANDLE hPipe = g_hPipe;
+    if (!slot || hPipe == INVALID_HANDLE_VALUE) {
+        g_Stats.framesDropped++;
+        if (hPipe != INVALID_HANDLE_VALUE)
+            g_ResyncPending = true; // the host is still there and missed a frame
+        FreeFrameBlock(allocation);
+        return;
+    }
+
+    // WriteFile resets the slot's event when the write starts
+    if (!WriteFile(hPipe, data, size, NULL, &slot->overlapped) && GetLastError() != ERROR_IO_PENDING) {
+        FreeFrameBlock(allocation);
+        DisconnectPipe();
+        return;
     }
+    slot->hPipe = hPipe;
+    slot->allocation = allocation;
+    RecordStageLatency(TRAY_STAGE_PIPE_WRITE, start);
+}
 
-    BYTE *maskBytes = NULL;
-    BOOL maskOk = FALSE;
-    if (isMaskBased && iconInfo.hbmMask) {
-        maskBytes = (BYTE *)HeapAlloc(GetProcessHeap(), 0, outSize);
-        if (maskBytes) {
-            maskOk = GetDIBits(hdc, iconInfo.hbmMask, 0, outHeight, maskBytes, (BITMAPINFO *)&bitmapInfo,
-                               DIB_RGB_COLORS) == (int)outHeight;
+// Lets the last writes finish on shutdown, then releases the slots
+void ClosePipeWriter() {
+    HANDLE events[PIPE_WRITE_SLOTS];
+    DWORD count = GetPipeWriteEvents(events);
+    if (count > 0 && WaitForMultipleObjects(count, events, TRUE, PIPE_WRITE_TIMEOUT_MS) != WAIT_OBJECT_0) {
+        DisconnectPipe();
+    }
+    ReapPipeWrites();
+    for (int i = 0; i < PIPE_WRITE_SLOTS; i++) {
+        if (g_WriteSlots[i].overlapped.hEvent) {
+            CloseHandle(g_WriteSlots[i].overlapped.hEvent);
+            g_WriteSlots[i].overlapped.hEvent = NULL;
         }
     }
-    DeleteDC(hdc);
+    if (g_HostReadPipe != INVALID_HANDLE_VALUE) {
+        CancelIoEx(g_HostReadPipe, &g_HostRead);
+        AbandonHostRead(g_HostReadPipe);
+    }
+    if (g_HostRead.hEvent) {
+        CloseHandle(g_HostRead.hEvent);
+        g_HostRead.hEvent = NULL;
+    }
+}
 
-    if (ok) {
-        for (DWORD i = 0; i < pixelCount; i++) {
-            BYTE b = outRGBA[i * 4 + 0];
-            BYTE g = outRGBA[i * 4 + 1];
-            BYTE r = outRGBA[i * 4 + 2];
-            BYTE a = outRGBA[i * 4 + 3];
+// Callable from any thread, the frame is numbered and written later by the writer thread
+void SendTextToPipe(const char *msg) {
+    size_t msgLen = strlen(msg);
+    DWORD totalSize = (DWORD)(sizeof(TrayFrameHeader) + msgLen);
+    TrayFrameHeader *frame = (TrayFrameHeader *)AllocFrameBlock(totalSize);
+    if (!frame)
+        return;
+    TrayInitFrameHeader(frame, TRAY_MSG_TEXT, totalSize, 0, GetTimestampUs());
+    memcpy(frame + 1, msg, msgLen);
 
-            if (isMaskBased) {
-                if (maskOk && maskBytes) {
-                    a = (maskBytes[i * 4] == 255) ? 0 : 255;
-                } else {
-                    a = 255; // mask fetch failed, assume fully opaque
-                }
-            }
+    EnterCriticalSection(&g_TextQueueCS);
+    bool queued = g_TextQueueCount < TEXT_QUEUE_CAPACITY;
+    if (queued)
+        g_TextQueue[g_TextQueueCount++] = frame;
+    LeaveCriticalSection(&g_TextQueueCS);
+
+    if (queued) {
+        SetEvent(g_hWriterEvent);
+    } else {
+        FreeFrameBlock(frame);
+    }
+}
+
+bool EnsureConnected();
+
+// Writer thread: sends the text frames queued by SendTextToPipe, or just frees them when send is false
+void SendQueuedText(bool send) {
+    TrayFrameHeader *frames[TEXT_QUEUE_CAPACITY];
+    EnterCriticalSection(&g_TextQueueCS);
+    DWORD count = g_TextQueueCount;
+    memcpy(frames, g_TextQueue, count * sizeof(frames[0]));
+    g_TextQueueCount = 0;
+    LeaveCriticalSection(&g_TextQueueCS);
+    if (count == 0)
+        return;
 
-            outRGBA[i * 4 + 0] = r;
-            outRGBA[i * 4 + 1] = g;
-            outRGBA[i * 4 + 2] = b;
-            outRGBA[i * 4 + 3] = a;
+    if (send)
+        EnsureConnected();
+    for (DWORD i = 0; i < count; i++) {
+        if (send && g_hPipe != INVALID_HANDLE_VALUE) {
+            frames[i]->sequence = InterlockedIncrement(&g_FrameSequence);
+            SubmitPipeWrite(frames[i], frames[i], frames[i]->length);
+        } else {
+            FreeFrameBlock(frames[i]);
         }
+    }
+}
+
+// Runs on Explorer's tray UI thread. Snapshots the message into the ring and returns,
+// all pipe I/O happens later on the writer thread.
+void EnqueueCopyData(PCOPYDATASTRUCT pcds) {
+    if (!pcds || !pcds->lpData)
+        return;
+
+    TrayEvent *ev = g_EventRing.BeginPush();
+    if (!ev) {
+        InterlockedIncrement(&g_DroppedEvents);
+        return;
+    }
+
+    DWORD copySize = pcds->cbData < sizeof(SHELLTRAYDATA) ? pcds->cbData : (DWORD)sizeof(SHELLTRAYDATA);
+    memcpy(&ev->trayData, pcds->lpData, copySize);
+    if (copySize < sizeof(SHELLTRAYDATA)) {
+        memset((BYTE *)&ev->trayData + copySize, 0, sizeof(SHELLTRAYDATA) - copySize);
+    }
+    ev->timestamp = GetTimestampUs();
+    ev->dwData = pcds->dwData;
+    ev->cbData = copySize;
+    ev->hIcon = NULL;
+
+    // Only the copy happens inline so the handle stays valid after the caller's wndproc returns,
+    // the expensive rasterization is done by the writer thread
+    NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    if ((nid->uFlags & NIF_ICON) && nid->hIcon) {
+        ev->hIcon = CopyIcon((HICON)(ULONG_PTR)nid->hIcon);
+    }
+
+    g_EventRing.CommitPush();
+    SetEvent(g_hWriterEvent);
+}
+
+// Folds a newer NIM_MODIFY into a pending event for the same icon so only the latest state is sent.
+// Fields are taken per NIF_* flag, so an older tooltip survives a newer icon-only update.
+void MergeTrayEvent(TrayEvent *dst, TrayEvent *src) {
+    NOTIFYICONDATA32 *d = &dst->trayData.nid;
+    const NOTIFYICONDATA32 *s = &src->trayData.nid;
+
+    if (s->uFlags & NIF_MESSAGE)
+        d->uCallbackMessage = s->uCallbackMessage;
+    if (s->uFlags & NIF_ICON) {
+        d->hIcon = s->hIcon;
+        if (dst->hIcon)
+            DestroyIcon(dst->hIcon);
+        dst->hIcon = src->hIcon;
+        src->hIcon = NULL;
+    }
+    if (s->uFlags & NIF_TIP)
+        memcpy(d->szTip, s->szTip, sizeof(d->szTip));
+    if (s->uFlags & NIF_STATE) {
+        d->dwState = (d->dwState & ~s->dwStateMask) | (s->dwState & s->dwStateMask);
+        d->dwStateMask |= s->dwStateMask;
+    }
+    if (s->uFlags & NIF_INFO) {
+        memcpy(d->szInfo, s->szInfo, sizeof(d->szInfo));
+        memcpy(d->szInfoTitle, s->szInfoTitle, sizeof(d->szInfoTitle));
+        d->dwInfoFlags = s->dwInfoFlags;
+        d->uTimeout = s->uTimeout;
+    }
+    if (s->uFlags & NIF_GUID)
+        d->guidItem = s->guidItem;
+    d->uFlags |= s->uFlags;
+    if (src->cbData > dst->cbData)
+        dst->cbData = src->cbData;
+}
+
+// Shared memory transport, owned by the writer thread.
+// With TRAY_CAP_SHM_RING, frames are built in place inside the host's mapping instead of being copied
+// through the pipe. It is reopened whenever the pipe generation changes, the pipe itself stays
+// connected for the handshake, text and as the liveness check.
+HANDLE g_hRingMapping = NULL;
+BYTE *g_RingView = NULL;
+HANDLE g_hRingEvent = NULL;
+DWORD g_RingViewSize = 0;
+LONG g_RingGeneration = 0;
+ShmRingProducer g_Ring;
+
+void CloseSharedRing() {
+    g_Ring.Detach();
+    if (g_RingView) {
+        UnmapViewOfFile(g_RingView);
+        g_RingView = NULL;
+    }
+    if (g_hRingMapping) {
+        CloseHandle(g_hRingMapping);
+        g_hRingMapping = NULL;
+    }
+    if (g_hRingEvent) {
+        CloseHandle(g_hRingEvent);
+        g_hRingEvent = NULL;
+    }
+    g_RingViewSize = 0;
+}
+
+// Attaches to the ring of the current connection, returns false when frames have to go through the pipe
+bool UpdateSharedRing() {
+    LONG generation = g_PipeGeneration;
+    if (g_RingGeneration == generation)
+        return g_Ring.IsAttached();
+
+    CloseSharedRing();
+    g_RingGeneration = generation;
+    if (!(g_HostCapabilities & TRAY_CAP_SHM_RING))
+        return false;
+
+    WCHAR name[64];
+    wsprintfW(name, TRAY_SHM_RING_NAME, GetCurrentProcessId());
+    g_hRingMapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name);
+    if (g_hRingMapping) {
+        g_RingView = (BYTE *)MapViewOfFile(g_hRingMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, g_HostRingSize);
+    }
+    wsprintfW(name, TRAY_SHM_EVENT_NAME, GetCurrentProcessId());
+    g_hRingEvent = OpenEventW(EVENT_MODIFY_STATE, FALSE, name);
+
+    if (!g_RingView || !g_hRingEvent || !g_Ring.Attach(g_RingView, g_HostRingSize)) {
+        DebugOutput("[DLL] Shared memory ring unavailable, using the pipe.\n");
+        CloseSharedRing();
+        return false;
+    }
+    g_RingViewSize = g_HostRingSize;
+    return true;
+}
+
+// Space for a frame in the ring, waits for the host to catch up for at most RING_FULL_TIMEOUT_MS
+BYTE *ReserveRingFrame(DWORD size) {
+    ULONGLONG start = GetTickCount64();
+    for (;;) {
+        BYTE *frame = g_Ring.Reserve(size);
+        if (frame)
+            return frame;
+        if (g_WriterStop || GetTickCount64() - start >= RING_FULL_TIMEOUT_MS)
+            break;
+        Sleep(1);
+    }
+
+    // The host stopped reading. If it is gone for good the pipe tells, and the next frame reconnects.
+    // Otherwise it gets a snapshot once it catches up, in place of whatever this frame carried.
+    g_Stats.framesDropped++;
+    g_ResyncPending = true;
+    DisconnectPipeIfBroken();
+    return NULL;
+}
+
+// Batching stage, owned by the writer thread.
+// With TRAY_CAP_BATCH, frames are built directly in g_Batch and written as one TRAY_MSG_BATCH
+// when it is full or its oldest frame is BATCH_LATENCY_US old, instead of one pipe write each.
+BYTE *g_Batch = NULL; // BATCH_MAX_BYTES, handed to the pipe writer on flush and reallocated on demand
+DWORD g_BatchSize = sizeof(TrayBatchMessage);
+DWORD g_BatchCount = 0;
+ULONGLONG g_BatchStartUs = 0;
+LONG g_BatchGeneration = 0; // pipe connection the batched frames were numbered for
+
+void FlushBatch() {
+    if (g_BatchCount == 0)
+        return;
+
+    if (g_BatchCount == 1) {
+        // No point wrapping a single frame
+        SubmitPipeWrite(g_Batch, g_Batch + sizeof(TrayBatchMessage), g_BatchSize - sizeof(TrayBatchMessage));
     } else {
-        HeapFree(GetProcessHeap(), 0, outRGBA);
-        outRGBA = NULL;
-        outSize = 0;
-        ok = FALSE;
+        TrayBatchMessage *batch = (TrayBatchMessage *)g_Batch;
+        TrayInitFrameHeader(&batch->header, TRAY_MSG_BATCH, g_BatchSize, 0, GetTimestampUs());
+        batch->count = g_BatchCount;
+        SubmitPipeWrite(g_Batch, g_Batch, g_BatchSize);
     }
+    g_Batch = NULL;
+    g_BatchSize = sizeof(TrayBatchMessage);
+    g_BatchCount = 0;
+}
 
-    if (maskBytes)
-        HeapFree(GetProcessHeap(), 0, maskBytes);
+// True while the host is not keeping up: every pipe write slot is busy or the shared ring cannot take
+// another full-size frame. The coalescing stage then holds events back instead of blocking on writes.
+bool IsTransportBusy() {
+    if (UpdateSharedRing())
+        return g_Ring.FreeSpace() < 2 * MAX_EVENT_FRAME_SIZE; // a wrap can waste up to one more frame
+    return g_hPipe != INVALID_HANDLE_VALUE && !FindFreeWriteSlot();
+}
 
-    DeleteObject(iconInfo.hbmMask);
-    DeleteObject(iconInfo.hbmColor);
-    return ok;
+// Milliseconds until the current batch must be flushed, 0 if it is due, INFINITE if there is none
+DWORD GetBatchTimeoutMs(ULONGLONG nowUs) {
+    if (g_BatchCount == 0)
+        return INFINITE;
+    ULONGLONG dueUs = g_BatchStartUs + BATCH_LATENCY_US;
+    return dueUs > nowUs ? (DWORD)((dueUs - nowUs + 999) / 1000) : 0;
 }
 
-void InternalWriteToPipe(void *buffer, DWORD totalSize) {
-    ConnectToPipe();
+// Returns a buffer for an outgoing frame of the given size: space in the shared ring when the host
+// provides one, space in the current batch when the host accepts batches and the frame fits,
+// otherwise a frame arena block that CommitFrame writes alone
+BYTE *AllocFrame(DWORD size) {
+    if (UpdateSharedRing() && size <= g_Ring.MaxRecordSize())
+        return ReserveRingFrame(size);
 
-    EnterCriticalSection(&g_PipeCS);
-    if (g_hPipe != INVALID_HANDLE_VALUE) {
-        DWORD written;
-        OVERLAPPED overlapped = {0};
-        overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-
-        if (overlapped.hEvent) {
-            if (!WriteFile(g_hPipe, buffer, totalSize, &written, &overlapped)) {
-                if (GetLastError() == ERROR_IO_PENDING) {
-                    // Wait for a maximum of 500ms for the write to complete to avoid blocking Explorer UI
-                    if (WaitForSingleObject(overlapped.hEvent, 500) != WAIT_OBJECT_0) {
-                        CancelIo(g_hPipe);
-                        CloseHandle(g_hPipe);
-                        g_hPipe = INVALID_HANDLE_VALUE;
-                    }
-                } else {
-                    CloseHandle(g_hPipe);
-                    g_hPipe = INVALID_HANDLE_VALUE;
-                }
-            }
-            CloseHandle(overlapped.hEvent);
+    if (g_BatchCount > 0 && g_BatchGeneration != g_PipeGeneration) {
+        // The pipe was reconnected, the host resynchronizes on its own and does not expect these sequences
+        g_BatchSize = sizeof(TrayBatchMessage);
+        g_BatchCount = 0;
+    }
+    if ((g_HostCapabilities & TRAY_CAP_BATCH) && size <= BATCH_MAX_BYTES - sizeof(TrayBatchMessage)) {
+        if (g_BatchSize + size > BATCH_MAX_BYTES)
+            FlushBatch();
+        if (!g_Batch)
+            g_Batch = AllocFrameBlock(BATCH_MAX_BYTES);
+        if (g_Batch)
+            return g_Batch + g_BatchSize;
+    }
+    return AllocFrameBlock(size);
+}
+
+void CommitFrame(BYTE *frame, DWORD size) {
+    if (frame >= g_RingView && frame < g_RingView + g_RingViewSize) {
+        g_Ring.Commit();
+        SetEvent(g_hRingEvent);
+        return;
+    }
+    if (g_Batch && frame >= g_Batch && frame < g_Batch + BATCH_MAX_BYTES) {
+        if (g_BatchCount++ == 0) {
+            g_BatchStartUs = GetTimestampUs();
+            g_BatchGeneration = g_PipeGeneration;
         }
+        g_BatchSize += size;
+        return;
     }
-    LeaveCriticalSection(&g_PipeCS);
+    // Unbatched frame, keep ordering by writing out everything built before it
+    FlushBatch();
+    SubmitPipeWrite(frame, frame, size);
 }
 
-void SendTextToPipe(const char *msg) {
-    size_t msgLen = strlen(msg);
-    size_t totalSize = sizeof(PipeMessageHeader) + msgLen;
-    char *buffer = (char *)malloc(totalSize);
-    if (buffer) {
-        PipeMessageHeader header = {1}; // 1 = text
-        memcpy(buffer, &header, sizeof(header));
-        memcpy(buffer + sizeof(header), msg, msgLen);
-        InternalWriteToPipe(buffer, (DWORD)totalSize);
-        free(buffer);
+void SendTrayEventToPipe(TrayEvent *ev);
+bool IsTracing();
+void TraceTrayEvent(const TrayEvent *ev, const SHELLTRAYDATA *trayData, const BYTE *iconRGBA, DWORD iconSize,
+                    DWORD iconWidth, DWORD iconHeight);
+
+// Icon table, owned by the writer thread.
+// Every tray message is applied here before coalescing, so the table mirrors what Explorer shows.
+// Entries keep only what is needed to recreate an icon (no balloon text, no raw payload) plus a
+// private icon copy and what the host was last sent for it. On every connection after the first
+// the table is streamed to the host as a snapshot, so it never has to make every tray application
+// re-add its icons with TaskbarCreated.
+struct TrayIconEntry {
+    TrayIconKey key;
+    DWORD dwSignature;
+    DWORD uFlags; // NIF_* fields present below, never NIF_INFO
+    DWORD uCallbackMessage;
+    DWORD hIconValue; // nid.hIcon as the application passed it
+    DWORD dwState;
+    DWORD dwStateMask;
+    DWORD uVersion;
+    uint16_t szTip[128];
+    HICON hIcon; // icon copy of the last event released for this entry, rasterized for snapshots
+    IconSizeCache iconSize;
+    SentIcon sent;
+    DWORD filterGeneration; // g_IconFilter.Generation() `filtered` was matched against
+    bool filtered;
+    bool exeResolved;
+    uint16_t exe[TRAY_FILTER_MAX_EXE_LENGTH]; // lower case image name of the icon's process once resolved
+};
+
+TrayIconEntry g_IconTable[ICON_TABLE_CAPACITY]; // in NIM_ADD order
+int g_IconTableCount = 0;
+
+TrayIconEntry *FindIconEntry(const NOTIFYICONDATA32 *nid) {
+    for (int i = 0; i < g_IconTableCount; i++) {
+        if (MatchesTrayIconKey(&g_IconTable[i].key, nid))
+            return &g_IconTable[i];
+    }
+    return NULL;
+}
+
+// Lower case image name of the process owning hWnd without its extension, the way the host names it in IconData.exe
+bool GetTrayIconExe(DWORD hWnd, uint16_t *exe) {
+    DWORD processId = 0;
+    GetWindowThreadProcessId((HWND)(ULONG_PTR)hWnd, &processId);
+    HANDLE hProcess = processId ? OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId) : NULL;
+    if (!hProcess)
+        return false;
+    WCHAR path[MAX_PATH];
+    DWORD length = MAX_PATH;
+    BOOL ok = QueryFullProcessImageNameW(hProcess, 0, path, &length);
+    CloseHandle(hProcess);
+    if (!ok)
+        return false;
+    const WCHAR *name = path + length;
+    while (name > path && name[-1] != L'\\')
+        name--;
+    DWORD count = 0;
+    while (name[count] && name[count] != L'.')
+        count++;
+    if (count == 0 || count >= TRAY_FILTER_MAX_EXE_LENGTH)
+        return false;
+    memcpy(exe, name, count * sizeof(WCHAR));
+    exe[count] = 0;
+    CharLowerBuffW((LPWSTR)exe, count);
+    return true;
+}
+
+// True if the host filters the icon out, its messages then go out without pixels. Entries keep the result until
+// the filter changes, so only a new filter or a new icon costs a process lookup.
+bool IsTrayIconFiltered(TrayIconEntry *entry, const NOTIFYICONDATA32 *nid) {
+    if (!entry) {
+        if (g_IconFilter.IsEmpty())
+            return false;
+        uint16_t exe[TRAY_FILTER_MAX_EXE_LENGTH];
+        bool hasExe = g_IconFilter.HasExes() && GetTrayIconExe(nid->hWnd, exe);
+        return g_IconFilter.Matches(nid->hWnd, nid->uID, (nid->uFlags & NIF_GUID) ? &nid->guidItem : NULL,
+                                    hasExe ? exe : NULL);
+    }
+    if (entry->filterGeneration != g_IconFilter.Generation()) {
+        if (g_IconFilter.HasExes() && !entry->exeResolved)
+            entry->exeResolved = GetTrayIconExe(entry->key.hWnd, entry->exe);
+        entry->filtered = g_IconFilter.Matches(entry->key.hWnd, entry->key.uID,
+                                               entry->key.hasGuid ? &entry->key.guidItem : NULL,
+                                               entry->exeResolved ? entry->exe : NULL);
+        entry->filterGeneration = g_IconFilter.Generation();
+    }
+    return entry->filtered;
+}
+
+void ForgetSentIcon(SentIcon *sent) {
+    if (sent->pixels)
+        HeapFree(GetProcessHeap(), 0, sent->pixels);
+    *sent = {};
+}
+
+void RemoveIconEntry(TrayIconEntry *entry) {
+    if (entry->hIcon)
+        DestroyIcon(entry->hIcon);
+    ForgetSentIcon(&entry->sent);
+    int index = (int)(entry - g_IconTable);
+    memmove(entry, entry + 1, (g_IconTableCount - index - 1) * sizeof(TrayIconEntry));
+    g_IconTableCount--;
+}
+
+// Same per-flag rules as MergeTrayEvent
+void ApplyToIconEntry(TrayIconEntry *entry, const TrayEvent *ev) {
+    const NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    if (nid->uFlags & NIF_MESSAGE)
+        entry->uCallbackMessage = nid->uCallbackMessage;
+    if (nid->uFlags & NIF_ICON)
+        entry->hIconValue = nid->hIcon; // the icon itself arrives with ReleaseTrayEvent
+    if (nid->uFlags & NIF_TIP)
+        memcpy(entry->szTip, nid->szTip, sizeof(entry->szTip));
+    if (nid->uFlags & NIF_STATE) {
+        entry->dwState = (entry->dwState & ~nid->dwStateMask) | (nid->dwState & nid->dwStateMask);
+        entry->dwStateMask |= nid->dwStateMask;
+    }
+    entry->uFlags |= nid->uFlags & ~NIF_INFO; // balloons are one-shot, never replay them
+}
+
+void TrackTrayIcon(const TrayEvent *ev) {
+    const NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    TrayIconEntry *entry = FindIconEntry(nid);
+
+    switch (ev->trayData.dwMessage) {
+    case NIM_ADD:
+        if (!entry) {
+            if (g_IconTableCount == ICON_TABLE_CAPACITY)
+                return;
+            entry = &g_IconTable[g_IconTableCount++];
+            *entry = {};
+            entry->key = MakeTrayIconKey(nid);
+        } else {
+            // Re-added after TaskbarCreated: start over from this message, the pixels the host
+            // already has stay valid
+            SentIcon sent = entry->sent;
+            if (entry->hIcon)
+                DestroyIcon(entry->hIcon);
+            *entry = {};
+            entry->key = MakeTrayIconKey(nid);
+            entry->sent = sent;
+        }
+        entry->dwSignature = ev->trayData.dwSignature;
+        ApplyToIconEntry(entry, ev);
+        break;
+    case NIM_MODIFY:
+        // A modify for an icon that was never added fails in Explorer too
+        if (entry)
+            ApplyToIconEntry(entry, ev);
+        break;
+    case NIM_SETVERSION:
+        if (entry)
+            entry->uVersion = nid->uVersion;
+        break;
+    case NIM_DELETE:
+        if (entry)
+            RemoveIconEntry(entry);
+        break;
+    }
+}
+
+void ReleaseIconTable() {
+    while (g_IconTableCount > 0) {
+        RemoveIconEntry(&g_IconTable[g_IconTableCount - 1]);
     }
 }
 
-void SendCopyDataToPipe(PCOPYDATASTRUCT pcds) {
-    if (!pcds)
+// Ends an event's time in the writer, sent or not. An icon change hands its icon copy over to the icon table,
+// so the table never needs a CopyIcon of its own: events of one icon leave in order, the last one is current.
+// An event whose copy was merged into a newer one leaves the table alone.
+void ReleaseTrayEvent(TrayEvent *ev) {
+    const NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    TrayIconEntry *entry = (nid->uFlags & NIF_ICON) && (ev->hIcon || !nid->hIcon) ? FindIconEntry(nid) : NULL;
+    if (entry && entry->hIcon != ev->hIcon) {
+        if (entry->hIcon)
+            DestroyIcon(entry->hIcon);
+        entry->hIcon = ev->hIcon;
+    } else if (!entry && ev->hIcon) {
+        DestroyIcon(ev->hIcon);
+    }
+    ev->hIcon = NULL;
+}
+
+// Rebuilds the NIM_ADD that recreates an entry. The event borrows the entry's icon, ReleaseTrayEvent keeps it.
+void MakeSnapshotEvent(const TrayIconEntry *entry, TrayEvent *ev) {
+    *ev = {};
+    ev->timestamp = GetTimestampUs();
+    ev->dwData = 1;
+    ev->cbData = sizeof(SHELLTRAYDATA);
+    ev->hIcon = entry->hIcon;
+    ev->trayData.dwSignature = entry->dwSignature;
+    ev->trayData.dwMessage = NIM_ADD;
+
+    NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    nid->cbSize = sizeof(NOTIFYICONDATA32);
+    nid->hWnd = entry->key.hWnd;
+    nid->uID = entry->key.uID;
+    nid->guidItem = entry->key.guidItem;
+    nid->uFlags = entry->uFlags;
+    nid->uCallbackMessage = entry->uCallbackMessage;
+    nid->hIcon = entry->hIconValue;
+    nid->dwState = entry->dwState;
+    nid->dwStateMask = entry->dwStateMask;
+    nid->uVersion = entry->uVersion;
+    memcpy(nid->szTip, entry->szTip, sizeof(nid->szTip));
+}
+
+void SendSnapshotMarker(uint16_t kind, DWORD count) {
+    BYTE *frame = AllocFrame(sizeof(TraySnapshotMessage));
+    if (!frame)
         return;
+    TraySnapshotMessage *msg = (TraySnapshotMessage *)frame;
+    TrayInitFrameHeader(&msg->header, kind, sizeof(TraySnapshotMessage), InterlockedIncrement(&g_FrameSequence),
+                        GetTimestampUs());
+    msg->count = count;
+    CommitFrame(frame, sizeof(TraySnapshotMessage));
+}
 
+// Streams the whole table ahead of anything else on the new connection. The writer thread is the only
+// one touching the table and tray messages wait in the event ring meanwhile, so the snapshot is consistent.
+void SendIconSnapshot() {
+    DWORD count = (DWORD)g_IconTableCount;
+    SendSnapshotMarker(TRAY_MSG_SNAPSHOT_BEGIN, count);
+    for (DWORD i = 0; i < count && g_hPipe != INVALID_HANDLE_VALUE; i++) {
+        TrayEvent ev;
+        MakeSnapshotEvent(&g_IconTable[i], &ev);
+        SendTrayEventToPipe(&ev);
+        ReleaseTrayEvent(&ev);
+    }
+    SendSnapshotMarker(TRAY_MSG_SNAPSHOT_END, count);
+    FlushBatch();
+}
+
+// Reconnect stage, owned by the writer thread.
+// A lost connection is retried in the background with exponential backoff instead of on every frame.
+// Messages keep flowing into the icon table meanwhile and the host gets a snapshot once it is back.
+ULONGLONG g_NextConnectTick = 0;
+DWORD g_ReconnectDelayMs = RECONNECT_MIN_DELAY_MS;
+
+bool EnsureConnected() {
+    if (g_hPipe != INVALID_HANDLE_VALUE)
+        return true;
+    ULONGLONG now = GetTickCount64();
+    if (now < g_NextConnectTick || g_WriterStop || g_TrayWindowGone)
+        return false;
+
+    bool snapshot = g_PipeGeneration > 0;
+    ConnectToPipe();
+    if (g_hPipe == INVALID_HANDLE_VALUE) {
+        g_NextConnectTick = now + g_ReconnectDelayMs;
+        g_ReconnectDelayMs = g_ReconnectDelayMs * 2 < RECONNECT_MAX_DELAY_MS ? g_ReconnectDelayMs * 2
+                                                                              : RECONNECT_MAX_DELAY_MS;
+        return false;
+    }
+    g_ReconnectDelayMs = RECONNECT_MIN_DELAY_MS;
+    if (snapshot)
+        SendIconSnapshot();
+    return g_hPipe != INVALID_HANDLE_VALUE;
+}
+
+// Milliseconds until the next reconnect attempt, INFINITE while connected or once the tray window is gone
+DWORD GetReconnectTimeout(ULONGLONG now) {
+    if (g_hPipe != INVALID_HANDLE_VALUE || g_TrayWindowGone)
+        return INFINITE;
+    return g_NextConnectTick > now ? (DWORD)(g_NextConnectTick - now) : 0;
+}
+
+// What the host negotiated for the current connection, mips go to the second half of the extraction surface
+IconPipelineConfig GetIconPipelineConfig() {
+    IconPipelineConfig config = {};
+    config.capabilities = g_HostCapabilities;
+    config.generation = g_PipeGeneration;
+    config.iconSizes = g_HostIconSizes;
+    config.iconSizeCount = g_HostIconSizeCount;
+    config.scratch = g_IconSurfaceBits + ICON_SURFACE_BYTES / 2;
+    config.scratchSize = ICON_SURFACE_BYTES / 2;
+    return config;
+}
+
+// Records what a frame carried, keeping the images as the next delta base when they are small enough
+void RememberSentIcon(SentIcon *sent, const TrayEventFrame *frame, const IconPipelineConfig *config) {
+    DWORD size = SentIconBaseSize(frame, config);
+    if (size == 0 || sent->capacity < size) {
+        if (sent->pixels)
+            HeapFree(GetProcessHeap(), 0, sent->pixels);
+        sent->pixels = size ? (BYTE *)HeapAlloc(GetProcessHeap(), 0, size) : NULL;
+        sent->capacity = sent->pixels ? size : 0;
+        if (size)
+            g_Stats.heapAllocations++;
+    }
+    StoreSentIcon(sent, frame, config);
+}
+
+void SendTrayEventToPipe(TrayEvent *ev) {
     BYTE *iconRGBA = NULL;
     DWORD iconSize = 0, iconWidth = 0, iconHeight = 0;
 
-    SHELLTRAYDATA *trayData = (SHELLTRAYDATA *)pcds->lpData;
-    if (!trayData) {
+    // Connect first so the icon hash cache generation and the negotiated capabilities
+    // match the pipe this message goes to. While disconnected the icon table keeps the state,
+    // only a running trace still wants the message.
+    bool connected = EnsureConnected();
+    if (!connected && !IsTracing()) {
+        return;
+    }
+
+    LONGLONG buildStart = ReadStageClock();
+    TrayIconEntry *entry = FindIconEntry(&ev->trayData.nid);
+    const SHELLTRAYDATA *trayData = &ev->trayData;
+    SHELLTRAYDATA metadata;
+    if (IsTrayIconFiltered(entry, &ev->trayData.nid)) {
+        // Hidden by the host: the message still goes out so it can track the icon, but never its pixels
+        metadata = ev->trayData;
+        metadata.nid.uFlags &= ~NIF_ICON;
+        metadata.nid.hIcon = 0;
+        trayData = &metadata;
+    } else if (ev->hIcon) {
+        // We are processing icons directly to avoid stale hIcon handles on Python side
+        LONGLONG extractStart = ReadStageClock();
+        if (!ExtractIconRGBA(ev->hIcon, ev->trayData.nid.hIcon, entry ? &entry->iconSize : NULL, iconRGBA, iconSize,
+                             iconWidth, iconHeight))
+            iconSize = 0;
+        RecordStageLatency(TRAY_STAGE_ICON_EXTRACT, extractStart);
+    }
+    // Before planning the frame, which premultiplies the pixels in place
+    if (IsTracing())
+        TraceTrayEvent(ev, trayData, iconRGBA, iconSize, iconWidth, iconHeight);
+    if (!connected)
         return;
+
+    IconPipelineConfig config = GetIconPipelineConfig();
+    TrayEventFrame frame;
+    DWORD totalSize = PlanTrayEventFrame(&frame, &config, ev->dwData, ev->cbData, trayData, iconRGBA, iconSize,
+                                         iconWidth, iconHeight, entry ? &entry->sent : NULL);
+    TrayInitFrameHeader(&frame.msg.header, frame.kind, totalSize, InterlockedIncrement(&g_FrameSequence),
+                        ev->timestamp);
+    BYTE *buffer = AllocFrame(totalSize);
+    if (buffer) {
+        WriteTrayEventFrame(buffer, &frame);
+        CommitFrame(buffer, totalSize);
+    }
+
+    if (entry && frame.kind != TRAY_MSG_ICON_REF && frame.msg.iconHash) {
+        if (buffer) {
+            RememberSentIcon(&entry->sent, &frame, &config);
+        } else {
+            ForgetSentIcon(&entry->sent); // the host never got these pixels
+        }
+    }
+    RecordStageLatency(TRAY_STAGE_FRAME_BUILD, buildStart);
+}
+
+// Coalescing stage, owned by the writer thread.
+// NIM_MODIFY events wait up to g_CoalesceWindowMs and absorb later modifies for the same icon.
+// Any other message first releases the icon's pending modify, so per-icon ordering of
+// NIM_ADD/NIM_DELETE relative to modifies is preserved. Icons never block each other.
+// The table doubles as the bounded outbound queue: while the transport is busy due events stay here
+// and keep absorbing modifies, and when it fills up superseded modifies are dropped. Anything else that
+// overflows is folded into the icon table and reaches the host with the next snapshot, the writer never
+// stops draining the event ring for a slow host.
+struct PendingEvent {
+    TrayEvent ev;
+    ULONGLONG dueTick;
+};
+
+PendingEvent g_PendingPool[PENDING_EVENT_CAPACITY];
+PendingEvent *g_PendingFree[PENDING_EVENT_CAPACITY];
+PendingEvent *g_PendingOrder[PENDING_EVENT_CAPACITY]; // arrival order
+int g_PendingFreeCount = 0;
+int g_PendingCount = 0;
+bool g_Backpressure = false; // due events are being held back until the host catches up
+
+void InitPendingEvents() {
+    for (int i = 0; i < PENDING_EVENT_CAPACITY; i++) {
+        g_PendingFree[i] = &g_PendingPool[i];
     }
+    g_PendingFreeCount = PENDING_EVENT_CAPACITY;
+    g_PendingCount = 0;
+}
+
+void RemovePendingEvent(int index) {
+    g_PendingFree[g_PendingFreeCount++] = g_PendingOrder[index];
+    memmove(&g_PendingOrder[index], &g_PendingOrder[index + 1], (g_PendingCount - index - 1) * sizeof(PendingEvent *));
+    g_PendingCount--;
+}
+
+// Latest pending event for the same icon, or -1
+int FindPendingEvent(const NOTIFYICONDATA32 *nid) {
+    for (int i = g_PendingCount - 1; i >= 0; i--) {
+        if (IsSameTrayIcon(&g_PendingOrder[i]->ev.trayData.nid, nid))
+            return i;
+    }
+    return -1;
+}
 
-    NOTIFYICONDATA32 *nid = &trayData->nid;
-    if (nid && (nid->uFlags & NIF_ICON) && nid->hIcon) {
-        HICON hIconCopy = CopyIcon((HICON)(ULONG_PTR)nid->hIcon);
-        if (hIconCopy) {
-            // We are processing icons directly to avoid stale hIcon handles on Python side
-            ExtractIconRGBA(hIconCopy, iconRGBA, iconSize, iconWidth, iconHeight);
-            DestroyIcon(hIconCopy);
+void SendDuePendingEvents(ULONGLONG now, bool flushAll) {
+    bool wasBackpressured = g_Backpressure;
+    g_Backpressure = false;
+    for (int i = 0; i < g_PendingCount;) {
+        PendingEvent *pending = g_PendingOrder[i];
+        if (!flushAll && pending->dueTick > now) {
+            i++;
+            continue;
+        }
+        if (!flushAll && IsTransportBusy()) {
+            // Stop at the first due event so nothing overtakes it
+            g_Backpressure = true;
+            if (!wasBackpressured)
+                g_Stats.backpressureEvents++;
+            return;
         }
+        if (!g_WriterStop) {
+            SendTrayEventToPipe(&pending->ev);
+        }
+        ReleaseTrayEvent(&pending->ev);
+        RemovePendingEvent(i);
     }
+}
+
+// Milliseconds until the earliest pending modify is due, INFINITE if nothing is pending
+DWORD GetCoalesceTimeout(ULONGLONG now) {
+    if (g_ResyncPending)
+        return BACKPRESSURE_POLL_MS; // polls for room for the snapshot
+    if (g_PendingCount == 0)
+        return INFINITE;
+    if (g_Backpressure)
+        return BACKPRESSURE_POLL_MS; // ring space is not signalled, write completions wake the writer early
+    ULONGLONG earliest = g_PendingOrder[0]->dueTick;
+    for (int i = 1; i < g_PendingCount; i++) {
+        if (g_PendingOrder[i]->dueTick < earliest)
+            earliest = g_PendingOrder[i]->dueTick;
+    }
+    return earliest > now ? (DWORD)(earliest - now) : 0;
+}
 
-    PipeCopyDataMessage msg = {};
-    msg.header.type = 2;
-    msg.dwData = pcds->dwData;
-    msg.cbData = (DWORD)pcds->cbData;
-    msg.iconWidth = iconWidth;
-    msg.iconHeight = iconHeight;
+// Pending modify to give up when the table is full, one that a later event for the same icon supersedes, or -1.
+// Nothing else is ever dropped.
+int FindDroppablePendingEvent() {
+    for (int i = 0; i < g_PendingCount; i++) {
+        const TrayEvent *ev = &g_PendingOrder[i]->ev;
+        if (ev->trayData.dwMessage == NIM_MODIFY && FindPendingEvent(&ev->trayData.nid) != i)
+            return i;
+    }
+    return -1;
+}
+
+// Gives up every pending event unsent. TrackTrayIcon applied them to the icon table on arrival already.
+void FoldPendingEvents() {
+    for (int i = 0; i < g_PendingCount; i++) {
+        ReleaseTrayEvent(&g_PendingOrder[i]->ev); // in arrival order, the last icon copy of each entry stays
+    }
+    InitPendingEvents();
+}
+
+// Frees table space without ever waiting for the host. While it keeps up the oldest event is simply sent
+// early, otherwise a superseded modify is dropped. A table full of anything else is given up as a whole:
+// TrackTrayIcon already applied every event to the icon table, so the snapshot ResyncHostIfDue sends once
+// the host catches up adds, updates and (by leaving them out) deletes the icons these events were about.
+void MakePendingRoom() {
+    if (!IsTransportBusy()) {
+        PendingEvent *oldest = g_PendingOrder[0];
+        if (!g_WriterStop) {
+            SendTrayEventToPipe(&oldest->ev);
+        }
+        ReleaseTrayEvent(&oldest->ev);
+        RemovePendingEvent(0);
+        return;
+    }
+    int index = FindDroppablePendingEvent();
+    if (index >= 0) {
+        ReleaseTrayEvent(&g_PendingOrder[index]->ev);
+        RemovePendingEvent(index);
+        g_Stats.modifiesDropped++;
+        return;
+    }
+
+    g_Stats.backpressureEvents++;
+    g_ResyncPending = true;
+    FoldPendingEvents();
+}
+
+// Streams the icon table to the host. Pending events are older than the table the snapshot is made of, sent after
+// it they would replay what the snapshot already holds.
+void ResyncHost() {
+    FoldPendingEvents();
+    SendIconSnapshot();
+}
+
+// Sends the snapshot a pending table overflow or a dropped frame made due, once the transport has room for it.
+// Until then the writer folds every tray message straight into the icon table.
+void ResyncHostIfDue() {
+    if (!g_ResyncPending || IsTransportBusy())
+        return;
+    g_ResyncPending = false;
+    ResyncHost();
+}
+
+void QueuePendingEvent(TrayEvent *ev, ULONGLONG now) {
+    if (g_ResyncPending) {
+        ReleaseTrayEvent(ev); // already in the icon table, the snapshot carries it
+        return;
+    }
+
+    int index = FindPendingEvent(&ev->trayData.nid);
+
+    if (ev->trayData.dwMessage == NIM_MODIFY) {
+        if (index >= 0) {
+            DWORD previous = g_PendingOrder[index]->ev.trayData.dwMessage;
+            if (previous == NIM_MODIFY || previous == NIM_ADD) {
+                MergeTrayEvent(&g_PendingOrder[index]->ev, ev);
+                ReleaseTrayEvent(ev);
+                g_Stats.modifiesCoalesced++;
+                return;
+            }
+        }
+    } else {
+        // Release this icon's waiting modifies before the new message so they stay in order,
+        // a delete makes them pointless so they are discarded instead
+        for (int i = 0; i < g_PendingCount;) {
+            PendingEvent *pending = g_PendingOrder[i];
+            if (pending->ev.trayData.dwMessage == NIM_MODIFY &&
+                IsSameTrayIcon(&pending->ev.trayData.nid, &ev->trayData.nid)) {
+                if (ev->trayData.dwMessage == NIM_DELETE) {
+                    ReleaseTrayEvent(&pending->ev);
+                    RemovePendingEvent(i);
+                    continue;
+                }
+                pending->dueTick = now;
+            }
+            i++;
+        }
+    }
+
+    if (g_PendingFreeCount == 0) {
+        MakePendingRoom();
+        if (g_ResyncPending) {
+            ReleaseTrayEvent(ev);
+            return;
+        }
+    }
+
+    PendingEvent *pending = g_PendingFree[--g_PendingFreeCount];
+    pending->ev = *ev;
+    pending->dueTick = ev->trayData.dwMessage == NIM_MODIFY ? now + g_CoalesceWindowMs : now;
+    g_PendingOrder[g_PendingCount++] = pending;
+    ev->hIcon = NULL; // ownership moved to the pending table
+    if ((DWORD)g_PendingCount > g_Stats.queueHighWater)
+        g_Stats.queueHighWater = g_PendingCount;
+}
+
+TrayStatsMessage g_StatsSent = {};
+ULONGLONG g_StatsSentTick = 0;
+
+void SendStats(ULONGLONG now) {
+    BYTE *frame = AllocFrame(sizeof(TrayStatsMessage));
+    if (!frame)
+        return;
+    g_Stats.gdiObjects = GetGuiResources(GetCurrentProcess(), GR_GDIOBJECTS);
+    g_Stats.userObjects = GetGuiResources(GetCurrentProcess(), GR_USEROBJECTS);
+    TrayInitFrameHeader(&g_Stats.header, TRAY_MSG_STATS, sizeof(TrayStatsMessage),
+                        InterlockedIncrement(&g_FrameSequence), GetTimestampUs());
+    memcpy(frame, &g_Stats, sizeof(TrayStatsMessage));
+    CommitFrame(frame, sizeof(TrayStatsMessage));
+    g_StatsSent = g_Stats;
+    g_StatsSentTick = now;
+}
+
+// Reports g_Stats to the host at most every STATS_INTERVAL_MS, and only when a counter moved
+void SendStatsIfChanged(ULONGLONG now) {
+    if (now - g_StatsSentTick < STATS_INTERVAL_MS || g_Backpressure || g_hPipe == INVALID_HANDLE_VALUE)
+        return;
+    // The object counts are sampled for the report, they alone do not make one
+    if (memcmp(&g_Stats.eventsDropped, &g_StatsSent.eventsDropped,
+               offsetof(TrayStatsMessage, gdiObjects) - sizeof(TrayFrameHeader)) != 0)
+        SendStats(now);
+}
+
+uint32_t g_MetricsSentMessages = 0; // TRAY_STAGE_COPYDATA samples in the last TRAY_MSG_METRICS
+ULONGLONG g_MetricsSentTick = 0;
+
+void SendMetrics(ULONGLONG now) {
+    uint32_t messages = g_StageLatency[TRAY_STAGE_COPYDATA].Count();
+    DWORD size = sizeof(TrayMetricsMessage) + TRAY_STAGE_COUNT * sizeof(TrayStageHistogram);
+    BYTE *frame = AllocFrame(size);
+    if (!frame)
+        return;
+    TrayMetricsMessage *msg = (TrayMetricsMessage *)frame;
+    TrayInitFrameHeader(&msg->header, TRAY_MSG_METRICS, size, InterlockedIncrement(&g_FrameSequence),
+                        GetTimestampUs());
+    msg->stageCount = TRAY_STAGE_COUNT;
+    TrayStageHistogram *stages = (TrayStageHistogram *)(msg + 1);
+    for (DWORD i = 0; i < TRAY_STAGE_COUNT; i++) {
+        g_StageLatency[i].Snapshot(&stages[i]);
+    }
+    CommitFrame(frame, size);
+    g_MetricsSentMessages = messages;
+    g_MetricsSentTick = now;
+}
+
+// Reports the stage histograms at most every METRICS_INTERVAL_MS to a host that takes them, and only after
+// Explorer handled tray messages since the last report: the other stages all follow from those
+void SendMetricsIfChanged(ULONGLONG now) {
+    if (!(g_HostCapabilities & TRAY_CAP_METRICS) || now - g_MetricsSentTick < METRICS_INTERVAL_MS || g_Backpressure ||
+        g_hPipe == INVALID_HANDLE_VALUE)
+        return;
+    if (g_StageLatency[TRAY_STAGE_COPYDATA].Count() != g_MetricsSentMessages)
+        SendMetrics(now);
+}
+
+// Trace recording, switched on and off by the host with TRAY_MSG_RECORD.
+// The writer thread turns each tray message leaving the coalescing stage into a trace frame and queues it for
+// the trace thread, the only one touching the file, so a slow disk never holds up the pipe. Frames live in a
+// heap of their own that goes away with the trace. They are dropped while TRACE_QUEUE_MAX_BYTES wait for the
+// disk, and the trace stops by itself at the size the host asked for. Stopping never blocks the writer: it only
+// flags the trace thread and reaps it from its wait loop once the file is closed.
+struct TraceFrame {
+    BYTE *data; // from g_hTraceHeap
+    DWORD size;
+};
+
+SpscRing<TraceFrame, TRACE_QUEUE_CAPACITY> g_TraceQueue;
+HANDLE g_hTraceThread = NULL;
+HANDLE g_hTraceEvent = NULL; // auto-reset, signalled for every queued frame
+HANDLE g_hTraceHeap = NULL;
+volatile LONG g_TraceStop = 0;        // the trace thread writes what is queued, closes the file and exits
+volatile LONG g_TraceQueuedBytes = 0; // queued but not written yet
+ULONGLONG g_TraceBytes = 0;           // queued since the trace started, written or not
+ULONGLONG g_TraceMaxBytes = 0;
+DWORD g_TraceSequence = 0;
+DWORD g_TraceFramesDropped = 0;
+WCHAR g_NextTracePath[TRAY_RECORD_PATH_CAPACITY] = {}; // waits for the stopping trace thread when set
+DWORD g_NextTraceMaxBytes = 0;
+
+DWORD WINAPI TraceThread(LPVOID lpParam) {
+    HANDLE hFile = (HANDLE)lpParam;
+    for (;;) {
+        WaitForSingleObject(g_hTraceEvent, INFINITE);
+        // Read before draining, so every frame queued ahead of the stop still reaches the file
+        bool stop = g_TraceStop != 0;
+        TraceFrame *frame;
+        while ((frame = g_TraceQueue.Front()) != NULL) {
+            TraceFrame item = *frame;
+            g_TraceQueue.Pop();
+            DWORD written;
+            WriteFile(hFile, item.data, item.size, &written, NULL);
+            InterlockedExchangeAdd(&g_TraceQueuedBytes, -(LONG)item.size);
+            HeapFree(g_hTraceHeap, 0, item.data);
+        }
+        if (stop) {
+            CloseHandle(hFile);
+            return 0;
+        }
+    }
+}
+
+bool IsTracing() {
+    return g_hTraceThread && !g_TraceStop;
+}
+
+// Asks the trace thread to write everything still queued and close the file, without waiting for it.
+// The writer reaps the thread once it exits; until then IsTracing is false and nothing new gets queued.
+void RequestTraceStop() {
+    if (!g_hTraceThread || g_TraceStop)
+        return;
+    InterlockedExchange(&g_TraceStop, 1);
+    SetEvent(g_hTraceEvent);
+}
+
+void OpenTrace(const WCHAR *path, DWORD maxBytes);
+
+// Releases a trace thread that has exited, then opens the trace queued behind it, if any
+void ReapTraceThread() {
+    if (g_hTraceThread && g_TraceStop && WaitForSingleObject(g_hTraceThread, 0) == WAIT_OBJECT_0) {
+        CloseHandle(g_hTraceThread);
+        CloseHandle(g_hTraceEvent);
+        HeapDestroy(g_hTraceHeap);
+        g_hTraceThread = NULL;
+        g_hTraceEvent = NULL;
+        g_hTraceHeap = NULL;
+        g_TraceStop = 0;
+        g_TraceQueuedBytes = 0;
+
+        char buf[128];
+        wsprintfA(buf, "[DLL] Trace stopped, %lu bytes, %lu frames dropped.\n", (DWORD)g_TraceBytes,
+                  g_TraceFramesDropped);
+        DebugOutput(buf);
+    }
+    if (!g_hTraceThread && g_NextTracePath[0]) {
+        OpenTrace(g_NextTracePath, g_NextTraceMaxBytes);
+        g_NextTracePath[0] = 0;
+    }
+}
+
+// Closes the trace on the way out, giving the trace thread TRACE_STOP_TIMEOUT_MS to finish the file. Returns
+// false when it is still busy with the disk: it keeps its file, queue and heap, and g_hTraceThread stays set so
+// the watchdog never unloads the DLL under it.
+bool StopTrace() {
+    g_NextTracePath[0] = 0;
+    RequestTraceStop();
+    if (g_hTraceThread)
+        WaitForSingleObject(g_hTraceThread, TRACE_STOP_TIMEOUT_MS);
+    ReapTraceThread();
+    if (g_hTraceThread) {
+        DebugOutput("[DLL] Trace thread is stuck writing, the trace stays open.\n");
+        return false;
+    }
+    return true;
+}
+
+// Space for a trace frame, NULL when it has to be dropped
+BYTE *AllocTraceFrame(DWORD size) {
+    if (g_TraceBytes + size > g_TraceMaxBytes) {
+        RequestTraceStop();
+        return NULL;
+    }
+    if (g_TraceQueuedBytes + size > TRACE_QUEUE_MAX_BYTES) {
+        g_TraceFramesDropped++;
+        return NULL;
+    }
+    BYTE *frame = (BYTE *)HeapAlloc(g_hTraceHeap, 0, size);
+    if (!frame)
+        g_TraceFramesDropped++;
+    return frame;
+}
+
+void QueueTraceFrame(BYTE *frame, DWORD size) {
+    TraceFrame *slot = g_TraceQueue.BeginPush();
+    if (!slot) {
+        HeapFree(g_hTraceHeap, 0, frame);
+        g_TraceFramesDropped++;
+        return;
+    }
+    slot->data = frame;
+    slot->size = size;
+    InterlockedExchangeAdd(&g_TraceQueuedBytes, (LONG)size);
+    g_TraceQueue.CommitPush();
+    g_TraceBytes += size;
+    SetEvent(g_hTraceEvent);
+}
+
+// Replaces any running trace with a new file at path, opened once the old trace thread has closed its file
+void StartTrace(const WCHAR *path, DWORD maxBytes) {
+    RequestTraceStop();
+    memcpy(g_NextTracePath, path, sizeof(g_NextTracePath));
+    g_NextTraceMaxBytes = maxBytes;
+    ReapTraceThread();
+}
+
+void OpenTrace(const WCHAR *path, DWORD maxBytes) {
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    g_hTraceHeap = HeapCreate(0, 0, 0);
+    g_hTraceEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (hFile != INVALID_HANDLE_VALUE && g_hTraceHeap && g_hTraceEvent)
+        g_hTraceThread = CreateThread(NULL, 0, TraceThread, hFile, 0, NULL);
+    if (!g_hTraceThread) {
+        if (hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(hFile);
+        if (g_hTraceHeap)
+            HeapDestroy(g_hTraceHeap);
+        if (g_hTraceEvent)
+            CloseHandle(g_hTraceEvent);
+        g_hTraceHeap = NULL;
+        g_hTraceEvent = NULL;
+        DebugOutput("[DLL] Failed to start the trace.\n");
+        return;
+    }
+    g_TraceBytes = 0;
+    g_TraceMaxBytes = maxBytes;
+    g_TraceSequence = 0;
+    g_TraceFramesDropped = 0;
+
+    // Opens the trace like a connection, so a reader checks the protocol version the same way
+    TrayHelloMessage hello = {};
+    TrayInitFrameHeader(&hello.header, TRAY_MSG_HELLO, sizeof(hello), 0, GetTimestampUs());
+    hello.capabilities = HOOK_CAPABILITIES;
+    hello.processId = GetCurrentProcessId();
+    BYTE *frame = AllocTraceFrame(sizeof(hello));
+    if (frame) {
+        memcpy(frame, &hello, sizeof(hello));
+        QueueTraceFrame(frame, sizeof(hello));
+    }
+    DebugOutput("[DLL] Trace started.\n");
+}
+
+// Records a tray message the way it leaves the coalescing stage, with the straight pixels extracted for the pipe
+void TraceTrayEvent(const TrayEvent *ev, const SHELLTRAYDATA *trayData, const BYTE *iconRGBA, DWORD iconSize,
+                    DWORD iconWidth, DWORD iconHeight) {
+    TrayEventMessage msg = {};
+    msg.dwData = ev->dwData;
+    msg.cbData = ev->cbData;
+    msg.iconWidth = iconSize ? iconWidth : 0;
+    msg.iconHeight = iconSize ? iconHeight : 0;
     msg.iconDataSize = iconSize;
+    msg.iconHash = iconSize ? HashIconPixels(iconRGBA, iconSize, iconWidth, iconHeight) : 0;
+    DWORD totalSize = sizeof(msg) + msg.cbData + iconSize;
+    TrayInitFrameHeader(&msg.header, TRAY_MSG_TRAY_EVENT, totalSize, ++g_TraceSequence, ev->timestamp);
 
-    size_t totalSize = sizeof(msg) + msg.cbData + msg.iconDataSize;
-    char *buffer = (char *)malloc(totalSize);
-    if (buffer) {
-        char *cursor = buffer;
-        memcpy(cursor, &msg, sizeof(msg));
-        cursor += sizeof(msg);
-        if (msg.cbData > 0 && pcds->lpData) {
-            memcpy(cursor, pcds->lpData, msg.cbData);
-            cursor += msg.cbData;
+    BYTE *frame = AllocTraceFrame(totalSize);
+    if (!frame)
+        return;
+    memcpy(frame, &msg, sizeof(msg));
+    memcpy(frame + sizeof(msg), trayData, msg.cbData);
+    if (iconSize)
+        memcpy(frame + sizeof(msg) + msg.cbData, iconRGBA, iconSize);
+    QueueTraceFrame(frame, totalSize);
+}
+
+// Takes a new TRAY_MSG_FILTER and sends the icons it no longer hides with their pixels, the host never got them
+void ApplyIconFilter(const BYTE *data, DWORD size) {
+    if (!g_IconFilter.Load(data, size))
+        DebugOutput("[DLL] Malformed icon filter, nothing is filtered.\n");
+    for (int i = 0; i < g_IconTableCount; i++) {
+        TrayIconEntry *entry = &g_IconTable[i];
+        bool wasFiltered = entry->filtered;
+        if (!IsTrayIconFiltered(entry, NULL) && wasFiltered && entry->hIcon) {
+            TrayEvent ev;
+            MakeSnapshotEvent(entry, &ev);
+            ev.trayData.dwMessage = NIM_MODIFY;
+            ForgetSentIcon(&entry->sent); // what the host cached for the icon may be long gone
+            SendTrayEventToPipe(&ev);
+            ReleaseTrayEvent(&ev);
+        }
+    }
+}
+
+void SendCommandReply(const TrayCommandMessage *command, DWORD status, DWORD value) {
+    BYTE *frame = AllocFrame(sizeof(TrayCommandReplyMessage));
+    if (!frame)
+        return;
+    TrayCommandReplyMessage *reply = (TrayCommandReplyMessage *)frame;
+    TrayInitFrameHeader(&reply->header, TRAY_MSG_COMMAND_REPLY, sizeof(TrayCommandReplyMessage),
+                        InterlockedIncrement(&g_FrameSequence), GetTimestampUs());
+    reply->requestId = command->requestId;
+    reply->command = command->command;
+    reply->status = status;
+    reply->value = value;
+    CommitFrame(frame, sizeof(TrayCommandReplyMessage));
+    FlushBatch(); // the host is waiting for it
+}
+
+// Services a TRAY_MSG_COMMAND between tray messages, the icon table and pending events are the writer's own
+void HandleCommand(const TrayCommandMessage *command) {
+    DWORD status = TRAY_COMMAND_OK;
+    DWORD value = 0;
+    switch (command->command) {
+    case TRAY_COMMAND_PING:
+        value = command->value;
+        break;
+    case TRAY_COMMAND_SNAPSHOT:
+        value = (DWORD)g_IconTableCount;
+        ResyncHost();
+        break;
+    case TRAY_COMMAND_STATS:
+        SendStats(GetTickCount64());
+        if (g_HostCapabilities & TRAY_CAP_METRICS)
+            SendMetrics(GetTickCount64());
+        break;
+    case TRAY_COMMAND_COALESCE_WINDOW:
+        value = g_CoalesceWindowMs;
+        if (command->value > TRAY_MAX_COALESCE_WINDOW_MS) {
+            status = TRAY_COMMAND_INVALID;
+            break;
+        }
+        g_CoalesceWindowMs = command->value; // events already pending keep their due time
+        break;
+    case TRAY_COMMAND_ICON_SIZES:
+        // A host that started without scaled icons decodes raw ones for the rest of the connection
+        if (!(g_HostCapabilities & TRAY_CAP_SCALED_ICONS) || (value = SetHostIconSizes(command->iconSizes)) == 0) {
+            status = TRAY_COMMAND_INVALID;
+            break;
+        }
+        // Cached icons and delta bases have the old sizes, every icon goes out in full again
+        for (int i = 0; i < g_IconTableCount; i++) {
+            ForgetSentIcon(&g_IconTable[i].sent);
+        }
+        ResyncHost();
+        break;
+    default:
+        status = TRAY_COMMAND_UNKNOWN;
+        break;
+    }
+    SendCommandReply(command, status, value);
+}
+
+// Frames the host sends after the handshake
+void HandleHostFrame(const BYTE *data, DWORD size) {
+    const TrayFrameHeader *header = TrayReadFrameHeader(data, size);
+    if (!header)
+        return;
+    if (header->kind == TRAY_MSG_RECORD && header->length >= sizeof(TrayRecordMessage)) {
+        const TrayRecordMessage *record = (const TrayRecordMessage *)data;
+        if (record->maxBytes == 0) {
+            g_NextTracePath[0] = 0;
+            RequestTraceStop();
+            return;
         }
-        if (msg.iconDataSize > 0) {
-            memcpy(cursor, iconRGBA, msg.iconDataSize);
+        WCHAR path[TRAY_RECORD_PATH_CAPACITY];
+        memcpy(path, record->path, sizeof(path));
+        path[TRAY_RECORD_PATH_CAPACITY - 1] = 0;
+        StartTrace(path, record->maxBytes);
+    } else if (header->kind == TRAY_MSG_FILTER && header->length >= sizeof(TrayFilterMessage)) {
+        ApplyIconFilter(data, header->length);
+    } else if (header->kind == TRAY_MSG_COMMAND && header->length >= sizeof(TrayCommandMessage)) {
+        TrayCommandMessage command;
+        memcpy(&command, data, sizeof(command));
+        HandleCommand(&command);
+    }
+}
+
+// Keeps a read pending on the current pipe when the host may send frames
+void PostHostRead() {
+    HANDLE hPipe = g_hPipe;
+    if (g_HostReadPipe != INVALID_HANDLE_VALUE || hPipe == INVALID_HANDLE_VALUE || !g_HostRead.hEvent ||
+        !(g_HostCapabilities & (TRAY_CAP_RECORD | TRAY_CAP_FILTER | TRAY_CAP_COMMAND)))
+        return;
+    // A read that finishes at once still signals the event, only a failed one leaves nothing to complete
+    if (ReadFile(hPipe, g_HostFrame, sizeof(g_HostFrame), NULL, &g_HostRead) || GetLastError() == ERROR_IO_PENDING ||
+        GetLastError() == ERROR_MORE_DATA)
+        g_HostReadPipe = hPipe;
+}
+
+// Handles the frame of a finished host read and starts the next one
+void CompleteHostRead() {
+    if (g_HostReadPipe == INVALID_HANDLE_VALUE || !HasOverlappedIoCompleted(&g_HostRead))
+        return;
+    HANDLE hPipe = g_HostReadPipe;
+    DWORD transferred = 0;
+    BOOL ok = GetOverlappedResult(hPipe, &g_HostRead, &transferred, FALSE);
+    DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+    g_HostReadPipe = INVALID_HANDLE_VALUE;
+    if (error == ERROR_MORE_DATA) {
+        // Larger than any frame the hook takes, the rest of it is read and dropped
+        g_HostReadTruncated = true;
+    } else if (error != ERROR_SUCCESS) {
+        g_HostReadTruncated = false;
+        if (hPipe == g_hPipe)
+            DisconnectPipe(); // the host closed its end
+        return;
+    } else if (g_HostReadTruncated) {
+        g_HostReadTruncated = false;
+    } else {
+        HandleHostFrame(g_HostFrame, transferred);
+    }
+    PostHostRead();
+}
+
+// Drains the event ring off the tray UI thread: coalesces bursts, rasterizes icons,
+// then issues the overlapped pipe writes
+DWORD WINAPI WriterThread(LPVOID lpParam) {
+    InitPendingEvents();
+    if (!InitPipeWriter()) {
+        OutputDebugStringA("[DLL] Failed to create the pipe write events.\n");
+    }
+
+    while (!g_WriterStop) {
+        DWORD timeout = GetCoalesceTimeout(GetTickCount64());
+        DWORD reconnectTimeout = GetReconnectTimeout(GetTickCount64());
+        if (reconnectTimeout < timeout)
+            timeout = reconnectTimeout;
+        DWORD batchTimeout = GetBatchTimeoutMs(GetTimestampUs());
+        // Also wake up for write completions so failed writes are noticed and their frames freed early,
+        // for frames from the host, and for a stopping trace thread to exit
+        HANDLE handles[3 + PIPE_WRITE_SLOTS] = {g_hWriterEvent};
+        DWORD count = 1 + GetPipeWriteEvents(handles + 1);
+        if (g_HostReadPipe != INVALID_HANDLE_VALUE)
+            handles[count++] = g_HostRead.hEvent;
+        if (g_hTraceThread && g_TraceStop)
+            handles[count++] = g_hTraceThread;
+        WaitForMultipleObjects(count, handles, FALSE, batchTimeout < timeout ? batchTimeout : timeout);
+        ReapTraceThread();
+        ReapPipeWrites();
+        CompleteHostRead();
+        if (g_TrayWindowGone)
+            DisconnectPipe(); // cancels and reaps what is in flight, the host sees a broken pipe
+        SendQueuedText(true);
+
+        ULONGLONG now = GetTickCount64();
+        if (g_PipeGeneration > 0) {
+            EnsureConnected();
         }
+        PostHostRead();
 
-        InternalWriteToPipe(buffer, (DWORD)totalSize);
-        free(buffer);
+        TrayEvent *ev;
+        while ((ev = g_EventRing.Front()) != NULL) {
+            TrackTrayIcon(ev);
+            QueuePendingEvent(ev, now);
+            g_EventRing.Pop();
+        }
+        ResyncHostIfDue();
+        SendDuePendingEvents(now, g_WriterStop != 0);
+        if (g_WriterStop || GetBatchTimeoutMs(GetTimestampUs()) == 0) {
+            FlushBatch();
+        }
+
+        g_Stats.eventsDropped += InterlockedExchange(&g_DroppedEvents, 0);
+        g_Stats.heapAllocations += InterlockedExchange(&g_FrameHeapAllocations, 0);
+        g_Stats.frameSlabMisses += InterlockedExchange(&g_FrameSlabMisses, 0);
+        SendStatsIfChanged(GetTickCount64());
+        SendMetricsIfChanged(GetTickCount64());
     }
 
-    if (iconRGBA) {
-        HeapFree(GetProcessHeap(), 0, iconRGBA);
+    // Release whatever is still queued, the host is gone
+    TrayEvent *ev;
+    while ((ev = g_EventRing.Front()) != NULL) {
+        ReleaseTrayEvent(ev);
+        g_EventRing.Pop();
     }
+    SendDuePendingEvents(0, true);
+    FlushBatch();
+    SendQueuedText(g_hPipe != INVALID_HANDLE_VALUE); // no reconnecting on the way out
+    bool traceStopped = StopTrace();
+    ClosePipeWriter();
+    CloseSharedRing();
+    ReleaseIconTable();
+    ReleaseIconSurface();
+    return traceStopped ? 0 : WRITER_EXIT_STRANDED;
 }
 
 void DebugOutput(const char *msg) {
@@ -318,20 +1957,25 @@ LRESULT CALLBACK ManualSubclassProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM
             SetWindowLongPtrW(hWnd, GWLP_WNDPROC, (LONG_PTR)oldProc);
             g_OldWndProc = NULL;
         }
-        // Close the pipe so the Python side gets a broken-pipe signal
-        EnterCriticalSection(&g_PipeCS);
-        if (g_hPipe != INVALID_HANDLE_VALUE) {
-            CloseHandle(g_hPipe);
-            g_hPipe = INVALID_HANDLE_VALUE;
-        }
-        LeaveCriticalSection(&g_PipeCS);
+        // Have the writer close the pipe so the Python side gets a broken-pipe signal. Its writes and the host
+        // read are still in flight on the handle, closing it from this thread would free it under them.
+        InterlockedExchange(&g_TrayWindowGone, 1);
+        if (g_hWriterEvent)
+            SetEvent(g_hWriterEvent);
     }
 
     // Don't do any pipe I/O once we're detaching
     if (!g_Detaching && uMsg == WM_COPYDATA) {
         PCOPYDATASTRUCT pcds = (PCOPYDATASTRUCT)lParam;
         if (pcds && pcds->dwData == 1) {
-            SendCopyDataToPipe(pcds);
+            LONGLONG start = ReadStageClock();
+            EnqueueCopyData(pcds);
+            RecordStageLatency(TRAY_STAGE_COPYDATA, start);
+            // Explorer's own time for the same message puts the hook's share in proportion
+            start = ReadStageClock();
+            LRESULT result = CallWindowProc(oldProc, hWnd, uMsg, wParam, lParam);
+            RecordStageLatency(TRAY_STAGE_WNDPROC, start);
+            return result;
         }
     }
 
@@ -386,7 +2030,27 @@ DWORD WINAPI WatchdogThread(LPVOID lpParam) {
         OutputDebugStringA("[DLL] Detach: No tray or wndproc to unhook.\n");
     }
 
-    // 2. Close the pipe
+    // 2. Stop the writer thread, the subclass proc can no longer enqueue.
+    //    Every wait on its way out is bounded, so it only misses WRITER_STOP_TIMEOUT_MS when something is badly
+    //    stuck. It, or the trace thread it left behind, may then still run DLL code: unloading would crash
+    //    Explorer, so the module and every handle they use are leaked and only this thread exits.
+    if (g_hWriterThread) {
+        InterlockedExchange(&g_WriterStop, 1);
+        SetEvent(g_hWriterStopEvent);
+        SetEvent(g_hWriterEvent);
+        DWORD exitCode = STILL_ACTIVE;
+        if (WaitForSingleObject(g_hWriterThread, WRITER_STOP_TIMEOUT_MS) == WAIT_OBJECT_0)
+            GetExitCodeThread(g_hWriterThread, &exitCode);
+        if (exitCode != 0) {
+            OutputDebugStringA("[DLL] Detach: Writer thread stop timed out, staying loaded.\n");
+            ExitThread(0);
+        }
+        OutputDebugStringA("[DLL] Detach: Writer thread stopped.\n");
+        CloseHandle(g_hWriterThread);
+        g_hWriterThread = NULL;
+    }
+
+    // 3. Close the pipe
     EnterCriticalSection(&g_PipeCS);
     if (g_hPipe != INVALID_HANDLE_VALUE) {
         FlushFileBuffers(g_hPipe);
@@ -396,13 +2060,22 @@ DWORD WINAPI WatchdogThread(LPVOID lpParam) {
     LeaveCriticalSection(&g_PipeCS);
     OutputDebugStringA("[DLL] Detach: Pipe closed.\n");
 
-    // 3. Clean up the event
+    // 4. Clean up the events and any text the writer did not get to
+    SendQueuedText(false);
     if (g_hUnhookDoneEvent) {
         CloseHandle(g_hUnhookDoneEvent);
         g_hUnhookDoneEvent = NULL;
     }
+    if (g_hWriterEvent) {
+        CloseHandle(g_hWriterEvent);
+        g_hWriterEvent = NULL;
+    }
+    if (g_hWriterStopEvent) {
+        CloseHandle(g_hWriterStopEvent);
+        g_hWriterStopEvent = NULL;
+    }
 
-    // 4. Safe to unload - the wndproc is restored and no DLL code is on any stack
+    // 5. Safe to unload - the wndproc is restored and no DLL code is on any stack
     OutputDebugStringA("[DLL] Detach: FreeLibraryAndExitThread now.\n");
     FreeLibraryAndExitThread(g_hModule, 0);
     return 0;
@@ -416,18 +2089,24 @@ DWORD WINAPI InitThread(LPVOID lpParam) {
         LoadLibraryW(dllPath);
     }
 
-    // Create the event before connecting - watchdog will need it
+    // Create the events before connecting - watchdog will need them
     g_hUnhookDoneEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    g_hWriterEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    g_hWriterStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
 
-    g_hPipe = CreateFileW(L"\\\\.\\pipe\\yasb_systray_monitor", GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-                          FILE_FLAG_OVERLAPPED, NULL);
+    ConnectToPipe();
     if (g_hPipe != INVALID_HANDLE_VALUE) {
         DebugOutput("[DLL] Pipeline connected.\n");
+        char buf[64];
+        wsprintf(buf, "[DLL] Pixel kernels: %s\n", PixelKernelName());
+        DebugOutput(buf);
         HWND hTray = FindRealSystray();
         if (hTray) {
             DWORD windowPid;
             GetWindowThreadProcessId(hTray, &windowPid);
-            if (windowPid == GetCurrentProcessId()) {
+            if (windowPid == GetCurrentProcessId() && g_hWriterEvent && g_hWriterStopEvent) {
+                // The writer must be running before the subclass proc starts enqueueing
+                g_hWriterThread = CreateThread(NULL, 0, WriterThread, NULL, 0, NULL);
                 g_OldWndProc = (WNDPROC)SetWindowLongPtrW(hTray, GWLP_WNDPROC, (LONG_PTR)ManualSubclassProc);
                 if (g_OldWndProc) {
                     DebugOutput("[DLL] Successfully subclassed Shell_TrayWnd\n");
@@ -460,12 +2139,20 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
         // When loaded locally by the injector to get GetMsgProc's address, do nothing.
         if (!IsExplorer()) return TRUE;
         InitializeCriticalSection(&g_PipeCS);
+        InitializeCriticalSection(&g_TextQueueCS);
+        InitializeCriticalSection(&g_FrameSlabCS);
+        QueryPerformanceFrequency(&g_QpcFrequency);
         DisableThreadLibraryCalls(hModule); // Removes the overhead of `DLL_THREAD_ATTACH` and `DLL_THREAD_DETACH` calls
         g_hModule = hModule;                // Save before any threads start
         CreateThread(NULL, 0, InitThread, NULL, 0, NULL);
     } else if (ul_reason_for_call == DLL_PROCESS_DETACH) {
-        if (g_hModule) // Only clean up if we actually initialised
+        if (g_hModule) { // Only clean up if we actually initialised
             DeleteCriticalSection(&g_PipeCS);
+            DeleteCriticalSection(&g_TextQueueCS);
+            DeleteCriticalSection(&g_FrameSlabCS);
+            if (g_hFrameHeap)
+                HeapDestroy(g_hFrameHeap);
+        }
     }
     return TRUE;
 }
@@ -0,0 +1,526 @@
+// trayhook_bench, replays tray traffic through the hook's event pipeline on any platform.
+//
+//   trayhook_bench [--icons N] [--fps N] [--seconds N] [--icon-size N] [--record FILE] [--frames FILE] [trace ...]
+//   trayhook_bench --kernels
+//
+// Without trace files it runs a synthetic storm: N icons are added, then each of them animates at the given rate
+// with a spinner that moves a few pixels per frame. Trace files recorded with `yasbc systray-trace start` replay
+// every tray message they hold instead. Each event goes through PlanTrayEventFrame, WriteTrayEventFrame and the
+// delta base bookkeeping of the writer thread, against a host that accepts every capability and draws 16, 24 and
+// 32 pixel icons. Icon extraction, coalescing and the transports are Win32 and not measured.
+// --record writes the storm to a trace file like the hook records one, --frames writes every frame built as the
+// host would read it off the pipe. tests/test_trace_decoders.py replays both through the host's decoders.
+// --kernels times each pixel kernel set the CPU runs on 32 and 256 pixel icons instead.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "icon_pipeline.h"
+#include "latency_histogram.h"
+#include "pixel_kernels.h"
+
+#define MAX_ICON_WIDTH 256
+#define MAX_ICON_HEIGHT 256
+#define ICON_TABLE_CAPACITY 256 // the hook's icon table, icons past it are never sent as deltas
+#define BENCH_CAPABILITIES                                                                                             \
+    (TRAY_CAP_ICON_REF | TRAY_CAP_SCALED_ICONS | TRAY_CAP_SPAN_CODEC | TRAY_CAP_ICON_DELTA | TRAY_CAP_COMPACT_NID)
+#define MAX_EVENT_FRAME_SIZE                                                                                           \
+    (sizeof(TrayEventMessage) + sizeof(SHELLTRAYDATA) + TRAY_MAX_ICON_SIZES * sizeof(TrayIconImage) +                  \
+     MAX_ICON_WIDTH * MAX_ICON_HEIGHT * 4)
+
+// Shell_NotifyIcon messages, same values as shellapi.h
+#define NIM_ADD 0x00000000
+#define NIM_MODIFY 0x00000001
+#define NIM_DELETE 0x00000002
+
+// Heap allocations so far. Counts operator new and the delta bases, which the hook takes from the process heap.
+static size_t g_Allocations = 0;
+
+// GCC pairs a new expression with free() once the replacement delete is inlined and warns about the mismatch
+#if defined(__GNUC__) || defined(__clang__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void *operator new(size_t size) {
+    g_Allocations++;
+    if (void *block = malloc(size ? size : 1))
+        return block;
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void *block) noexcept {
+    free(block);
+}
+
+BENCH_NOINLINE void operator delete(void *block, size_t) noexcept {
+    free(block);
+}
+
+// One tray message as the writer thread takes it from the event ring, icon already extracted
+struct BenchEvent {
+    uint64_t dwData;
+    uint32_t cbData;
+    SHELLTRAYDATA trayData;
+    uint32_t iconSize; // straight RGBA in g_IconPixels, 0 = no icon
+    uint32_t iconWidth;
+    uint32_t iconHeight;
+};
+
+struct BenchIcon {
+    TrayIconKey key;
+    SentIcon sent;
+};
+
+struct BenchResult {
+    uint64_t events;
+    uint64_t totalNs;
+    uint64_t bytes;
+    uint64_t allocations;
+    uint64_t kinds[4]; // TRAY_EVENT, ICON_REF, ICON_DELTA, other
+    LatencyHistogram latency;
+};
+
+static uint8_t g_IconPixels[MAX_ICON_WIDTH * MAX_ICON_HEIGHT * 4];
+static uint8_t g_Scratch[MAX_ICON_WIDTH * MAX_ICON_HEIGHT * 4];
+static uint8_t g_Frame[MAX_EVENT_FRAME_SIZE];
+static const uint16_t g_HostIconSizes[] = {32, 24, 16};
+static std::vector<BenchIcon> g_Icons;
+static FILE *g_RecordFile = nullptr;
+static FILE *g_FramesFile = nullptr;
+
+static BenchIcon *FindIcon(const NOTIFYICONDATA32 *nid) {
+    for (BenchIcon &icon : g_Icons) {
+        if (MatchesTrayIconKey(&icon.key, nid))
+            return &icon;
+    }
+    return nullptr;
+}
+
+static void ForgetIcons() {
+    for (BenchIcon &icon : g_Icons) {
+        free(icon.sent.pixels);
+    }
+    g_Icons.clear();
+}
+
+// The icon table part of TrackTrayIcon, applied before the event is sent like the writer thread does
+static BenchIcon *TrackIcon(const BenchEvent *ev) {
+    const NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    BenchIcon *icon = FindIcon(nid);
+    if (ev->trayData.dwMessage == NIM_ADD && !icon && g_Icons.size() < ICON_TABLE_CAPACITY) {
+        g_Icons.push_back({MakeTrayIconKey(nid), {}});
+        icon = &g_Icons.back();
+    } else if (ev->trayData.dwMessage == NIM_DELETE && icon) {
+        free(icon->sent.pixels);
+        g_Icons.erase(g_Icons.begin() + (icon - g_Icons.data()));
+        icon = nullptr;
+    }
+    return icon;
+}
+
+// SendTrayEventToPipe without the transport, the frame goes to g_Frame
+static void RunEvent(const BenchEvent *ev, BenchResult *result) {
+    BenchIcon *icon = TrackIcon(ev);
+    IconPipelineConfig config = {};
+    config.capabilities = BENCH_CAPABILITIES;
+    config.generation = 1;
+    config.iconSizes = g_HostIconSizes;
+    config.iconSizeCount = sizeof(g_HostIconSizes) / sizeof(g_HostIconSizes[0]);
+    config.scratch = g_Scratch;
+    config.scratchSize = sizeof(g_Scratch);
+
+    size_t allocations = g_Allocations;
+    auto start = std::chrono::steady_clock::now();
+
+    TrayEventFrame frame;
+    uint32_t totalSize = PlanTrayEventFrame(&frame, &config, ev->dwData, ev->cbData, &ev->trayData, g_IconPixels,
+                                            ev->iconSize, ev->iconWidth, ev->iconHeight, icon ? &icon->sent : nullptr);
+    TrayInitFrameHeader(&frame.msg.header, frame.kind, totalSize, (uint32_t)result->events + 1, 0);
+    WriteTrayEventFrame(g_Frame, &frame);
+    if (icon && frame.kind != TRAY_MSG_ICON_REF && frame.msg.iconHash) {
+        SentIcon *sent = &icon->sent;
+        uint32_t size = SentIconBaseSize(&frame, &config);
+        if (size == 0 || sent->capacity < size) {
+            free(sent->pixels);
+            sent->pixels = size ? (uint8_t *)malloc(size) : nullptr;
+            sent->capacity = sent->pixels ? size : 0;
+            if (size)
+                g_Allocations++;
+        }
+        StoreSentIcon(sent, &frame, &config);
+    }
+
+    uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                                 start)
+                      .count();
+    if (g_FramesFile)
+        fwrite(g_Frame, 1, totalSize, g_FramesFile);
+    result->events++;
+    result->totalNs += ns;
+    result->bytes += totalSize;
+    result->allocations += g_Allocations - allocations;
+    result->latency.Record(ns);
+    switch (frame.kind) {
+    case TRAY_MSG_TRAY_EVENT:
+        result->kinds[0]++;
+        break;
+    case TRAY_MSG_ICON_REF:
+        result->kinds[1]++;
+        break;
+    case TRAY_MSG_ICON_DELTA:
+        result->kinds[2]++;
+        break;
+    default:
+        result->kinds[3]++;
+        break;
+    }
+}
+
+// Upper bound of the bucket holding the given fraction of the samples, clamped to the slowest one like
+// histogram_percentile on the host
+static uint64_t LatencyPercentile(const TrayStageHistogram *histogram, double fraction) {
+    uint64_t rank = (uint64_t)ceil(histogram->count * fraction);
+    uint64_t running = 0;
+    for (uint32_t i = 0; i < TRAY_HISTOGRAM_BUCKETS; i++) {
+        running += histogram->buckets[i];
+        if (histogram->buckets[i] && running >= rank) {
+            uint64_t upper = TrayHistogramBucketLow(i + 1);
+            return upper < histogram->maxNs ? upper : histogram->maxNs;
+        }
+    }
+    return 0;
+}
+
+static void PrintResult(const char *name, const BenchResult *result) {
+    if (result->events == 0) {
+        printf("%s: no tray events\n", name);
+        return;
+    }
+    TrayStageHistogram histogram;
+    result->latency.Snapshot(&histogram);
+    double events = (double)result->events;
+    printf("%s: %llu events\n", name, (unsigned long long)result->events);
+    printf("  ns/event      %10.1f  (p50 %llu, p99 %llu, max %u)\n", result->totalNs / events,
+           (unsigned long long)LatencyPercentile(&histogram, 0.50),
+           (unsigned long long)LatencyPercentile(&histogram, 0.99), histogram.maxNs);
+    printf("  bytes/event   %10.1f\n", result->bytes / events);
+    printf("  allocs/event  %10.4f\n", result->allocations / events);
+    printf("  frames        %llu full, %llu icon ref, %llu icon delta\n", (unsigned long long)result->kinds[0],
+           (unsigned long long)result->kinds[1], (unsigned long long)result->kinds[2]);
+}
+
+// Appends ev to the --record trace, as TraceTrayEvent records a tray message in the hook
+static void RecordEvent(const BenchEvent *ev, uint32_t sequence) {
+    TrayEventMessage msg = {};
+    msg.dwData = ev->dwData;
+    msg.cbData = ev->cbData;
+    msg.iconWidth = ev->iconWidth;
+    msg.iconHeight = ev->iconHeight;
+    msg.iconDataSize = ev->iconSize;
+    msg.iconHash = ev->iconSize ? HashIconPixels(g_IconPixels, ev->iconSize, ev->iconWidth, ev->iconHeight) : 0;
+    TrayInitFrameHeader(&msg.header, TRAY_MSG_TRAY_EVENT, (uint32_t)sizeof(msg) + msg.cbData + msg.iconDataSize,
+                        sequence, 0);
+    fwrite(&msg, sizeof(msg), 1, g_RecordFile);
+    fwrite(&ev->trayData, 1, msg.cbData, g_RecordFile);
+    fwrite(g_IconPixels, 1, ev->iconSize, g_RecordFile);
+}
+
+// Straight RGBA of a synthetic animated icon: a disc in the icon's own color with a spinner dot circling it
+static void DrawStormIcon(uint32_t icon, uint32_t frame, uint32_t size) {
+    uint32_t color = 0x3F7FBF ^ (icon * 0x9E3779B1u);
+    int32_t center = (int32_t)size / 2;
+    int32_t radius = (int32_t)size * 7 / 16;
+    int32_t dot = (int32_t)size / 8 + 1;
+    static const int8_t orbit[8][2] = {{0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}};
+    int32_t dotX = center + orbit[frame % 8][0] * radius * 2 / 3;
+    int32_t dotY = center + orbit[frame % 8][1] * radius * 2 / 3;
+    uint8_t *pixel = g_IconPixels;
+    for (int32_t y = 0; y < (int32_t)size; y++) {
+        for (int32_t x = 0; x < (int32_t)size; x++, pixel += 4) {
+            int32_t dx = x - center, dy = y - center;
+            bool inside = dx * dx + dy * dy <= radius * radius;
+            bool onDot = x >= dotX - dot && x < dotX + dot && y >= dotY - dot && y < dotY + dot;
+            pixel[0] = onDot ? 255 : (uint8_t)(color >> 16);
+            pixel[1] = onDot ? 255 : (uint8_t)(color >> 8);
+            pixel[2] = onDot ? 255 : (uint8_t)color;
+            pixel[3] = inside || onDot ? (onDot ? 255 : 224) : 0;
+        }
+    }
+}
+
+static void SetStormText(uint16_t *units, size_t capacity, const char *format, uint32_t icon) {
+    char text[64];
+    int length = snprintf(text, sizeof(text), format, icon);
+    for (int i = 0; i < length && (size_t)i + 1 < capacity; i++) {
+        units[i] = (uint16_t)text[i];
+    }
+}
+
+static void MakeStormEvent(BenchEvent *ev, uint32_t icon, uint32_t frame, uint32_t size) {
+    memset(ev, 0, sizeof(*ev));
+    NOTIFYICONDATA32 *nid = &ev->trayData.nid;
+    ev->dwData = 1; // NIM_* through WM_COPYDATA
+    ev->cbData = sizeof(ev->trayData);
+    ev->trayData.dwSignature = 0x34753423;
+    ev->trayData.dwMessage = frame == 0 ? NIM_ADD : NIM_MODIFY;
+    nid->cbSize = sizeof(*nid);
+    nid->hWnd = 0x10000 + icon * 4;
+    nid->uID = 1;
+    nid->uFlags = TRAY_NIF_ICON;
+    nid->hIcon = 0x20000 + icon * 4 + frame % 8;
+    if (frame == 0) {
+        nid->uFlags |= TRAY_NIF_MESSAGE | TRAY_NIF_TIP;
+        nid->uCallbackMessage = 0x8001;
+        SetStormText(nid->szTip, 128, "Animated icon %u", icon);
+        // Every other icon registers a GUID, every fourth one shows a balloon
+        if (icon % 2) {
+            nid->uFlags |= TRAY_NIF_GUID;
+            nid->guidItem = {0x5A5A0000u + icon, 0x1234, 0x5678, {1, 2, 3, 4, 5, 6, 7, (uint8_t)icon}};
+        }
+        if (icon % 4 == 0) {
+            nid->uFlags |= TRAY_NIF_INFO;
+            SetStormText(nid->szInfo, 256, "Icon %u is animating\r\nat full speed", icon);
+            SetStormText(nid->szInfoTitle, 64, "Storm %u", icon);
+            nid->dwInfoFlags = 1;
+        }
+    }
+    DrawStormIcon(icon, frame, size);
+    ev->iconSize = size * size * 4;
+    ev->iconWidth = size;
+    ev->iconHeight = size;
+}
+
+static void RunStorm(uint32_t icons, uint32_t fps, uint32_t seconds, uint32_t size) {
+    BenchResult *result = new BenchResult();
+    BenchEvent ev;
+    uint32_t frames = fps * seconds + 1; // the NIM_ADD carries the first frame
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        for (uint32_t icon = 0; icon < icons; icon++) {
+            MakeStormEvent(&ev, icon, frame, size);
+            if (g_RecordFile)
+                RecordEvent(&ev, (uint32_t)result->events + 1);
+            RunEvent(&ev, result);
+        }
+    }
+    char name[128];
+    snprintf(name, sizeof(name), "storm %u icons x %u fps x %u s, %ux%u", icons, fps, seconds, size, size);
+    PrintResult(name, result);
+    ForgetIcons();
+    delete result;
+}
+
+static bool RunTrace(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.insert(data.end(), chunk, chunk + read);
+    }
+    fclose(file);
+
+    const TrayFrameHeader *hello = TrayReadFrameHeader(data.data(), data.size(), sizeof(TrayHelloMessage));
+    if (!hello || hello->kind != TRAY_MSG_HELLO) {
+        fprintf(stderr, "%s: not a tray trace of protocol version %u\n", path, TRAY_PROTOCOL_VERSION);
+        return false;
+    }
+
+    BenchResult *result = new BenchResult();
+    BenchEvent *ev = new BenchEvent();
+    size_t offset = hello->length;
+    while (offset < data.size()) {
+        const uint8_t *cursor = data.data() + offset;
+        const TrayFrameHeader *header = TrayReadFrameHeader(cursor, data.size() - offset);
+        if (!header) {
+            fprintf(stderr, "%s: truncated frame at offset %zu\n", path, offset);
+            break;
+        }
+        offset += header->length;
+        if (header->kind != TRAY_MSG_TRAY_EVENT || header->length < sizeof(TrayEventMessage))
+            continue;
+        TrayEventMessage msg;
+        memcpy(&msg, cursor, sizeof(msg));
+        uint64_t payload = (uint64_t)sizeof(msg) + msg.cbData + msg.iconDataSize;
+        if (payload > header->length || msg.cbData > sizeof(SHELLTRAYDATA) || msg.iconWidth > MAX_ICON_WIDTH ||
+            msg.iconHeight > MAX_ICON_HEIGHT || msg.iconDataSize != msg.iconWidth * msg.iconHeight * 4) {
+            fprintf(stderr, "%s: malformed tray event %u\n", path, header->sequence);
+            continue;
+        }
+        memset(ev, 0, sizeof(*ev));
+        ev->dwData = msg.dwData;
+        ev->cbData = msg.cbData;
+        memcpy(&ev->trayData, cursor + sizeof(msg), msg.cbData);
+        memcpy(g_IconPixels, cursor + sizeof(msg) + msg.cbData, msg.iconDataSize);
+        ev->iconSize = msg.iconDataSize;
+        ev->iconWidth = msg.iconWidth;
+        ev->iconHeight = msg.iconHeight;
+        RunEvent(ev, result);
+    }
+    PrintResult(path, result);
+    ForgetIcons();
+    delete ev;
+    delete result;
+    return true;
+}
+
+// Nanoseconds per pixel of kernel over count pixels, best of several runs so a preemption does not count
+template <typename Kernel> static double TimeKernel(Kernel kernel, size_t count) {
+    size_t repeats = (16u << 20) / count + 1;
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < repeats; i++) {
+            kernel();
+        }
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                                  start)
+                        .count() /
+                    ((double)repeats * count);
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+static void RunKernels() {
+    PixelKernelSet sets[PIXEL_KERNEL_SET_MAX];
+    size_t setCount = GetPixelKernelSets(sets);
+    static uint8_t mask[MAX_ICON_WIDTH * MAX_ICON_HEIGHT * 4];
+    for (uint32_t size : {32u, 256u}) {
+        size_t count = (size_t)size * size;
+        DrawStormIcon(0, 0, size);
+        for (size_t i = 0; i < count; i++) {
+            mask[i * 4] = mask[i * 4 + 1] = mask[i * 4 + 2] = g_IconPixels[i * 4 + 3] ? 0 : 255;
+        }
+        printf("%ux%u icon, ns/pixel\n", size, size);
+        for (size_t i = 0; i < setCount; i++) {
+            const PixelKernelSet &set = sets[i];
+            double swizzle = TimeKernel([&] { set.swizzle(g_IconPixels, count); }, count);
+            double applyMask = TimeKernel([&] { set.applyMask(g_IconPixels, mask, count); }, count);
+            printf("  %-8s swizzle %7.3f  mask %7.3f\n", set.name, swizzle, applyMask);
+        }
+        double premultiply = TimeKernel([&] { PremultiplyIconPixels(g_IconPixels, count); }, count);
+        double downscale = TimeKernel([&] { DownscaleIconPixels(g_IconPixels, size, size, g_Scratch, 16, 16); }, count);
+        printf("  premultiply %7.3f  downscale to 16x16 %7.3f\n", premultiply, downscale);
+    }
+}
+
+// Closes a --record or --frames file, false if anything failed to reach it
+static bool CloseOutput(FILE *file, const char *path) {
+    if (!file)
+        return true;
+    bool written = !ferror(file);
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "%s: write failed\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool ParseCount(const char *text, uint32_t *value) {
+    char *end;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || parsed == 0 || parsed > 100000)
+        return false;
+    *value = (uint32_t)parsed;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t icons = 500, fps = 30, seconds = 2, size = 32;
+    bool kernels = false;
+    const char *recordPath = nullptr, *framesPath = nullptr;
+    std::vector<const char *> traces;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--kernels") == 0) {
+            kernels = true;
+            continue;
+        }
+        const char **path = strcmp(arg, "--record") == 0   ? &recordPath
+                            : strcmp(arg, "--frames") == 0 ? &framesPath
+                                                           : nullptr;
+        if (path) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "%s expects a file\n", arg);
+                return 2;
+            }
+            *path = argv[++i];
+            continue;
+        }
+        uint32_t *option = strcmp(arg, "--icons") == 0       ? &icons
+                           : strcmp(arg, "--fps") == 0       ? &fps
+                           : strcmp(arg, "--seconds") == 0   ? &seconds
+                           : strcmp(arg, "--icon-size") == 0 ? &size
+                                                             : nullptr;
+        if (option) {
+            if (i + 1 == argc || !ParseCount(argv[++i], option)) {
+                fprintf(stderr, "%s expects a positive count\n", arg);
+                return 2;
+            }
+        } else if (arg[0] == '-') {
+            fprintf(stderr,
+                    "usage: %s [--icons N] [--fps N] [--seconds N] [--icon-size N] [--record FILE] [--frames FILE] "
+                    "[trace ...]\n",
+                    argv[0]);
+            fprintf(stderr, "       %s --kernels\n", argv[0]);
+            return 2;
+        } else {
+            traces.push_back(arg);
+        }
+    }
+    if (size > MAX_ICON_WIDTH) {
+        fprintf(stderr, "--icon-size is at most %d\n", MAX_ICON_WIDTH);
+        return 2;
+    }
+    if (recordPath && !traces.empty()) {
+        fprintf(stderr, "--record writes the synthetic storm, it takes no traces\n");
+        return 2;
+    }
+
+    g_Icons.reserve(ICON_TABLE_CAPACITY);
+    printf("pixel kernels: %s\n", PixelKernelName());
+    if (kernels) {
+        RunKernels();
+        return 0;
+    }
+    if (framesPath && !(g_FramesFile = fopen(framesPath, "wb"))) {
+        fprintf(stderr, "%s: cannot create\n", framesPath);
+        return 1;
+    }
+    int status = 0;
+    if (traces.empty()) {
+        if (recordPath && !(g_RecordFile = fopen(recordPath, "wb"))) {
+            fprintf(stderr, "%s: cannot create\n", recordPath);
+            return 1;
+        }
+        if (g_RecordFile) {
+            // Opens the trace like the hook does, with a TRAY_MSG_HELLO
+            TrayHelloMessage hello = {};
+            TrayInitFrameHeader(&hello.header, TRAY_MSG_HELLO, sizeof(hello), 0, 0);
+            hello.capabilities = BENCH_CAPABILITIES;
+            fwrite(&hello, sizeof(hello), 1, g_RecordFile);
+        }
+        RunStorm(icons, fps, seconds, size);
+    } else {
+        for (const char *path : traces) {
+            if (!RunTrace(path))
+                status = 1;
+        }
+    }
+    bool recorded = CloseOutput(g_RecordFile, recordPath);
+    if (!CloseOutput(g_FramesFile, framesPath) || !recorded)
+        status = 1;
+    return status;
+}
@@ -0,0 +1,372 @@
+// _trayproto, an optional CPython extension with native decoders for the hook pipe payloads.
+// Built from the same tray_protocol.h and icon_codec.h as trayhook.cpp, so the host parses exactly what the
+// hook writes. tray_protocol.py swaps these in for its pure Python decoders of the same name when the module
+// can be imported, the signatures and results are identical.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <cstring>
+
+#include "icon_codec.h"
+#include "tray_protocol.h"
+
+// True when [offset, offset + size) lies inside view
+static bool InRange(const Py_buffer &view, Py_ssize_t offset, Py_ssize_t size) {
+    return offset >= 0 && size >= 0 && offset <= view.len && size <= view.len - offset;
+}
+
+// Expands span coded pixels into a zeroed bytes object of pixelCount pixels, nullptr with no error set if the
+// spans are malformed
+static PyObject *DecodeSpansToBytes(const uint8_t *data, size_t size, size_t pixelCount) {
+    PyObject *pixels = PyBytes_FromStringAndSize(nullptr, (Py_ssize_t)(pixelCount * 4));
+    if (!pixels)
+        return nullptr;
+    uint8_t *bits = (uint8_t *)PyBytes_AS_STRING(pixels);
+    bool valid;
+    Py_BEGIN_ALLOW_THREADS;
+    memset(bits, 0, pixelCount * 4);
+    valid = DecodeIconSpans(data, size, bits, pixelCount);
+    Py_END_ALLOW_THREADS;
+    if (!valid) {
+        Py_DECREF(pixels);
+        return nullptr;
+    }
+    return pixels;
+}
+
+// decode_icon_spans(data, offset, size, pixel_count) -> bytearray | None
+static PyObject *DecodeIconSpansPy(PyObject *, PyObject *args) {
+    Py_buffer view;
+    Py_ssize_t offset, size, pixelCount;
+    if (!PyArg_ParseTuple(args, "y*nnn:decode_icon_spans", &view, &offset, &size, &pixelCount))
+        return nullptr;
+    PyObject *result = nullptr;
+    if (InRange(view, offset, size) && pixelCount >= 0) {
+        result = PyByteArray_FromStringAndSize(nullptr, pixelCount * 4);
+        if (result) {
+            uint8_t *bits = (uint8_t *)PyByteArray_AS_STRING(result);
+            memset(bits, 0, (size_t)pixelCount * 4);
+            if (!DecodeIconSpans((const uint8_t *)view.buf + offset, (size_t)size, bits, (size_t)pixelCount))
+                Py_CLEAR(result);
+        }
+    }
+    PyBuffer_Release(&view);
+    if (!result && !PyErr_Occurred())
+        Py_RETURN_NONE;
+    return result;
+}
+
+// apply_icon_tiles(pixels, width, height, tile_size, data, offset, size) -> bool
+static PyObject *ApplyIconTilesPy(PyObject *, PyObject *args) {
+    Py_buffer pixels, view;
+    unsigned int width, height, tileSize;
+    Py_ssize_t offset, size;
+    if (!PyArg_ParseTuple(args, "w*IIIy*nn:apply_icon_tiles", &pixels, &width, &height, &tileSize, &view, &offset,
+                          &size))
+        return nullptr;
+    bool valid = tileSize > 0 && InRange(view, offset, size) && (size_t)pixels.len >= (size_t)width * height * 4;
+    if (valid) {
+        Py_BEGIN_ALLOW_THREADS;
+        valid = ApplyIconTiles((uint8_t *)pixels.buf, width, height, tileSize, (const uint8_t *)view.buf + offset,
+                               (size_t)size);
+        Py_END_ALLOW_THREADS;
+    }
+    PyBuffer_Release(&view);
+    PyBuffer_Release(&pixels);
+    return PyBool_FromLong(valid);
+}
+
+// (width, height, pixels) of each scaled icon image in data, span coded ones expanded. nullptr if there are none or
+// one is malformed, with a Python error set only if one was raised.
+static PyObject *ReadIconImages(const uint8_t *cursor, size_t size, bool spanCodec) {
+    PyObject *images = PyList_New(0);
+    const uint8_t *end = cursor + size;
+    while (images && (size_t)(end - cursor) >= sizeof(TrayIconImage)) {
+        TrayIconImage image;
+        memcpy(&image, cursor, sizeof(image));
+        cursor += sizeof(image);
+        size_t rawSize = (size_t)image.width * image.height * 4;
+        if (image.size > rawSize || image.size > (size_t)(end - cursor) || (image.size < rawSize && !spanCodec)) {
+            Py_CLEAR(images);
+            break;
+        }
+        PyObject *pixels = image.size == rawSize
+                               ? PyBytes_FromStringAndSize((const char *)cursor, (Py_ssize_t)rawSize)
+                               : DecodeSpansToBytes(cursor, image.size, (size_t)image.width * image.height);
+        PyObject *entry = pixels ? Py_BuildValue("(IIN)", (unsigned int)image.width, image.height, pixels) : nullptr;
+        if (!entry || PyList_Append(images, entry) < 0) {
+            Py_XDECREF(entry);
+            Py_CLEAR(images);
+            break;
+        }
+        Py_DECREF(entry);
+        cursor += image.size;
+    }
+    if (images && PyList_GET_SIZE(images) == 0)
+        Py_CLEAR(images);
+    return images;
+}
+
+// read_icon_images(data, offset, size, span_codec) -> list[tuple[int, int, bytes]] | None
+static PyObject *ReadIconImagesPy(PyObject *, PyObject *args) {
+    Py_buffer view;
+    Py_ssize_t offset, size;
+    int spanCodec;
+    if (!PyArg_ParseTuple(args, "y*nnp:read_icon_images", &view, &offset, &size, &spanCodec))
+        return nullptr;
+    PyObject *images = nullptr;
+    if (InRange(view, offset, size))
+        images = ReadIconImages((const uint8_t *)view.buf + offset, (size_t)size, spanCodec);
+    PyBuffer_Release(&view);
+    if (!images && !PyErr_Occurred())
+        Py_RETURN_NONE;
+    return images;
+}
+
+// expand_compact_tray_data(data, offset, size) -> bytes | None, the SHELLTRAYDATA for from_buffer_copy
+static PyObject *ExpandCompactTrayDataPy(PyObject *, PyObject *args) {
+    Py_buffer view;
+    Py_ssize_t offset, size;
+    if (!PyArg_ParseTuple(args, "y*nn:expand_compact_tray_data", &view, &offset, &size))
+        return nullptr;
+    SHELLTRAYDATA data;
+    bool valid =
+        InRange(view, offset, size) && TrayReadCompactTrayData((const uint8_t *)view.buf + offset, (size_t)size, &data);
+    PyBuffer_Release(&view);
+    if (!valid)
+        Py_RETURN_NONE;
+    return PyBytes_FromStringAndSize((const char *)&data, sizeof(data));
+}
+
+// Frame level parsing: parse_frames walks a whole pipe message once, batches included, and returns what
+// systray_hook.py dispatches on. Tray events come back decoded, strings as str and icon pixels as buffers a QImage
+// (scaled, premultiplied) or PIL (unscaled, straight) wraps as they are. Same fields as TrayFrame and TrayEvent in
+// tray_protocol.py, whose parse_frames is the fallback.
+static PyTypeObject *g_TrayFrameType = nullptr;
+static PyTypeObject *g_TrayEventType = nullptr;
+
+static PyStructSequence_Field g_TrayFrameFields[] = {
+    {"kind", "TRAY_MSG_* of the frame"},
+    {"sequence", nullptr},
+    {"timestamp", "microseconds on the hook's QPC clock"},
+    {"offset", "of the frame header in the message"},
+    {"length", "of the frame, header included"},
+    {"event", "TrayEvent of a TRAY_EVENT, ICON_REF or ICON_DELTA frame, None for other kinds or if malformed"},
+    {nullptr, nullptr},
+};
+
+static PyStructSequence_Field g_TrayEventFields[] = {
+    {"message", "NIM_*"},
+    {"hwnd", nullptr},
+    {"uid", nullptr},
+    {"flags", "NIF_*, the fields below only mean something with their flag"},
+    {"version", nullptr},
+    {"callback_message", nullptr},
+    {"hicon", nullptr},
+    {"state", nullptr},
+    {"state_mask", nullptr},
+    {"guid", "bytes_le of guidItem, None without NIF_GUID"},
+    {"tip", nullptr},
+    {"info", nullptr},
+    {"info_title", nullptr},
+    {"info_flags", nullptr},
+    {"icon_hash", nullptr},
+    {"icon_offset", "of the icon data in the message"},
+    {"icon_size", nullptr},
+    {"images", "(width, height, pixels) of a TRAY_EVENT icon, largest first, None without pixels or if malformed"},
+    {nullptr, nullptr},
+};
+
+static PyStructSequence_Desc g_TrayFrameDesc = {"_trayproto.TrayFrame", "A frame of a pipe message",
+                                                g_TrayFrameFields, 6};
+static PyStructSequence_Desc g_TrayEventDesc = {"_trayproto.TrayEvent", "A decoded tray message", g_TrayEventFields,
+                                                18};
+
+// Instance of type holding values, which it steals. nullptr if creating any of them failed.
+static PyObject *MakeStructSequence(PyTypeObject *type, PyObject **values, Py_ssize_t count) {
+    bool complete = true;
+    for (Py_ssize_t i = 0; i < count; i++)
+        complete = complete && values[i];
+    PyObject *result = complete ? PyStructSequence_New(type) : nullptr;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (result)
+            PyStructSequence_SET_ITEM(result, i, values[i]);
+        else
+            Py_XDECREF(values[i]);
+    }
+    return result;
+}
+
+// Text of a NUL-terminated UTF-16 field like wide_text in tray_protocol.py: undecodable units replaced, carriage
+// returns dropped after decoding
+static PyObject *WideText(const uint16_t *units, size_t capacity) {
+    size_t length = 0;
+    bool carriageReturn = false;
+    for (; length < capacity && units[length]; length++)
+        carriageReturn = carriageReturn || units[length] == '\r';
+    int byteOrder = -1; // little endian
+    PyObject *text = PyUnicode_DecodeUTF16((const char *)units, (Py_ssize_t)(length * 2), "replace", &byteOrder);
+    if (!text || !carriageReturn)
+        return text;
+    PyObject *stripped = nullptr;
+    PyObject *from = PyUnicode_FromString("\r");
+    PyObject *to = PyUnicode_FromString("");
+    if (from && to)
+        stripped = PyUnicode_Replace(text, from, to, -1);
+    Py_XDECREF(from);
+    Py_XDECREF(to);
+    Py_DECREF(text);
+    return stripped;
+}
+
+// Pixels of a TRAY_EVENT icon, as the host's capabilities have the hook send them. nullptr if malformed, with a
+// Python error set only if one was raised.
+static PyObject *ReadEventImages(const uint8_t *data, const TrayEventMessage &msg, uint32_t capabilities) {
+    if (capabilities & TRAY_CAP_SCALED_ICONS)
+        return ReadIconImages(data, msg.iconDataSize, capabilities & TRAY_CAP_SPAN_CODEC);
+    size_t rawSize = (size_t)msg.iconWidth * msg.iconHeight * 4;
+    PyObject *pixels = nullptr;
+    if (msg.iconDataSize >= rawSize)
+        pixels = PyBytes_FromStringAndSize((const char *)data, (Py_ssize_t)rawSize);
+    else if (capabilities & TRAY_CAP_SPAN_CODEC)
+        pixels = DecodeSpansToBytes(data, msg.iconDataSize, (size_t)msg.iconWidth * msg.iconHeight);
+    if (!pixels)
+        return nullptr;
+    return Py_BuildValue("[(IIN)]", msg.iconWidth, msg.iconHeight, pixels);
+}
+
+// TrayEvent of the tray event frame at offset, Py_None if it is malformed
+static PyObject *ReadTrayEvent(const uint8_t *base, Py_ssize_t offset, const TrayFrameHeader *header,
+                               uint32_t capabilities) {
+    if (header->length < sizeof(TrayEventMessage))
+        Py_RETURN_NONE;
+    TrayEventMessage msg;
+    memcpy(&msg, base + offset, sizeof(msg));
+    if ((uint64_t)sizeof(msg) + msg.cbData + msg.iconDataSize > header->length)
+        Py_RETURN_NONE;
+    const uint8_t *payload = base + offset + sizeof(msg);
+    SHELLTRAYDATA data;
+    if (capabilities & TRAY_CAP_COMPACT_NID) {
+        if (!TrayReadCompactTrayData(payload, msg.cbData, &data))
+            Py_RETURN_NONE;
+    } else {
+        // Shorter payloads of older NOTIFYICONDATA versions read as zero past their end
+        memset(&data, 0, sizeof(data));
+        memcpy(&data, payload, msg.cbData < sizeof(data) ? msg.cbData : sizeof(data));
+    }
+
+    const NOTIFYICONDATA32 &nid = data.nid;
+    uint32_t flags = nid.uFlags;
+    Py_ssize_t iconOffset = offset + (Py_ssize_t)sizeof(msg) + msg.cbData;
+    PyObject *images = nullptr;
+    if (header->kind == TRAY_MSG_TRAY_EVENT && msg.iconDataSize)
+        images = ReadEventImages(base + iconOffset, msg, capabilities);
+    if (!images && !PyErr_Occurred())
+        images = Py_NewRef(Py_None);
+
+    PyObject *values[] = {
+        PyLong_FromUnsignedLong(data.dwMessage),
+        PyLong_FromUnsignedLong(nid.hWnd),
+        PyLong_FromUnsignedLong(nid.uID),
+        PyLong_FromUnsignedLong(flags),
+        PyLong_FromUnsignedLong(nid.uVersion),
+        PyLong_FromUnsignedLong(nid.uCallbackMessage),
+        PyLong_FromUnsignedLong(nid.hIcon),
+        PyLong_FromUnsignedLong(nid.dwState),
+        PyLong_FromUnsignedLong(nid.dwStateMask),
+        flags & TRAY_NIF_GUID ? PyBytes_FromStringAndSize((const char *)&nid.guidItem, sizeof(nid.guidItem))
+                              : Py_NewRef(Py_None),
+        flags & TRAY_NIF_TIP ? WideText(nid.szTip, 128) : PyUnicode_FromString(""),
+        flags & TRAY_NIF_INFO ? WideText(nid.szInfo, 256) : PyUnicode_FromString(""),
+        flags & TRAY_NIF_INFO ? WideText(nid.szInfoTitle, 64) : PyUnicode_FromString(""),
+        PyLong_FromUnsignedLong(nid.dwInfoFlags),
+        PyLong_FromUnsignedLongLong(msg.iconHash),
+        PyLong_FromSsize_t(iconOffset),
+        PyLong_FromUnsignedLong(msg.iconDataSize),
+        images,
+    };
+    return MakeStructSequence(g_TrayEventType, values, sizeof(values) / sizeof(values[0]));
+}
+
+// Appends the TrayFrame of the frame at offset to frames, false on a Python error
+static bool AppendFrame(PyObject *frames, const uint8_t *base, Py_ssize_t offset, const TrayFrameHeader *header,
+                        uint32_t capabilities) {
+    bool trayEvent = header->kind == TRAY_MSG_TRAY_EVENT || header->kind == TRAY_MSG_ICON_REF ||
+                     header->kind == TRAY_MSG_ICON_DELTA;
+    PyObject *values[] = {
+        PyLong_FromUnsignedLong(header->kind),
+        PyLong_FromUnsignedLong(header->sequence),
+        PyLong_FromUnsignedLongLong(header->timestamp),
+        PyLong_FromSsize_t(offset),
+        PyLong_FromUnsignedLong(header->length),
+        trayEvent ? ReadTrayEvent(base, offset, header, capabilities) : Py_NewRef(Py_None),
+    };
+    PyObject *frame = MakeStructSequence(g_TrayFrameType, values, sizeof(values) / sizeof(values[0]));
+    bool appended = frame && PyList_Append(frames, frame) == 0;
+    Py_XDECREF(frame);
+    return appended;
+}
+
+// parse_frames(data, capabilities) -> tuple[list[TrayFrame], bool], false when a frame is truncated or invalid
+static PyObject *ParseFramesPy(PyObject *, PyObject *args) {
+    Py_buffer view;
+    unsigned int capabilities;
+    if (!PyArg_ParseTuple(args, "y*I:parse_frames", &view, &capabilities))
+        return nullptr;
+    const uint8_t *base = (const uint8_t *)view.buf;
+    PyObject *frames = PyList_New(0);
+    const TrayFrameHeader *header = TrayReadFrameHeader(base, (size_t)view.len);
+    bool complete = header != nullptr;
+    if (frames && header && header->kind != TRAY_MSG_BATCH) {
+        if (!AppendFrame(frames, base, 0, header, capabilities))
+            Py_CLEAR(frames);
+    } else if (frames && header) {
+        // Frames of a batch are read in place, a nested batch is passed on as a frame of its own
+        TrayBatchMessage batch = {};
+        complete = header->length >= sizeof(batch);
+        if (complete)
+            memcpy(&batch, base, sizeof(batch));
+        Py_ssize_t offset = sizeof(batch);
+        for (uint32_t i = 0; complete && i < batch.count; i++) {
+            const TrayFrameHeader *frame = TrayReadFrameHeader(base + offset, header->length - (size_t)offset);
+            complete = frame != nullptr;
+            if (frame && !AppendFrame(frames, base, offset, frame, capabilities)) {
+                Py_CLEAR(frames);
+                break;
+            }
+            if (frame)
+                offset += frame->length;
+        }
+    }
+    PyBuffer_Release(&view);
+    if (!frames)
+        return nullptr;
+    return Py_BuildValue("(NO)", frames, complete ? Py_True : Py_False);
+}
+
+static PyMethodDef g_TrayProtoMethods[] = {
+    {"decode_icon_spans", DecodeIconSpansPy, METH_VARARGS, "Expands span coded icon pixels, None if malformed"},
+    {"apply_icon_tiles", ApplyIconTilesPy, METH_VARARGS, "Copies icon delta tiles into RGBA pixels"},
+    {"read_icon_images", ReadIconImagesPy, METH_VARARGS, "(width, height, pixels) of each scaled icon image"},
+    {"expand_compact_tray_data", ExpandCompactTrayDataPy, METH_VARARGS, "SHELLTRAYDATA bytes of a compact payload"},
+    {"parse_frames", ParseFramesPy, METH_VARARGS, "TrayFrame of every frame in a pipe message, and if none was cut"},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+static PyModuleDef g_TrayProtoModule = {
+    PyModuleDef_HEAD_INIT, "_trayproto", "Native decoders for the systray hook pipe", -1, g_TrayProtoMethods,
+    nullptr, nullptr, nullptr, nullptr,
+};
+
+PyMODINIT_FUNC PyInit__trayproto(void) {
+    if (!g_TrayFrameType && !(g_TrayFrameType = PyStructSequence_NewType(&g_TrayFrameDesc)))
+        return nullptr;
+    if (!g_TrayEventType && !(g_TrayEventType = PyStructSequence_NewType(&g_TrayEventDesc)))
+        return nullptr;
+    PyObject *module = PyModule_Create(&g_TrayProtoModule);
+    if (module && (PyModule_AddObjectRef(module, "TrayFrame", (PyObject *)g_TrayFrameType) < 0 ||
+                   PyModule_AddObjectRef(module, "TrayEvent", (PyObject *)g_TrayEventType) < 0))
+        Py_CLEAR(module);
+    return module;
+}
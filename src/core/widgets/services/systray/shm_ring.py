@@ -0,0 +1,83 @@
+"""Consumer side of the shared memory frame ring, mirrors hook/shm_ring.h"""
+
+import ctypes
+import mmap
+import platform
+import struct
+from collections.abc import Callable
+
+import win32api
+import win32event
+
+RING_MAGIC = 0x474E5259  # "YRNG"
+RING_WRAP = 0
+
+RING_HEADER = struct.Struct("<II")  # magic, capacity
+RING_HEAD_OFFSET = 64
+RING_TAIL_OFFSET = 128
+RING_DATA_OFFSET = 192
+RING_RECORD = struct.Struct("<II")  # size, reserved
+
+# Loads and stores of the Python reader are not ordered against each other on ARM64: the record reads must
+# come after the head load that published them, and be done before the tail store hands them back to the hook
+_NEEDS_BARRIER = platform.machine().lower() in {"arm64", "aarch64"}
+
+
+def _record_span(size: int) -> int:
+    return (RING_RECORD.size + size + 7) & ~7
+
+
+class ShmRingReader:
+    """Creates the named mapping and wakeup event, the hook attaches to both as the producer"""
+
+    def __init__(self, name: str, event_name: str, capacity: int):
+        if capacity < 64 or capacity & (capacity - 1):
+            raise ValueError(f"Ring capacity must be a power of two, got {capacity}")
+        self.size = RING_DATA_OFFSET + capacity
+        self._capacity = capacity
+        self._mm = mmap.mmap(-1, self.size, tagname=name)
+        self.event = win32event.CreateEvent(None, False, False, event_name)
+
+        self._view = memoryview(self._mm)
+        self._head = ctypes.c_uint64.from_buffer(self._mm, RING_HEAD_OFFSET)
+        self._tail_shared = ctypes.c_uint64.from_buffer(self._mm, RING_TAIL_OFFSET)
+        self._tail = 0
+        self._head.value = 0
+        self._tail_shared.value = 0
+        # Magic last, the hook refuses to attach to a ring without it
+        RING_HEADER.pack_into(self._mm, 0, RING_MAGIC, capacity)
+
+    def drain(self, handler: Callable[[memoryview], None]) -> int:
+        """
+        Passes every committed frame to handler and returns how many there were.
+        The memoryview points into the ring and is only valid during the call.
+        The head may include records the hook committed after the signal that ended the wait, so the head load
+        needs its own barrier before the records are read.
+        """
+        head = self._head.value
+        if _NEEDS_BARRIER:
+            ctypes.windll.kernel32.FlushProcessWriteBuffers()
+        mask = self._capacity - 1
+        count = 0
+        while self._tail != head:
+            offset = self._tail & mask
+            (size, _reserved) = RING_RECORD.unpack_from(self._mm, RING_DATA_OFFSET + offset)
+            if size == RING_WRAP:
+                self._tail += self._capacity - offset
+                continue
+            start = RING_DATA_OFFSET + offset + RING_RECORD.size
+            handler(self._view[start : start + size])
+            self._tail += _record_span(size)
+            count += 1
+        if count:
+            if _NEEDS_BARRIER:
+                ctypes.windll.kernel32.FlushProcessWriteBuffers()
+            self._tail_shared.value = self._tail
+        return count
+
+    def close(self) -> None:
+        win32api.CloseHandle(self.event)
+        # Exported buffers must be gone before the mapping can be closed
+        del self._head, self._tail_shared
+        self._view.release()
+        self._mm.close()
@@ -1,8 +1,12 @@
 import ctypes
 import logging
 import os
-import struct
+import threading
 import time
+from collections import OrderedDict
+from collections.abc import Callable, Iterable
+from functools import partial
+from uuid import UUID
 
 import pywintypes
 import win32api
@@ -12,7 +16,10 @@ import win32pipe
 import winerror
 from PIL import Image
 from PyQt6.QtCore import QObject, pyqtSignal
+from PyQt6.QtGui import QGuiApplication, QImage
 
+from core.config import get_config_dir
+from core.events.service import EventService
 from core.utils.win32.bindings.kernel32 import (
     CloseHandle,
     CreateMutex,
@@ -30,20 +37,77 @@ from core.utils.win32.bindings.user32 import (
     UnhookWindowsHookEx,
 )
 from core.utils.win32.constants import (
-    NIF_GUID,
+    NIF_ICON,
     NIM_ADD,
     NIM_DELETE,
     NIM_MODIFY,
     NIM_SETVERSION,
     WH_GETMESSAGE,
 )
-from core.utils.win32.structs import NOTIFYICONDATA, SHELLTRAYDATA
+from core.widgets.services.systray.shm_ring import ShmRingReader
+from core.widgets.services.systray.tray_protocol import (
+    ACK_FILTER,
+    CAP_COMMAND,
+    CAP_FILTER,
+    CAP_RECORD,
+    CAP_SCALED_ICONS,
+    CAP_SHM_RING,
+    COMMAND,
+    COMMAND_ICON_SIZES,
+    COMMAND_OK,
+    COMMAND_REPLY,
+    FRAME_HEADER,
+    HELLO,
+    HELLO_ACK,
+    HELLO_FLAGS,
+    HELLO_SNAPSHOT,
+    HOST_CAPABILITIES,
+    ICON_DELTA,
+    ICON_IMAGE,
+    MAX_ICON_SIZES,
+    METRIC_STAGES,
+    METRICS,
+    MSG_BATCH,
+    MSG_COMMAND,
+    MSG_COMMAND_REPLY,
+    MSG_FILTER,
+    MSG_HELLO,
+    MSG_HELLO_ACK,
+    MSG_ICON_DELTA,
+    MSG_ICON_REF,
+    MSG_METRICS,
+    MSG_RECORD,
+    MSG_SNAPSHOT_BEGIN,
+    MSG_SNAPSHOT_END,
+    MSG_STATS,
+    MSG_TEXT,
+    MSG_TRAY_EVENT,
+    RECORD,
+    RECORD_PATH_CAPACITY,
+    SHM_EVENT_NAME,
+    SHM_RING_NAME,
+    SNAPSHOT,
+    STAGE_HISTOGRAM,
+    STATS,
+    STATS_RESOURCES,
+    CommandReply,
+    HookStats,
+    StageLatency,
+    TrayFrame,
+    apply_icon_tiles,
+    histogram_percentile,
+    is_legacy_message,
+    pack_frame,
+    pack_icon_filter,
+    parse_frames,
+    read_frame_header,
+)
 from core.widgets.services.systray.utils import (
     IconData,
     get_dll_path,
     get_explorer_pid,
+    icon_data_from_event,
     is_dll_loaded,
-    validate_icon_data,
 )
 
 logger = logging.getLogger("systray_hook")
@@ -111,19 +175,53 @@ def _inject_via_hook(dll_path: str, explorer_pid: int) -> int:
 WATCHDOG_MUTEX_NAME = "Global\\YASBTrayHookAlive"
 MESSAGE_PIPE_NAME = r"\\.\pipe\yasb_systray_monitor"
 PIPE_BUFFER_SIZE = 32 * 1024
+ICON_CACHE_SIZE = 256
+COALESCE_WINDOW_MS = 50  # how long the DLL may hold NIM_MODIFY bursts per icon
+SHM_RING_CAPACITY = 4 * 1024 * 1024  # shared memory frame ring, fits ~16 full-size 256x256 icons
+TRACE_MAX_BYTES = 256 * 1024 * 1024  # the DLL stops a trace file at this size
 
 
 class SystrayHook(QObject):
     update_icons = pyqtSignal()
     icon_modified = pyqtSignal(IconData)
     icon_deleted = pyqtSignal(IconData)
+    trace_requested = pyqtSignal(str)
 
     def __init__(self, parent: QObject | None = None):
         super().__init__(parent)
         self._running = False
         self._h_mutex = None
         self._message_pipe = None
+        # The worker thread and requests from the UI thread both write to the pipe. Reentrant, the handshake holds
+        # it across the ack and its filter and the UI thread across a capability check and its write.
+        self._write_lock = threading.RLock()
         self._h_hook: int = 0
+        # Converted icons by DLL content hash, lets the DLL skip resending unchanged pixels
+        # Scaled icons keep every image, the base of TRAY_MSG_ICON_DELTA patches
+        self._icon_cache: OrderedDict[int, list[QImage]] = OrderedDict()
+        # Negotiated in the handshake with the DLL on every connection
+        self._capabilities = 0
+        self._last_sequence = 0
+        self._snapshot_expected = False
+        # Icons emitted to the widget by (hWnd, uID) or GUID, pruned against the DLL's snapshot on reconnect
+        self._live_icons: dict[object, IconData] = {}
+        self._snapshot_keys: set[object] | None = None
+        self._ring: ShmRingReader | None = None
+        # Pixel sizes the widgets draw icons at, the DLL scales icons to these
+        self._icon_sizes: list[int] = []
+        # Image names and GUIDs each live widget hides by id(widget), the DLL never rasterizes icons hidden in all
+        self._icon_filters: dict[int, tuple[frozenset[str], frozenset[UUID]]] = {}
+        # Callbacks of commands sent to the DLL by request id, until their COMMAND_REPLY arrives
+        self._pending_commands: dict[int, Callable[[CommandReply | None], None]] = {}
+        self._next_request_id = 0
+        self._command_lock = threading.Lock()
+        self.hook_stats = HookStats()
+        # Per stage latency of the DLL hot paths by METRIC_STAGES name, and the cumulative buckets it was taken from
+        self.hook_latency: dict[str, StageLatency] = {}
+        self._latency_buckets: dict[str, list[int]] = {}
+        # yasbc systray-trace start|stop
+        self.trace_requested.connect(self._on_trace_requested)
+        EventService().register_event("systray_trace", self.trace_requested)
 
         # Create the watchdog mutex - held for entire lifetime.
         try:
@@ -138,7 +236,7 @@ class SystrayHook(QObject):
         try:
             self._message_pipe = win32pipe.CreateNamedPipe(
                 MESSAGE_PIPE_NAME,
-                win32pipe.PIPE_ACCESS_INBOUND | win32file.FILE_FLAG_OVERLAPPED,
+                win32pipe.PIPE_ACCESS_DUPLEX | win32file.FILE_FLAG_OVERLAPPED,
                 win32pipe.PIPE_TYPE_MESSAGE | win32pipe.PIPE_READMODE_MESSAGE | win32pipe.PIPE_WAIT,
                 1,
                 PIPE_BUFFER_SIZE,
@@ -153,6 +251,142 @@ class SystrayHook(QObject):
                 self._h_mutex = None
             return
 
+    def request_icon_size(self, logical_size: int) -> None:
+        """
+        Adds the pixel sizes of a widget's icons on every screen.
+        The DLL sends one mip per size so widgets on mixed-DPI screens each draw an exact one.
+        """
+        sizes = set(self._icon_sizes)
+        for screen in QGuiApplication.screens():
+            sizes.add(round(logical_size * screen.devicePixelRatio()))
+        # Keep the largest, Qt scales those down for anything else
+        icon_sizes = sorted(sizes)[-MAX_ICON_SIZES:]
+        # A connected DLL already scaling icons resends them at the new sizes, otherwise they apply from the next
+        # connection on. Under the lock a handshake either already took the new sizes or has not published
+        # CAP_SCALED_ICONS yet.
+        with self._write_lock:
+            if icon_sizes == self._icon_sizes:
+                return
+            self._icon_sizes = icon_sizes
+            if self._capabilities & CAP_SCALED_ICONS:
+                self.send_command(COMMAND_ICON_SIZES, icon_sizes=icon_sizes)
+
+    def send_command(
+        self,
+        command: int,
+        value: int = 0,
+        icon_sizes: Iterable[int] = (),
+        callback: Callable[[CommandReply | None], None] | None = None,
+    ) -> bool:
+        """
+        Sends a COMMAND_* to the DLL, which services it off Explorer's UI thread.
+        callback gets the reply on the pipe worker thread, or None if the DLL disconnected before answering.
+        Returns False if the DLL is not connected or cannot take commands.
+        """
+        # The DLL fails a connection on any frame that arrives before its HELLO_ACK or in place of the filter the
+        # ack announces. _handshake publishes CAP_COMMAND only once both are written and the worker clears it on
+        # disconnect, each under _write_lock, so checked and written under it a command never lands in between.
+        overlapped = win32file.OVERLAPPED()
+        overlapped.hEvent = win32event.CreateEvent(None, True, False, None)
+        try:
+            with self._write_lock:
+                if not self._capabilities & CAP_COMMAND:
+                    return False
+                with self._command_lock:
+                    self._next_request_id = self._next_request_id % 0xFFFFFFFF + 1
+                    request_id = self._next_request_id
+                    if callback is not None:
+                        # Registered before the write, the reply may arrive before it returns
+                        self._pending_commands[request_id] = callback
+                padded_sizes = (list(icon_sizes) + [0] * MAX_ICON_SIZES)[:MAX_ICON_SIZES]
+                frame = pack_frame(MSG_COMMAND, COMMAND.pack(request_id, command, value & 0xFFFFFFFF, *padded_sizes))
+                if self._write_message(frame, overlapped):
+                    return True
+        finally:
+            win32api.CloseHandle(overlapped.hEvent)
+        with self._command_lock:
+            self._pending_commands.pop(request_id, None)
+        return False
+
+    def _fail_pending_commands(self) -> None:
+        """Answers the commands the DLL took with it when it disconnected"""
+        with self._command_lock:
+            pending, self._pending_commands = self._pending_commands, {}
+        for callback in pending.values():
+            callback(None)
+
+    def request_icon_filter(self, widget: QObject, exes: Iterable[str], guids: Iterable[UUID]) -> None:
+        """
+        Sets the icons a widget hides, by image name without extension or GUID, until the widget is destroyed.
+        The DLL sends icons that every widget hides as metadata only, without extracting their pixels.
+        """
+        key = id(widget)
+        if key not in self._icon_filters:
+            widget.destroyed.connect(partial(self._release_icon_filter, key))
+        self._icon_filters[key] = (frozenset(exe.lower() for exe in exes), frozenset(guids))
+        self._update_icon_filter()
+
+    def _release_icon_filter(self, key: int) -> None:
+        """Drops the filter of a destroyed widget, icons only it hid get their pixels back"""
+        if self._icon_filters.pop(key, None) is not None:
+            self._update_icon_filter()
+
+    def _update_icon_filter(self) -> None:
+        """Sends the combined filter to a connected DLL that takes one"""
+        overlapped = win32file.OVERLAPPED()
+        overlapped.hEvent = win32event.CreateEvent(None, True, False, None)
+        try:
+            # Checked under the lock: a handshake in progress has not published its capabilities yet and picks up
+            # this filter itself
+            with self._write_lock:
+                if self._capabilities & CAP_FILTER:
+                    self._send_icon_filter(overlapped)
+        finally:
+            win32api.CloseHandle(overlapped.hEvent)
+
+    def _send_icon_filter(self, overlapped: win32file.OVERLAPPED) -> bool:
+        """Pushes the icons hidden in every widget to the DLL, replacing the filter it had"""
+        filters = list(self._icon_filters.values())
+        exes = frozenset.intersection(*(exes for exes, _ in filters)) if filters else frozenset()
+        guids = frozenset.intersection(*(guids for _, guids in filters)) if filters else frozenset()
+        return self._write_message(pack_frame(MSG_FILTER, pack_icon_filter(guids, (), exes)), overlapped)
+
+    def start_trace(self, path: str | None = None, max_bytes: int = TRACE_MAX_BYTES) -> str | None:
+        """
+        Makes the DLL record every tray message it receives, icons included, to a trace file for offline replay.
+        Returns the trace path, or None if the DLL is not connected or cannot record.
+        """
+        if path is None:
+            path = os.path.join(get_config_dir(), time.strftime("systray-%Y%m%d-%H%M%S.trace"))
+        encoded = os.path.abspath(path).encode("utf-16-le")
+        if len(encoded) >= RECORD_PATH_CAPACITY * 2:
+            logger.error("Systray trace path is too long: %s", path)
+            return None
+        return path if self._send_record(max_bytes, encoded) else None
+
+    def stop_trace(self) -> bool:
+        """Closes the trace file started by start_trace"""
+        return self._send_record(0, b"")
+
+    def _send_record(self, max_bytes: int, path: bytes) -> bool:
+        if not self._capabilities & CAP_RECORD:
+            logger.warning("The systray hook DLL is not connected or cannot record traces")
+            return False
+        overlapped = win32file.OVERLAPPED()
+        overlapped.hEvent = win32event.CreateEvent(None, True, False, None)
+        try:
+            return self._write_message(pack_frame(MSG_RECORD, RECORD.pack(max_bytes, path)), overlapped)
+        finally:
+            win32api.CloseHandle(overlapped.hEvent)
+
+    def _on_trace_requested(self, action: str) -> None:
+        if action == "start":
+            path = self.start_trace()
+            if path is not None:
+                logger.info("Recording systray hook trace to %s", path)
+        elif action == "stop" and self.stop_trace():
+            logger.info("Stopped the systray hook trace")
+
     def destroy(self):
         """Clean up the hook"""
         self._running = False
@@ -180,6 +414,9 @@ class SystrayHook(QObject):
         h_event = win32event.CreateEvent(None, True, False, None)
         overlapped = win32file.OVERLAPPED()
         overlapped.hEvent = h_event
+        h_write_event = win32event.CreateEvent(None, True, False, None)
+        write_overlapped = win32file.OVERLAPPED()
+        write_overlapped.hEvent = h_write_event
 
         # Retry loop: retries in case or explorer restart or injection failure
         while self._running:
@@ -220,110 +457,375 @@ class SystrayHook(QObject):
                 if self._h_hook:
                     UnhookWindowsHookEx(self._h_hook)
                     self._h_hook = 0
-                self.update_icons.emit()
 
                 buffer = win32file.AllocateReadBuffer(PIPE_BUFFER_SIZE)
-                # Read loop: reads a single message from the explorer hook
-                while self._running:
-                    chunks: list[bytes] = []
-                    read_error = False
-                    # Chunks loop: collects chunks until the full message is received
-                    while True:
-                        win32event.ResetEvent(h_event)
-                        try:
-                            hr, _data = win32file.ReadFile(self._message_pipe, buffer, overlapped)
-                        except pywintypes.error as e:
-                            if e.winerror == winerror.ERROR_BROKEN_PIPE:
-                                logger.debug("DLL Disconnected")
-                            elif e.winerror == winerror.ERROR_OPERATION_ABORTED:
-                                logger.debug("Pipe operation aborted (closing)")
-                            else:
-                                logger.error("ReadFile failed immediately: %s", e)
-                            read_error = True
-                            break
-
-                        if hr == winerror.ERROR_IO_PENDING:
-                            while self._running:
-                                wait_res = win32event.WaitForSingleObject(h_event, 500)
-                                if wait_res == win32event.WAIT_OBJECT_0:
-                                    break
-                            if not self._running:
-                                break
-                        # Retrieve completed result
-                        try:
-                            n_read = win32file.GetOverlappedResult(self._message_pipe, overlapped, True)
-                            chunks.append(bytes(buffer[:n_read]))
-                            break  # Full message received
-                        except pywintypes.error as e:
-                            if e.winerror == winerror.ERROR_MORE_DATA:
-                                chunks.append(bytes(buffer[:PIPE_BUFFER_SIZE]))
-                                continue  # More data remaining for this message
-                            elif e.winerror == winerror.ERROR_BROKEN_PIPE:
-                                logger.debug("DLL Disconnected")
-                            else:
-                                logger.error("GetOverlappedResult failed: %s", e)
-                            read_error = True
+                hello = self._read_message(buffer, overlapped)
+                if hello is not None and self._handshake(hello, write_overlapped):
+                    # A reconnecting DLL sends a snapshot of its icons, only a fresh one needs TaskbarCreated
+                    if not self._snapshot_expected:
+                        self._live_icons.clear()
+                        self.update_icons.emit()
+                    # Read loop: reads a single message from the explorer hook
+                    while self._running:
+                        data = self._read_message(buffer, overlapped)
+                        if data is None:
                             break
-                    if read_error or not self._running:
-                        break
-                    if chunks:
-                        self.process_message(b"".join(chunks))
+                        self.process_message(data)
             except Exception as e:
                 # Avoid logging error if shutting down
                 if self._running:
                     logger.error("Worker error: %s", e)
             finally:
+                # Cleared before the pipe is reused, no UI thread write may reach the next connection's handshake
+                with self._write_lock:
+                    self._capabilities = 0
                 try:
                     win32pipe.DisconnectNamedPipe(self._message_pipe)
                 except pywintypes.error:
                     pass
+                self._close_ring()
+                self._fail_pending_commands()
             if self._running:
                 time.sleep(3)
         win32api.CloseHandle(h_event)
+        win32api.CloseHandle(h_write_event)
+
+    def _read_message(self, buffer: memoryview, overlapped: win32file.OVERLAPPED) -> bytes | None:
+        """Reads one whole pipe message, returns None when the DLL disconnected or the hook is stopping"""
+        chunks: list[bytes] = []
+        # Chunks loop: collects chunks until the full message is received
+        while True:
+            win32event.ResetEvent(overlapped.hEvent)
+            try:
+                hr, _data = win32file.ReadFile(self._message_pipe, buffer, overlapped)
+            except pywintypes.error as e:
+                if e.winerror == winerror.ERROR_BROKEN_PIPE:
+                    logger.debug("DLL Disconnected")
+                elif e.winerror == winerror.ERROR_OPERATION_ABORTED:
+                    logger.debug("Pipe operation aborted (closing)")
+                else:
+                    logger.error("ReadFile failed immediately: %s", e)
+                return None
+
+            if hr == winerror.ERROR_IO_PENDING:
+                while self._running:
+                    # Frames in the shared memory ring are handled while waiting for the pipe
+                    handles = [overlapped.hEvent] if self._ring is None else [overlapped.hEvent, self._ring.event]
+                    wait_res = win32event.WaitForMultipleObjects(handles, False, 500)
+                    if wait_res == win32event.WAIT_OBJECT_0:
+                        break
+                    if wait_res == win32event.WAIT_OBJECT_0 + 1 and self._ring is not None:
+                        self._ring.drain(self.process_message)
+                if not self._running:
+                    return None
+            # Retrieve completed result
+            try:
+                n_read = win32file.GetOverlappedResult(self._message_pipe, overlapped, True)
+                chunks.append(bytes(buffer[:n_read]))
+                return b"".join(chunks)  # Full message received
+            except pywintypes.error as e:
+                if e.winerror == winerror.ERROR_MORE_DATA:
+                    chunks.append(bytes(buffer[:PIPE_BUFFER_SIZE]))
+                    continue  # More data remaining for this message
+                elif e.winerror == winerror.ERROR_BROKEN_PIPE:
+                    logger.debug("DLL Disconnected")
+                else:
+                    logger.error("GetOverlappedResult failed: %s", e)
+                return None
 
-    def process_message(self, data_bytes: bytes) -> None:
+    def _write_message(self, data: bytes, overlapped: win32file.OVERLAPPED) -> bool:
+        """Writes one pipe message to the DLL and waits for it to complete"""
+        with self._write_lock:
+            win32event.ResetEvent(overlapped.hEvent)
+            try:
+                win32file.WriteFile(self._message_pipe, data, overlapped)
+                win32file.GetOverlappedResult(self._message_pipe, overlapped, True)
+            except pywintypes.error as e:
+                logger.error("Failed to write to the DLL pipe: %s", e)
+                return False
+        return True
+
+    def _handshake(self, data: bytes, overlapped: win32file.OVERLAPPED) -> bool:
+        """Validates the DLL hello frame and replies with the capabilities this host accepts"""
+        header = read_frame_header(data, min_length=FRAME_HEADER.size + HELLO.size)
+        if header is None or header.kind != MSG_HELLO:
+            if is_legacy_message(data):
+                logger.error("Explorer still runs an older systray hook DLL. Restart Explorer to load the current one.")
+            else:
+                logger.error("Systray hook DLL speaks an incompatible protocol (%s bytes hello)", len(data))
+            return False
+
+        capabilities, process_id = HELLO.unpack_from(data, FRAME_HEADER.size)
+        flags = 0
+        if header.length >= FRAME_HEADER.size + HELLO.size + HELLO_FLAGS.size:
+            (flags,) = HELLO_FLAGS.unpack_from(data, FRAME_HEADER.size + HELLO.size)
+        self._snapshot_expected = bool(flags & HELLO_SNAPSHOT)
+        self._snapshot_keys = None
+        self._last_sequence = header.sequence
+        # Negotiated in a local: until the ack and its filter are written, the DLL takes no other frame, so no
+        # other thread may see a capability that lets it write one
+        capabilities &= HOST_CAPABILITIES
+        ring_size = 0
+        if capabilities & CAP_SHM_RING:
+            ring_size = self._open_ring(process_id)
+            if not ring_size:
+                capabilities &= ~CAP_SHM_RING
+        with self._write_lock:
+            icon_sizes = self._icon_sizes
+            if not icon_sizes:
+                capabilities &= ~CAP_SCALED_ICONS
+            logger.debug("DLL handshake: pid %s, capabilities %#x, flags %#x", process_id, capabilities, flags)
+            padded_sizes = (icon_sizes + [0] * MAX_ICON_SIZES)[:MAX_ICON_SIZES]
+            # Every connection starts unfiltered, the DLL waits for the filter announced here before its snapshot
+            send_filter = bool(capabilities & CAP_FILTER and self._icon_filters)
+            ack = pack_frame(
+                MSG_HELLO_ACK,
+                HELLO_ACK.pack(
+                    capabilities, COALESCE_WINDOW_MS, ring_size, *padded_sizes, ACK_FILTER if send_filter else 0
+                ),
+            )
+            if not self._write_message(ack, overlapped):
+                return False
+            if send_filter and not self._send_icon_filter(overlapped):
+                return False
+            self._capabilities = capabilities
+        return True
+
+    def _open_ring(self, process_id: int) -> int:
+        """Creates the shared memory ring for this connection, returns its size or 0 to stay on the pipe"""
+        self._close_ring()
+        try:
+            self._ring = ShmRingReader(
+                SHM_RING_NAME.format(pid=process_id), SHM_EVENT_NAME.format(pid=process_id), SHM_RING_CAPACITY
+            )
+        except (OSError, pywintypes.error) as e:
+            logger.warning("Shared memory ring unavailable, using the pipe: %s", e)
+            return 0
+        return self._ring.size
+
+    def _close_ring(self) -> None:
+        if self._ring is not None:
+            self._ring.close()
+            self._ring = None
+
+    def process_message(self, data_bytes: bytes | memoryview) -> None:
         """Processes a message from the explorer hook"""
-        if len(data_bytes) < 4:
+        frames, complete = parse_frames(data_bytes, self._capabilities)
+        for frame in frames:
+            self._process_frame(frame, data_bytes)
+        if not complete:
+            logger.error("Invalid or truncated frame from the systray hook (%s bytes)", len(data_bytes))
+
+    def _process_frame(self, frame: TrayFrame, data: bytes | memoryview) -> None:
+        """Handles a single frame of a message, parse_frames already decoded tray events"""
+        if frame.sequence > self._last_sequence + 1:
+            logger.debug("Systray hook skipped %s frames", frame.sequence - self._last_sequence - 1)
+        self._last_sequence = max(self._last_sequence, frame.sequence)
+
+        if frame.kind == MSG_TEXT:
+            msg = bytes(data[frame.offset + FRAME_HEADER.size : frame.offset + frame.length])
+            logger.debug(msg.decode("utf-8", errors="ignore").strip())
+        elif frame.kind in {MSG_TRAY_EVENT, MSG_ICON_REF, MSG_ICON_DELTA}:
+            self._process_tray_event(frame, data)
+        elif frame.kind == MSG_STATS:
+            self._process_stats(frame, data)
+        elif frame.kind == MSG_METRICS:
+            self._process_metrics(frame, data)
+        elif frame.kind in {MSG_SNAPSHOT_BEGIN, MSG_SNAPSHOT_END}:
+            self._process_snapshot_marker(frame, data)
+        elif frame.kind == MSG_COMMAND_REPLY:
+            self._process_command_reply(frame, data)
+        elif frame.kind == MSG_BATCH:
+            logger.debug("Ignoring nested systray hook batch")
+        else:
+            # Newer DLL, frames this host doesn't know about are skipped
+            logger.debug("Ignoring systray hook frame of kind %s", frame.kind)
+
+    def _process_tray_event(self, frame: TrayFrame, data: bytes | memoryview) -> None:
+        """Emits the icon signals of a TRAY_EVENT, ICON_REF or ICON_DELTA frame"""
+        event = frame.event
+        if event is None:
+            logger.error("Malformed tray event frame %s (%s bytes)", frame.sequence, frame.length)
             return
 
-        msg_type = struct.unpack_from("=I", data_bytes)[0]
-
-        if msg_type == 1:
-            msg = data_bytes[4:].decode("utf-8", errors="ignore")
-            logger.debug(msg.strip())
-        elif msg_type == 2:
-            if len(data_bytes) < 28:
-                logger.error("Invalid COPYDATA message size: %s", len(data_bytes))
-                return
+        # Icon
+        flags = event.flags
+        icon: Image.Image | QImage | None = None
+        images: list[QImage] | None = None
+        if frame.kind == MSG_ICON_REF:
+            # Pixels unchanged since the DLL last sent them, reuse the converted image
+            images = self._icon_cache.get(event.icon_hash)
+            if images is not None:
+                self._icon_cache.move_to_end(event.icon_hash)
+                icon = images[0]
+            else:
+                # Keep whatever image the widget already has
+                flags &= ~NIF_ICON
+        elif frame.kind == MSG_ICON_DELTA:
+            images = self._apply_icon_delta(data, event.icon_offset, event.icon_size)
+            if images is not None:
+                icon = images[0]
+            else:
+                flags &= ~NIF_ICON
+        elif event.icon_size > 0 and event.images is None:
+            logger.error("Malformed icon pixels in frame %s (%s bytes)", frame.sequence, event.icon_size)
+            if not self._capabilities & CAP_SCALED_ICONS:
+                flags &= ~NIF_ICON
+        elif event.images is not None and self._capabilities & CAP_SCALED_ICONS:
+            images = self._convert_scaled_images(event.images)
+            icon = images[0]
+        elif event.images is not None:
+            width, height, pixels = event.images[0]
+            # Zero-copy when the frame lives in the shared ring, icon_data_from_event detaches the image
+            icon = Image.frombuffer("RGBA", (width, height), pixels, "raw", "RGBA", 0, 1)
+
+        guid = UUID(bytes_le=event.guid) if event.guid is not None else None
+        identity = IconData(hWnd=event.hwnd, uID=event.uid, guid=guid)
+        key = identity.guid or (identity.hWnd, identity.uID)
+        if event.message in {NIM_ADD, NIM_MODIFY, NIM_SETVERSION}:
+            validated_data = icon_data_from_event(event, flags, icon)
+            validated_data.message_type = event.message
+            if images and validated_data.icon_image is images[0]:
+                validated_data.icon_mips = images
+            if frame.kind != MSG_ICON_REF and event.icon_hash and validated_data.icon_image is not None:
+                self._cache_icon(event.icon_hash, images or [validated_data.icon_image])
+            self._live_icons[key] = identity
+            if self._snapshot_keys is not None:
+                self._snapshot_keys.add(key)
+            self.icon_modified.emit(validated_data)
+        elif event.message == NIM_DELETE:
+            self._live_icons.pop(key, None)
+            self.icon_deleted.emit(identity)
+
+    @staticmethod
+    def _convert_scaled_images(decoded: list[tuple[int, int, bytes | bytearray | memoryview]]) -> list[QImage]:
+        """QImages of the images of a scaled icon, largest first, the DLL already premultiplied and downscaled them"""
+        images: list[QImage] = []
+        for width, height, pixels in decoded:
+            # copy() detaches the image from pixels
+            image = QImage(bytes(pixels), width, height, width * 4, QImage.Format.Format_RGBA8888_Premultiplied)
+            images.append(image.copy())
+        return images
+
+    def _apply_icon_delta(self, data: bytes | memoryview, offset: int, size: int) -> list[QImage] | None:
+        """Patches copies of the cached base images with the tiles of an ICON_DELTA frame"""
+        if size < ICON_DELTA.size:
+            logger.error("Invalid icon delta size: %s", size)
+            return None
+        base_hash, tile_size, image_count = ICON_DELTA.unpack_from(data, offset)
+        base = self._icon_cache.get(base_hash)
+        if base is None or len(base) != image_count or tile_size == 0:
+            # Evicted or never received, the next full frame from the DLL brings the icon back in sync
+            logger.debug("Systray hook icon delta without its base %#x", base_hash)
+            return None
+        offset += ICON_DELTA.size
+        end = offset + size - ICON_DELTA.size
+        images: list[QImage] = []
+        for base_image in base:
+            if end - offset < ICON_IMAGE.size:
+                return None
+            width, height, tiles_size = ICON_IMAGE.unpack_from(data, offset)
+            offset += ICON_IMAGE.size
+            if (width, height) != (base_image.width(), base_image.height()) or offset + tiles_size > end:
+                logger.error("Icon delta does not match its base image")
+                return None
+            image = base_image.copy()
+            bits = image.bits()
+            if bits is None:
+                return None
+            bits.setsize(image.sizeInBytes())
+            if not apply_icon_tiles(memoryview(bits), width, height, tile_size, data, offset, tiles_size):
+                logger.error("Malformed icon delta tiles")
+                return None
+            images.append(image)
+            offset += tiles_size
+        return images
+
+    def _process_snapshot_marker(self, frame: TrayFrame, data: bytes | memoryview) -> None:
+        """Brackets the DLL icon table, icons missing from it were deleted while the DLL was disconnected"""
+        if frame.length < FRAME_HEADER.size + SNAPSHOT.size:
+            logger.error("Invalid snapshot frame size: %s", frame.length)
+            return
+        (count,) = SNAPSHOT.unpack_from(data, frame.offset + FRAME_HEADER.size)
+        if frame.kind == MSG_SNAPSHOT_BEGIN:
+            self._snapshot_keys = set()
+            return
+        if self._snapshot_keys is None:
+            return
+        stale = [key for key in self._live_icons if key not in self._snapshot_keys]
+        for key in stale:
+            self.icon_deleted.emit(self._live_icons.pop(key))
+        logger.debug("Systray hook snapshot: %s icons, %s removed", count, len(stale))
+        self._snapshot_keys = None
+
+    def _process_command_reply(self, frame: TrayFrame, data: bytes | memoryview) -> None:
+        """Hands the DLL's answer to the callback of the command with the same request id"""
+        if frame.length < FRAME_HEADER.size + COMMAND_REPLY.size:
+            logger.error("Invalid command reply frame size: %s", frame.length)
+            return
+        request_id, command, status, value = COMMAND_REPLY.unpack_from(data, frame.offset + FRAME_HEADER.size)
+        with self._command_lock:
+            callback = self._pending_commands.pop(request_id, None)
+        if status != COMMAND_OK:
+            logger.warning("Systray hook refused command %s (status %s)", command, status)
+        if callback is not None:
+            callback(CommandReply(command, status, value))
+
+    def _process_stats(self, frame: TrayFrame, data: bytes | memoryview) -> None:
+        """Keeps the DLL backpressure and resource counters and reports anything it had to drop"""
+        if frame.length < FRAME_HEADER.size + STATS.size:
+            logger.error("Invalid stats frame size: %s", frame.length)
+            return
+        counters = STATS.unpack_from(data, frame.offset + FRAME_HEADER.size)
+        if frame.length >= FRAME_HEADER.size + STATS.size + STATS_RESOURCES.size:
+            # Appended by newer DLLs
+            counters += STATS_RESOURCES.unpack_from(data, frame.offset + FRAME_HEADER.size + STATS.size)
+        stats = HookStats(*counters)
+        previous, self.hook_stats = self.hook_stats, stats
+        if stats.events_dropped > previous.events_dropped or stats.frames_dropped > previous.frames_dropped:
+            logger.warning(
+                "Systray hook dropped %s tray messages and %s frames while YASB was busy",
+                stats.events_dropped - previous.events_dropped,
+                stats.frames_dropped - previous.frames_dropped,
+            )
+        logger.debug("Systray hook stats: %s", stats)
 
-            header_fmt = "=IQIIII"  # type, dwData, cbData, iconWidth, iconHeight, iconDataSize
-            header_size = struct.calcsize(header_fmt)
-            _type, _dw_data, cb_data, icon_w, icon_h, icon_data_size = struct.unpack_from(header_fmt, data_bytes)
-
-            # Payload
-            cursor = header_size
-            payload = data_bytes[cursor : cursor + cb_data]
-
-            # Use ctypes to cast payload
-            tray_message = SHELLTRAYDATA.from_buffer_copy(payload)
-            icon_data: NOTIFYICONDATA = tray_message.icon_data
-
-            # Icon
-            icon = None
-            if icon_data_size > 0:
-                cursor += cb_data
-                rgba_bytes = data_bytes[cursor : cursor + icon_data_size]
-                icon = Image.frombytes("RGBA", (icon_w, icon_h), bytes(rgba_bytes))  # type: ignore
-
-            if tray_message.message_type in {NIM_ADD, NIM_MODIFY, NIM_SETVERSION}:
-                validated_data = validate_icon_data(icon_data, icon)
-                validated_data.message_type = tray_message.message_type
-                self.icon_modified.emit(validated_data)
-            elif tray_message.message_type == NIM_DELETE:
-                self.icon_deleted.emit(
-                    IconData(
-                        hWnd=icon_data.hWnd,
-                        uID=icon_data.uID,
-                        guid=icon_data.guidItem.to_uuid() if icon_data.uFlags & NIF_GUID else None,
-                    )
-                )
+    def _process_metrics(self, frame: TrayFrame, data: bytes | memoryview) -> None:
+        """Turns the DLL's cumulative stage histograms into percentiles over the interval since the last report"""
+        if frame.length < FRAME_HEADER.size + METRICS.size:
+            logger.error("Invalid metrics frame size: %s", frame.length)
+            return
+        (stage_count,) = METRICS.unpack_from(data, frame.offset + FRAME_HEADER.size)
+        if frame.length < FRAME_HEADER.size + METRICS.size + stage_count * STAGE_HISTOGRAM.size:
+            logger.error("Metrics frame too short for %s stages: %s", stage_count, frame.length)
+            return
+        cursor = frame.offset + FRAME_HEADER.size + METRICS.size
+        # Stages a newer DLL added are skipped
+        for name in METRIC_STAGES[:stage_count]:
+            _count, max_ns, _total_ns, *buckets = STAGE_HISTOGRAM.unpack_from(data, cursor)
+            cursor += STAGE_HISTOGRAM.size
+            previous = self._latency_buckets.get(name)
+            interval = buckets
+            if previous is not None and all(now >= before for now, before in zip(buckets, previous)):
+                interval = [now - before for now, before in zip(buckets, previous)]
+            self._latency_buckets[name] = buckets
+            self.hook_latency[name] = StageLatency(
+                sum(interval),
+                histogram_percentile(interval, 0.5, max_ns),
+                histogram_percentile(interval, 0.99, max_ns),
+                max_ns,
+            )
+        logger.debug(
+            "Systray hook latency: %s",
+            ", ".join(
+                f"{name} p50 {latency.p50_ns / 1000:.1f}us p99 {latency.p99_ns / 1000:.1f}us ({latency.count})"
+                for name, latency in self.hook_latency.items()
+            ),
+        )
+
+    def _cache_icon(self, icon_hash: int, images: list[QImage]) -> None:
+        """Remember a converted icon by its DLL content hash"""
+        self._icon_cache[icon_hash] = images
+        self._icon_cache.move_to_end(icon_hash)
+        while len(self._icon_cache) > ICON_CACHE_SIZE:
+            self._icon_cache.popitem(last=False)
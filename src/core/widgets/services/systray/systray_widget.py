@@ -223,6 +223,13 @@ class IconWidget(QPushButton):
             return
         if self.enable_tooltips:
             set_tooltip(self, self.data.szTip or self.data.exe, delay=50)
+        if self.data.icon_mips:
+            # One pixmap per mip, Qt draws the one matching the device pixel ratio of the screen the widget is on
+            qicon = QIcon()
+            for image in self.data.icon_mips:
+                qicon.addPixmap(QPixmap.fromImage(image))
+            self.setIcon(qicon)
+            return
         icon = self.data.icon_image
         if icon:
             self.setIcon(QIcon(QPixmap.fromImage(icon)))
@@ -0,0 +1,515 @@
+"""Wire format of the systray hook pipe, mirrors hook/tray_protocol.h"""
+
+import ctypes
+import math
+import struct
+import time
+from collections.abc import Iterable
+from dataclasses import dataclass
+from typing import NamedTuple
+from uuid import UUID
+
+from core.utils.win32.constants import NIF_GUID, NIF_ICON, NIF_INFO, NIF_MESSAGE, NIF_STATE, NIF_TIP
+from core.utils.win32.structs import NOTIFYICONDATA, SHELLTRAYDATA
+
+try:
+    # Optional native decoders built from hook/trayproto_module.cpp, the pure Python ones below are the fallback
+    from core.widgets.services.systray import _trayproto
+except ImportError:
+    _trayproto = None
+
+PROTOCOL_MAGIC = 0x59525459  # "YTRY"
+PROTOCOL_VERSION = 1
+
+# Frame kinds
+MSG_HELLO = 1
+MSG_HELLO_ACK = 2
+MSG_TEXT = 3
+MSG_TRAY_EVENT = 4
+MSG_ICON_REF = 5
+MSG_BATCH = 6
+MSG_STATS = 7
+MSG_SNAPSHOT_BEGIN = 8
+MSG_SNAPSHOT_END = 9
+MSG_ICON_DELTA = 10
+MSG_METRICS = 11
+MSG_RECORD = 12
+MSG_FILTER = 13
+MSG_COMMAND = 14
+MSG_COMMAND_REPLY = 15
+
+# Capability bits
+CAP_ICON_REF = 0x00000001
+CAP_BATCH = 0x00000002
+CAP_SHM_RING = 0x00000004
+CAP_SCALED_ICONS = 0x00000008
+CAP_SPAN_CODEC = 0x00000010
+CAP_ICON_DELTA = 0x00000020
+CAP_COMPACT_NID = 0x00000040
+CAP_METRICS = 0x00000080
+CAP_RECORD = 0x00000100
+CAP_FILTER = 0x00000200
+CAP_COMMAND = 0x00000400
+
+MAX_ICON_SIZES = 4
+
+# Capabilities this host implements, the hook only uses the ones echoed back in the hello ack
+HOST_CAPABILITIES = (
+    CAP_ICON_REF
+    | CAP_BATCH
+    | CAP_SHM_RING
+    | CAP_SCALED_ICONS
+    | CAP_SPAN_CODEC
+    | CAP_ICON_DELTA
+    | CAP_COMPACT_NID
+    | CAP_METRICS
+    | CAP_RECORD
+    | CAP_FILTER
+    | CAP_COMMAND
+)
+
+# Hook stages timed in METRICS frames, in the order of their histograms (TRAY_STAGE_* in hook/tray_protocol.h)
+METRIC_STAGES = ("copydata", "wndproc", "icon_extract", "frame_build", "pipe_write")
+HISTOGRAM_BUCKETS = 96
+RECORD_PATH_CAPACITY = 260
+# Limits of a FILTER frame, the hook ignores entries past them
+FILTER_MAX_GUIDS = 32
+FILTER_MAX_ICONS = 64
+FILTER_MAX_EXES = 64
+FILTER_MAX_EXE_LENGTH = 64  # UTF-16 units of an image name, terminator included
+
+# Commands of a COMMAND frame, each answered by a COMMAND_REPLY with the same request id
+COMMAND_PING = 1  # replies with the value unchanged
+COMMAND_SNAPSHOT = 2  # streams the hook's icon table, replies with the icon count
+COMMAND_STATS = 3  # sends STATS, and METRICS with CAP_METRICS, before the reply
+COMMAND_COALESCE_WINDOW = 4  # value replaces the NIM_MODIFY coalescing window in ms, replies with the old one
+COMMAND_ICON_SIZES = 5  # replaces the CAP_SCALED_ICONS sizes, a snapshot follows, replies with the sizes taken
+MAX_COALESCE_WINDOW_MS = 1000  # longer windows are cut to it in HELLO_ACK and COMMAND_INVALID as a command
+
+# Status of a COMMAND_REPLY
+COMMAND_OK = 0
+COMMAND_UNKNOWN = 1  # the hook predates the command
+COMMAND_INVALID = 2  # arguments out of range, or the command needs a capability the host did not accept
+
+# Hello flags
+HELLO_SNAPSHOT = 0x00000001  # a snapshot of every live icon follows the handshake
+ACK_FILTER = 0x00000001  # a FILTER frame follows the hello ack, the DLL applies it before its snapshot
+
+# Shared memory transport names, formatted with the hook's process id
+SHM_RING_NAME = "Local\\yasb_systray_ring_{pid}"
+SHM_EVENT_NAME = "Local\\yasb_systray_ring_event_{pid}"
+
+FRAME_HEADER = struct.Struct("<IHHIIQ")  # magic, version, kind, length, sequence, timestamp
+HELLO = struct.Struct("<II")  # capabilities, processId
+HELLO_FLAGS = struct.Struct("<I")  # flags, appended after HELLO
+HELLO_ACK = struct.Struct("<III4HI")  # capabilities, coalesceWindowMs, ringSize, iconSizes, flags
+TRAY_EVENT = struct.Struct("<QIIIIQ")  # dwData, cbData, iconWidth, iconHeight, iconDataSize, iconHash
+ICON_IMAGE = struct.Struct("<HHI")  # width, height, size, followed by premultiplied RGBA pixels
+ICON_SPAN = struct.Struct("<HH")  # zeros, literals, followed by that many RGBA pixels
+ICON_DELTA = struct.Struct("<QHH")  # baseHash, tileSize, imageCount, followed by an ICON_IMAGE of tiles per image
+ICON_TILE = struct.Struct("<HH")  # tile column, tile row, followed by the tile's RGBA rows
+BATCH = struct.Struct("<I")  # count, followed by that many complete frames
+# eventsDropped, framesDropped, modifiesDropped, modifiesCoalesced, backpressureEvents, queueHighWater
+STATS = struct.Struct("<6I")
+# heapAllocations, gdiObjectsCreated, frameSlabMisses, gdiObjects, userObjects, appended after STATS
+STATS_RESOURCES = struct.Struct("<5I")
+SNAPSHOT = struct.Struct("<I")  # count of NIM_ADD tray events between SNAPSHOT_BEGIN and SNAPSHOT_END
+# dwSignature, dwMessage, hWnd, uID, uFlags, uVersion, followed by the fields named in uFlags
+COMPACT_TRAY_DATA = struct.Struct("<6I")
+COMPACT_GUID = struct.Struct("<IHH8s")  # TrayGuid
+METRICS = struct.Struct("<I")  # stageCount, followed by that many STAGE_HISTOGRAM
+STAGE_HISTOGRAM = struct.Struct(f"<IIQ{HISTOGRAM_BUCKETS}I")  # count, maxNs, totalNs, buckets
+RECORD = struct.Struct(f"<I{RECORD_PATH_CAPACITY * 2}s")  # maxBytes (0 stops), NUL-terminated UTF-16 trace path
+# guidCount, iconCount, exeCount, followed by the GUIDs, FILTER_ICON pairs and counted UTF-16 image names
+FILTER = struct.Struct("<III")
+FILTER_ICON = struct.Struct("<II")  # hWnd, uID
+COMMAND = struct.Struct(f"<III{MAX_ICON_SIZES}H")  # requestId, command, value, iconSizes (COMMAND_ICON_SIZES only)
+COMMAND_REPLY = struct.Struct("<IIII")  # requestId, command, status, value
+
+
+@dataclass
+class FrameHeader:
+    kind: int
+    length: int
+    sequence: int
+    timestamp: int
+
+
+class TrayEvent(NamedTuple):
+    """A tray message decoded from a TRAY_EVENT, ICON_REF or ICON_DELTA frame"""
+
+    message: int  # NIM_*
+    hwnd: int
+    uid: int
+    flags: int  # NIF_*, the fields below only mean something with their flag
+    version: int
+    callback_message: int
+    hicon: int
+    state: int
+    state_mask: int
+    guid: bytes | None  # bytes_le of guidItem, None without NIF_GUID
+    tip: str
+    info: str
+    info_title: str
+    info_flags: int
+    icon_hash: int
+    icon_offset: int  # of the icon data in the message
+    icon_size: int
+    # (width, height, pixels) of a TRAY_EVENT icon, largest first, None without pixels or if malformed. Premultiplied
+    # for QImage with CAP_SCALED_ICONS, else the one straight RGBA image as the application drew it.
+    images: list[tuple[int, int, bytes | bytearray | memoryview]] | None
+
+
+class TrayFrame(NamedTuple):
+    """A frame of a pipe message, batches are flattened"""
+
+    kind: int
+    sequence: int
+    timestamp: int  # microseconds on the hook's QPC clock
+    offset: int  # of the frame header in the message
+    length: int  # of the frame, header included
+    event: TrayEvent | None  # of a TRAY_EVENT, ICON_REF or ICON_DELTA frame, None for other kinds or if malformed
+
+
+@dataclass
+class HookStats:
+    """Backpressure and resource counters of the hook, cumulative since it was injected except the object counts"""
+
+    events_dropped: int = 0
+    frames_dropped: int = 0
+    modifies_dropped: int = 0
+    modifies_coalesced: int = 0
+    backpressure_events: int = 0
+    queue_high_water: int = 0
+    heap_allocations: int = 0
+    gdi_objects_created: int = 0
+    frame_slab_misses: int = 0
+    gdi_objects: int = 0  # held by explorer.exe when the DLL sent the stats
+    user_objects: int = 0
+
+
+@dataclass
+class CommandReply:
+    """Answer of the hook to a COMMAND frame"""
+
+    command: int
+    status: int  # COMMAND_OK, COMMAND_UNKNOWN or COMMAND_INVALID
+    value: int
+
+
+@dataclass
+class StageLatency:
+    """
+    Latency of one hook stage in nanoseconds, percentiles are bucket upper bounds over the last report interval,
+    clamped to max_ns
+    """
+
+    count: int = 0
+    p50_ns: int = 0
+    p99_ns: int = 0
+    max_ns: int = 0  # since the hook was injected
+
+
+def read_frame_header(data: bytes | memoryview, offset: int = 0, min_length: int = 0) -> FrameHeader | None:
+    """Validates the frame at offset, returns None if it is truncated or speaks another protocol"""
+    if len(data) - offset < FRAME_HEADER.size:
+        return None
+    magic, version, kind, length, sequence, timestamp = FRAME_HEADER.unpack_from(data, offset)
+    if magic != PROTOCOL_MAGIC or version != PROTOCOL_VERSION:
+        return None
+    if length < max(FRAME_HEADER.size, min_length) or length > len(data) - offset:
+        return None
+    return FrameHeader(kind, length, sequence, timestamp)
+
+
+def is_legacy_message(data: bytes | memoryview) -> bool:
+    """True for messages of the unversioned format used before the framed protocol (type 1-3 header)"""
+    return len(data) >= 4 and struct.unpack_from("<I", data)[0] in {1, 2, 3}
+
+
+def pack_frame(kind: int, payload: bytes, sequence: int = 0) -> bytes:
+    """Prefixes payload with a frame header, the timestamp uses the same QPC clock as the hook"""
+    length = FRAME_HEADER.size + len(payload)
+    timestamp = time.perf_counter_ns() // 1000
+    return FRAME_HEADER.pack(PROTOCOL_MAGIC, PROTOCOL_VERSION, kind, length, sequence, timestamp) + payload
+
+
+def pack_icon_filter(guids: Iterable[UUID], icons: Iterable[tuple[int, int]], exes: Iterable[str]) -> bytes:
+    """
+    FILTER payload for icons to send without pixels, by GUID, (hWnd, uID) or image name without extension.
+    Entries past the hook's limits and names it could never match are left out.
+    """
+    guid_entries = [guid.bytes_le for guid in guids][:FILTER_MAX_GUIDS]
+    icon_entries = [FILTER_ICON.pack(hwnd & 0xFFFFFFFF, uid & 0xFFFFFFFF) for hwnd, uid in icons][:FILTER_MAX_ICONS]
+    exe_entries = []
+    for exe in exes:
+        encoded = exe.lower().encode("utf-16-le")
+        if 0 < len(encoded) < FILTER_MAX_EXE_LENGTH * 2 and len(exe_entries) < FILTER_MAX_EXES:
+            exe_entries.append(struct.pack("<H", len(encoded) // 2) + encoded)
+    header = FILTER.pack(len(guid_entries), len(icon_entries), len(exe_entries))
+    return header + b"".join(guid_entries + icon_entries + exe_entries)
+
+
+def histogram_bucket_low(bucket: int) -> int:
+    """Smallest latency in nanoseconds of a METRICS histogram bucket, mirrors TrayHistogramBucketLow"""
+    if bucket < 4:
+        return bucket << 6
+    return (4 + bucket % 4) << (bucket // 4 + 5)
+
+
+def histogram_percentile(buckets: list[int], fraction: float, max_ns: int) -> int:
+    """
+    Upper bound in nanoseconds of the bucket holding the given fraction of the samples, 0 without samples.
+    Never above max_ns, so a percentile in the last bucket does not read past the slowest sample.
+    """
+    rank = math.ceil(sum(buckets) * fraction)
+    running = 0
+    for bucket, count in enumerate(buckets):
+        running += count
+        if count and running >= rank:
+            return min(histogram_bucket_low(bucket + 1), max_ns)
+    return 0
+
+
+def wide_text(units: ctypes.Array[ctypes.c_uint16]) -> str:
+    """Text of a NUL-terminated WCHAR field, decoded from its buffer in one pass instead of per unit"""
+    return bytes(units).decode("utf-16-le", "replace").partition("\0")[0].replace("\r", "")
+
+
+def decode_icon_spans(data: bytes | memoryview, offset: int, size: int, pixel_count: int) -> bytearray | None:
+    """
+    Expands span coded icon pixels (hook/icon_codec.h) into pixel_count RGBA pixels.
+    Returns None if the spans are malformed.
+    """
+    raw_size = pixel_count * 4
+    pixels = bytearray(raw_size)
+    end = offset + size
+    cursor = 0
+    while offset < end:
+        if end - offset < ICON_SPAN.size:
+            return None
+        zeros, literals = ICON_SPAN.unpack_from(data, offset)
+        offset += ICON_SPAN.size
+        cursor += zeros * 4
+        literal_size = literals * 4
+        if cursor + literal_size > raw_size or offset + literal_size > end:
+            return None
+        # Slice assignment copies each run in one go
+        pixels[cursor : cursor + literal_size] = data[offset : offset + literal_size]
+        cursor += literal_size
+        offset += literal_size
+    return pixels
+
+
+def apply_icon_tiles(
+    pixels: memoryview, width: int, height: int, tile_size: int, data: bytes | memoryview, offset: int, size: int
+) -> bool:
+    """Copies the tiles of an icon delta (hook/icon_codec.h) into width x height RGBA pixels, False if malformed"""
+    stride = width * 4
+    end = offset + size
+    while offset < end:
+        if end - offset < ICON_TILE.size:
+            return False
+        column, row = ICON_TILE.unpack_from(data, offset)
+        offset += ICON_TILE.size
+        left, top = column * tile_size, row * tile_size
+        if left >= width or top >= height:
+            return False
+        row_size = min(tile_size, width - left) * 4
+        rows = min(tile_size, height - top)
+        if end - offset < rows * row_size:
+            return False
+        target = top * stride + left * 4
+        for _ in range(rows):
+            pixels[target : target + row_size] = data[offset : offset + row_size]
+            target += stride
+            offset += row_size
+    return True
+
+
+def read_icon_images(
+    data: bytes | memoryview, offset: int, size: int, span_codec: bool
+) -> list[tuple[int, int, bytes | bytearray | memoryview]] | None:
+    """
+    Splits the images of a scaled icon into (width, height, RGBA pixels), expanding span coded ones.
+    Returns None if there are none or one is malformed.
+    """
+    images: list[tuple[int, int, bytes | bytearray | memoryview]] = []
+    end = offset + size
+    while end - offset >= ICON_IMAGE.size:
+        width, height, image_size = ICON_IMAGE.unpack_from(data, offset)
+        offset += ICON_IMAGE.size
+        raw_size = width * height * 4
+        if image_size > raw_size or offset + image_size > end:
+            return None
+        if image_size == raw_size:
+            pixels = data[offset : offset + raw_size]
+        elif not span_codec or (pixels := decode_icon_spans(data, offset, image_size, width * height)) is None:
+            return None
+        images.append((width, height, pixels))
+        offset += image_size
+    return images or None
+
+
+def decode_compact_tray_data(data: bytes | memoryview, offset: int, size: int) -> SHELLTRAYDATA | None:
+    """
+    Rebuilds the SHELLTRAYDATA of a compact tray event payload (TrayCompactTrayData in hook/tray_protocol.h).
+    Fields without their NIF_* flag stay zero. Returns None if the payload is malformed.
+    """
+    if _trayproto is not None:
+        expanded = _trayproto.expand_compact_tray_data(data, offset, size)
+        return SHELLTRAYDATA.from_buffer_copy(expanded) if expanded is not None else None
+    payload = bytes(data[offset : offset + size])
+    try:
+        signature, message, hwnd, uid, flags, version = COMPACT_TRAY_DATA.unpack_from(payload)
+        cursor = COMPACT_TRAY_DATA.size
+        tray_data = SHELLTRAYDATA()
+        tray_data.magic_number = signature
+        tray_data.message_type = message
+        nid: NOTIFYICONDATA = tray_data.icon_data
+        nid.cbSize = ctypes.sizeof(NOTIFYICONDATA)
+        nid.hWnd, nid.uID, nid.uFlags = hwnd, uid, flags
+        nid.anonymous.uVersion = version
+
+        def read_u32() -> int:
+            nonlocal cursor
+            (value,) = struct.unpack_from("<I", payload, cursor)
+            cursor += 4
+            return value
+
+        def read_text(target: ctypes.Array[ctypes.c_uint16]) -> None:
+            nonlocal cursor
+            (count,) = struct.unpack_from("<H", payload, cursor)
+            if count >= len(target):
+                raise ValueError("compact string longer than its field")
+            target[:count] = struct.unpack_from(f"<{count}H", payload, cursor + 2)
+            cursor += 2 + count * 2
+
+        if flags & NIF_MESSAGE:
+            nid.uCallbackMessage = read_u32()
+        if flags & NIF_ICON:
+            nid.hIcon = read_u32()
+        if flags & NIF_TIP:
+            read_text(nid.szTip)
+        if flags & NIF_STATE:
+            nid.dwState = read_u32()
+            nid.dwStateMask = read_u32()
+        if flags & NIF_INFO:
+            read_text(nid.szInfo)
+            read_text(nid.szInfoTitle)
+            nid.dwInfoFlags = read_u32()
+            nid.hBalloonIcon = read_u32()
+        if flags & NIF_GUID:
+            # TrayGuid has the memory layout of GUID
+            guid = payload[cursor : cursor + COMPACT_GUID.size]
+            if len(guid) != COMPACT_GUID.size:
+                raise ValueError("compact GUID cut short")
+            ctypes.memmove(ctypes.addressof(nid.guidItem), guid, COMPACT_GUID.size)
+            cursor += COMPACT_GUID.size
+    except struct.error, ValueError:
+        return None
+    return tray_data if cursor == len(payload) else None
+
+
+def read_icon_pixels(
+    data: bytes | memoryview, offset: int, size: int, width: int, height: int, span_codec: bool
+) -> bytes | bytearray | memoryview | None:
+    """Straight RGBA pixels of an unscaled icon, expanded if the DLL span coded them (sent smaller than raw)"""
+    raw_size = width * height * 4
+    if size >= raw_size:
+        return data[offset : offset + raw_size]
+    if not span_codec:
+        return None
+    return decode_icon_spans(data, offset, size, width * height)
+
+
+def read_tray_event(
+    data: bytes | memoryview, offset: int, kind: int, length: int, capabilities: int
+) -> TrayEvent | None:
+    """Decodes the TRAY_EVENT, ICON_REF or ICON_DELTA frame at offset, None if it is malformed"""
+    if length < FRAME_HEADER.size + TRAY_EVENT.size:
+        return None
+    _dw_data, cb_data, icon_w, icon_h, icon_size, icon_hash = TRAY_EVENT.unpack_from(data, offset + FRAME_HEADER.size)
+    if FRAME_HEADER.size + TRAY_EVENT.size + cb_data + icon_size > length:
+        return None
+    cursor = offset + FRAME_HEADER.size + TRAY_EVENT.size
+    if capabilities & CAP_COMPACT_NID:
+        tray_data = decode_compact_tray_data(data, cursor, cb_data)
+        if tray_data is None:
+            return None
+    else:
+        # Shorter payloads of older NOTIFYICONDATA versions read as zero past their end
+        size = ctypes.sizeof(SHELLTRAYDATA)
+        tray_data = SHELLTRAYDATA.from_buffer_copy(bytes(data[cursor : cursor + min(cb_data, size)]).ljust(size, b"\0"))
+
+    nid: NOTIFYICONDATA = tray_data.icon_data
+    flags = nid.uFlags
+    icon_offset = cursor + cb_data
+    images = None
+    if kind == MSG_TRAY_EVENT and icon_size:
+        if capabilities & CAP_SCALED_ICONS:
+            images = read_icon_images(data, icon_offset, icon_size, bool(capabilities & CAP_SPAN_CODEC))
+        else:
+            span_codec = bool(capabilities & CAP_SPAN_CODEC)
+            pixels = read_icon_pixels(data, icon_offset, icon_size, icon_w, icon_h, span_codec)
+            images = [(icon_w, icon_h, pixels)] if pixels is not None else None
+    return TrayEvent(
+        tray_data.message_type,
+        nid.hWnd,
+        nid.uID,
+        flags,
+        nid.anonymous.uVersion,
+        nid.uCallbackMessage,
+        nid.hIcon,
+        nid.dwState,
+        nid.dwStateMask,
+        ctypes.string_at(ctypes.addressof(nid.guidItem), COMPACT_GUID.size) if flags & NIF_GUID else None,
+        wide_text(nid.szTip) if flags & NIF_TIP else "",
+        wide_text(nid.szInfo) if flags & NIF_INFO else "",
+        wide_text(nid.szInfoTitle) if flags & NIF_INFO else "",
+        nid.dwInfoFlags,
+        icon_hash,
+        icon_offset,
+        icon_size,
+        images,
+    )
+
+
+def parse_frames(data: bytes | memoryview, capabilities: int) -> tuple[list[TrayFrame], bool]:
+    """
+    Parses every frame of a pipe message in one pass, the frames of a batch in place and a nested batch as a frame
+    of its own. Tray events are decoded for the capabilities the hook was acknowledged.
+    The flag is False when a frame was truncated or invalid, the frames before it are still returned.
+    """
+    header = read_frame_header(data)
+    if header is None:
+        return [], False
+    if header.kind != MSG_BATCH:
+        return [_read_frame(data, 0, header, capabilities)], True
+    if header.length < FRAME_HEADER.size + BATCH.size:
+        return [], False
+    (count,) = BATCH.unpack_from(data, FRAME_HEADER.size)
+    data = data[: header.length]
+    offset = FRAME_HEADER.size + BATCH.size
+    frames: list[TrayFrame] = []
+    for _ in range(count):
+        sub_header = read_frame_header(data, offset)
+        if sub_header is None:
+            return frames, False
+        frames.append(_read_frame(data, offset, sub_header, capabilities))
+        offset += sub_header.length
+    return frames, True
+
+
+def _read_frame(data: bytes | memoryview, offset: int, header: FrameHeader, capabilities: int) -> TrayFrame:
+    event = None
+    if header.kind in {MSG_TRAY_EVENT, MSG_ICON_REF, MSG_ICON_DELTA}:
+        event = read_tray_event(data, offset, header.kind, header.length, capabilities)
+    return TrayFrame(header.kind, header.sequence, header.timestamp, offset, header.length, event)
+
+
+if _trayproto is not None:
+    decode_icon_spans = _trayproto.decode_icon_spans
+    apply_icon_tiles = _trayproto.apply_icon_tiles
+    read_icon_images = _trayproto.read_icon_images
+    parse_frames = _trayproto.parse_frames
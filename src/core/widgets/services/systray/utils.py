@@ -14,7 +14,7 @@ from ctypes.wintypes import (
     MSG,
     POINT,
 )
-from dataclasses import dataclass
+from dataclasses import dataclass, field
 from pathlib import Path
 from uuid import UUID
 
@@ -57,6 +57,7 @@ from core.utils.win32.constants import (
 )
 from core.utils.win32.structs import NOTIFYICONDATA, WNDCLASS, WNDPROC
 from core.utils.win32.utils import get_windows_host_arch
+from core.widgets.services.systray.tray_protocol import TrayEvent, wide_text
 from settings import IS_FROZEN
 
 logger = logging.getLogger("systray_widget")
@@ -86,6 +87,7 @@ class IconData:
     uCallbackMessage: int = 0
     uVersion: int = 0
     icon_image: QImage | None = None
+    icon_mips: list[QImage] = field(default_factory=list)  # every size the hook sent, largest first
     exe: str = ""
     exe_path: str = ""
 
@@ -191,26 +193,16 @@ def get_exe_path_from_hwnd(hwnd: int) -> str | None:
     return None
 
 
-def array_to_str(array: bytes) -> str:
-    null_pos = next((i for i, c in enumerate(array) if c == 0), len(array))
-    return "".join(chr(c) for c in array[:null_pos]).replace("\r", "")
-
-
-def validate_icon_data(data: NOTIFYICONDATA, icon: Image.Image | None = None) -> IconData:
+def validate_icon_data(data: NOTIFYICONDATA, icon: Image.Image | QImage | None = None) -> IconData:
     """
     Validates and processes raw icon data
-    Pre-processed icon can be also passed
+    Pre-processed icon can be also passed, a QImage is used as-is
     """
     icon_data = IconData()
     icon_data.hWnd = data.hWnd
     icon_data.uID = data.uID
     icon_data.uFlags = data.uFlags
 
-    exe_path = get_exe_path_from_hwnd(icon_data.hWnd)
-    if exe_path is not None:
-        icon_data.exe_path = exe_path
-        icon_data.exe = Path(exe_path).name.split(".")[0] if exe_path else ""
-
     if 0 < data.anonymous.uVersion <= 4:
         icon_data.uVersion = data.anonymous.uVersion
 
@@ -219,20 +211,9 @@ def validate_icon_data(data: NOTIFYICONDATA, icon: Image.Image | None = None) ->
 
     if data.uFlags & NIF_ICON:
         icon_data.hIcon = data.hIcon
-        if not icon:
-            icon_image = hicon_to_image(icon_data.hIcon)
-        else:
-            icon_image = icon
-        if icon_image is not None:
-            if icon_image.size != (32, 32):  # Ensure we have consistent icon sizes
-                icon_image = icon_image.resize((32, 32), Image.Resampling.LANCZOS).filter(SHARPEN)  # pyright: ignore [reportUnknownMemberType]
-            img_qt = ImageQt(icon_image)
-            icon_image = img_qt.copy()
-            del img_qt
-        icon_data.icon_image = icon_image
 
     if data.uFlags & NIF_TIP:
-        icon_data.szTip = array_to_str(data.szTip)
+        icon_data.szTip = wide_text(data.szTip)
 
     if data.uFlags & NIF_STATE:
         icon_data.dwState = data.dwState
@@ -243,8 +224,58 @@ def validate_icon_data(data: NOTIFYICONDATA, icon: Image.Image | None = None) ->
 
     if data.uFlags & NIF_INFO:
         icon_data.dwInfoFlags = data.dwInfoFlags
-        icon_data.szInfoTitle = array_to_str(data.szInfoTitle)
-        icon_data.szInfo = array_to_str(data.szInfo)
+        icon_data.szInfoTitle = wide_text(data.szInfoTitle)
+        icon_data.szInfo = wide_text(data.szInfo)
+
+    return _complete_icon_data(icon_data, icon)
+
+
+def icon_data_from_event(event: TrayEvent, flags: int, icon: Image.Image | QImage | None = None) -> IconData:
+    """
+    validate_icon_data for a tray message the hook pipe already decoded, flags replace the event's NIF_* flags
+    """
+    icon_data = IconData(hWnd=event.hwnd, uID=event.uid, uFlags=flags)
+    if 0 < event.version <= 4:
+        icon_data.uVersion = event.version
+    if flags & NIF_MESSAGE:
+        icon_data.uCallbackMessage = event.callback_message
+    if flags & NIF_ICON:
+        icon_data.hIcon = event.hicon
+    if flags & NIF_TIP:
+        icon_data.szTip = event.tip
+    if flags & NIF_STATE:
+        icon_data.dwState = event.state
+        icon_data.dwStateMask = event.state_mask
+    if flags & NIF_GUID and event.guid is not None:
+        icon_data.guid = UUID(bytes_le=event.guid)
+    if flags & NIF_INFO:
+        icon_data.dwInfoFlags = event.info_flags
+        icon_data.szInfoTitle = event.info_title
+        icon_data.szInfo = event.info
+    return _complete_icon_data(icon_data, icon)
+
+
+def _complete_icon_data(icon_data: IconData, icon: Image.Image | QImage | None) -> IconData:
+    """Looks up the owning executable and turns icon, or the hIcon without one, into a QImage"""
+    exe_path = get_exe_path_from_hwnd(icon_data.hWnd)
+    if exe_path is not None:
+        icon_data.exe_path = exe_path
+        icon_data.exe = Path(exe_path).name.split(".")[0] if exe_path else ""
+
+    if icon_data.uFlags & NIF_ICON:
+        if isinstance(icon, QImage):
+            icon_image = icon
+        elif not icon:
+            icon_image = hicon_to_image(icon_data.hIcon)
+        else:
+            icon_image = icon
+        if isinstance(icon_image, Image.Image):
+            if icon_image.size != (32, 32):  # Ensure we have consistent icon sizes
+                icon_image = icon_image.resize((32, 32), Image.Resampling.LANCZOS).filter(SHARPEN)  # pyright: ignore [reportUnknownMemberType]
+            img_qt = ImageQt(icon_image)
+            icon_image = img_qt.copy()
+            del img_qt
+        icon_data.icon_image = icon_image
 
     return icon_data
 
@@ -274,6 +274,10 @@ class SystrayWidget(BaseWidget):
 
         self.load_state()
         systray_client, systray_thread = SystrayWidget.get_monitor_instance(self.config.use_hook)
+        if isinstance(systray_client, SystrayHook):
+            systray_client.request_icon_size(self.config.icon_size)
+            # Icons this widget throws away anyway, the DLL skips their pixels when no other widget shows them
+            systray_client.request_icon_filter(self, self.hidden_icons_lower, self.filtered_guids)
 
         systray_client.icon_modified.connect(self.on_icon_modified)
         systray_client.icon_deleted.connect(self.on_icon_deleted)
@@ -479,6 +483,7 @@ class SystrayWidget(BaseWidget):
             "uID",
             "uFlags",
             "icon_image",
+            "icon_mips",
             "exe",
             "exe_path",
         ]